@@ -1360,6 +1360,69 @@ void LoadParameters(char *pszParamsFile,
                   sprintf(szParamStringVal, "%d", iIntParam);
                   pSearchMgr->SetParam("fragindex_min_matchedions", szParamStringVal, iIntParam);
                }
+               else if (!strcmp(szParamName, "fragindex_num_precursorbins"))
+               {
+                  sscanf(szParamVal, "%d", &iIntParam);
+                  sprintf(szParamStringVal, "%d", iIntParam);
+                  pSearchMgr->SetParam("fragindex_num_precursorbins", szParamStringVal, iIntParam);
+               }
+               else if (!strcmp(szParamName, "fragindex_compress"))
+               {
+                  sscanf(szParamVal, "%d", &iIntParam);
+                  sprintf(szParamStringVal, "%d", iIntParam);
+                  pSearchMgr->SetParam("fragindex_compress", szParamStringVal, iIntParam);
+               }
+               else if (!strcmp(szParamName, "fragindex_prune_precursors"))
+               {
+                  sscanf(szParamVal, "%d", &iIntParam);
+                  sprintf(szParamStringVal, "%d", iIntParam);
+                  pSearchMgr->SetParam("fragindex_prune_precursors", szParamStringVal, iIntParam);
+               }
+               else if (!strcmp(szParamName, "fragindex_num_partitions"))
+               {
+                  sscanf(szParamVal, "%d", &iIntParam);
+                  sprintf(szParamStringVal, "%d", iIntParam);
+                  pSearchMgr->SetParam("fragindex_num_partitions", szParamStringVal, iIntParam);
+               }
+               else if (!strcmp(szParamName, "fragindex_share"))
+               {
+                  sscanf(szParamVal, "%d", &iIntParam);
+                  sprintf(szParamStringVal, "%d", iIntParam);
+                  pSearchMgr->SetParam("fragindex_share", szParamStringVal, iIntParam);
+               }
+               else if (!strcmp(szParamName, "peptide_index_memory"))
+               {
+                  sscanf(szParamVal, "%d", &iIntParam);
+                  sprintf(szParamStringVal, "%d", iIntParam);
+                  pSearchMgr->SetParam("peptide_index_memory", szParamStringVal, iIntParam);
+               }
+               else if (!strcmp(szParamName, "peptide_index_decode_mods"))
+               {
+                  sscanf(szParamVal, "%d", &iIntParam);
+                  sprintf(szParamStringVal, "%d", iIntParam);
+                  pSearchMgr->SetParam("peptide_index_decode_mods", szParamStringVal, iIntParam);
+               }
+               else if (!strcmp(szParamName, "peptide_index_cache_dir"))
+               {
+                  char szDir[SIZE_FILE];
+
+                  // Remove white spaces at beginning/end of szParamVal
+                  int iLen = (int)strlen(szParamVal);
+                  char *szTrimmed = szParamVal;
+
+                  while (iLen > 0 && isspace(szTrimmed[iLen -1]))  // trim end
+                     szTrimmed[--iLen] = 0;
+                  while (*szTrimmed && isspace(*szTrimmed))  // trim beginning
+                  {
+                     ++szTrimmed;
+                     --iLen;
+                  }
+
+                  memmove(szParamVal, szTrimmed, iLen+1);
+
+                  strcpy(szDir, szParamVal);
+                  pSearchMgr->SetParam("peptide_index_cache_dir", szDir, szDir);
+               }
                else
                {
                   sprintf(szErrorMsg, " Warning - invalid parameter found: %s.  Parameter will be ignored.\n", szParamName);
@@ -1660,21 +1723,27 @@ void PrintParams(void)
    fprintf(fp,
 "\n\
 database_name = /some/path/db.fasta\n\
+peptide_index_memory = 0               # MB of digested peptides held in memory while creating the .idx file (-i); more are sorted in run files; 0=no limit\n\
+peptide_index_decode_mods = 0          # 0=store every modification number in the .idx file (-i), 1=store only their counts and decode them when used (smaller .idx, slower)\n\
+peptide_index_cache_dir =              # search a fasta database through the .idx file kept in this directory for the current parameters, creating it when needed; blank=off\n\
 decoy_search = 0                       # 0=no (default), 1=internal decoy concatenated, 2=internal decoy separate\n\
 \n\
 num_threads = 0                        # 0=poll CPU to set num threads; else specify num threads directly (max %d)\n\n", MAX_THREADS);
 
-/*
    fprintf(fp,
 "#\n\
 # fragment index\n\
 #\n\
-fragindex_min_fragmentmass = 3         # minimum number of matched fragment ion index peaks for xcorr\n\
-fragindex_num_spectrumpeaks = 100      # number of peaks from spectrum to use for fragment index matching\n\
+fragindex_min_fragmentmass = 200.0     # low mass cutoff for fragment ions\n\
+fragindex_max_fragmentmass = 2000.0    # high mass cutoff for fragment ions\n\
+fragindex_min_matchedions = 3          # minimum number of matched fragment ion index peaks for xcorr\n\
+fragindex_num_spectrumpeaks = 150      # number of peaks from spectrum to use for fragment index matching\n\
 fragindex_max_peptidesscored = 100     # xcorr score up to this many peptides per spectrum query\n\
-fragindex_min_matchedions = 200.0      # low mass cutoff for fragment ions\n\
-fragindex_max_fragmentmass = 2000.0    # high mass cutoff for fragment ions\n\n");
-*/
+fragindex_num_precursorbins = 300      # number of precursor mass bins, each holding an equal share of peptides; the default is lowered for small indexes built at search time\n\
+fragindex_compress = 0                 # 0=plain fragment index lists, 1=delta encoded bit-packed lists (smaller on large indexes, slower); an index built at search time keeps plain lists if they are smaller\n\
+fragindex_prune_precursors = 0         # 0=use .idx.frag file if present, 1=always build index only for peptides matching input precursors\n\
+fragindex_num_partitions = 1           # build the .idx.frag file (-i) in this many precursor mass partitions to bound memory use\n\
+fragindex_share = 0                    # 0=build index in memory if no matching .idx.frag file, 1=write it once and map it, shared by concurrent searches\n\n");
 
    fprintf(fp,
 "#\n\
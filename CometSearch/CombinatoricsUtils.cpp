@@ -23,11 +23,15 @@ CombinatoricsUtils::CombinatoricsUtils()
 }
 
 int** BINOM_COEF; // array[N][K], partial Pascal's Triangle
+int** COMBINATION_COUNT; // array[N][K], getCombinationCount(n, k)
 int N = -1;
 int K = -1;
 
 void CombinatoricsUtils::initBinomialCoefficients(const int n, const int k)
 {
+   if (n <= N && k <= K)
+      return;  // already initialized
+
    N = n;
    K = k;
    BINOM_COEF = new int*[n + 1];
@@ -55,6 +59,15 @@ void CombinatoricsUtils::initBinomialCoefficients(const int n, const int k)
       BINOM_COEF[i] = coeffs;
    }
 
+   COMBINATION_COUNT = new int*[n + 1];
+   for (int i = 0; i <= n; ++i)
+   {
+      COMBINATION_COUNT[i] = new int[k + 1];
+      COMBINATION_COUNT[i][0] = 0;
+      for (int j = 1; j <= k; ++j)
+         COMBINATION_COUNT[i][j] = COMBINATION_COUNT[i][j - 1] + (j <= i ? BINOM_COEF[i][j] : 0);
+   }
+
    // for (int i = 0; i <= n; ++i)
    // {
    //    int* arr = BINOM_COEF[i];
@@ -195,6 +208,9 @@ int CombinatoricsUtils::nChooseK(const int n, const int k)
 
 int CombinatoricsUtils::getCombinationCount(int n, int k)
 {
+   if (n <= N && k <= K)
+      return COMBINATION_COUNT[n][k];
+
    int total = 0;
    if (k > n) k = n;
    for (; k >= 1; k--)
@@ -204,6 +220,28 @@ int CombinatoricsUtils::getCombinationCount(int n, int k)
    return total;
 }
 
+// Return the rank-th (0 based) of the n bit numbers with 1 to k bits set, in ascending
+// order.  Bit i of the result selects the i-th of n items; getCombinationCount(n, k) is
+// the number of such numbers.
+unsigned long long CombinatoricsUtils::getCombination(int n, int k, int rank)
+{
+   unsigned long long combination = 0ULL;
+   int remaining = rank + 1;  // rank among the numbers including 0
+
+   for (int i = n - 1; i >= 0 && k > 0; i--)
+   {
+      // the numbers with bit i clear come first: 0 plus those of the lower i bits
+      int count = 1 + getCombinationCount(i, k);
+      if (remaining >= count)
+      {
+         remaining -= count;
+         combination |= 1ULL << i;
+         k--;
+      }
+   }
+   return combination;
+}
+
 CombinatoricsUtils::~CombinatoricsUtils()
 {
 }
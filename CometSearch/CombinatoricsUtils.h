@@ -25,6 +25,7 @@ public:
    static int** makeCombinations(int n, int r, int count);
    static int nChooseK(int n, int k);
    static int getCombinationCount(int n, int k);
+   static unsigned long long getCombination(int n, int k, int rank);
    static void initBinomialCoefficients(const int n, const int k);
 };
 
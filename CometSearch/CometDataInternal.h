@@ -36,12 +36,15 @@ class CometSearchManager;
 #define FRAGINDEX_MAX_MASS          2000.0   // maximum fragment ion mass used to generate fragment index
 #define FRAGINDEX_MAX_THREADS       16       // not sure it makes sense to set this max limit
 #define FRAGINDEX_MAX_BATCHSIZE     2000     // maximum number of spectra loaded when querying fragment index
+#define FRAGINDEX_QUERY_BATCHSIZE   8        // number of mass sorted spectra that query the fragment index together
 #define FRAGINDEX_MAX_NUMPEAKS      150      // number of spectrum peaks used to query fragment index
 #define FRAGINDEX_MAX_NUMSCORED     100      // for each fragment index spectrum query, score up to this many peptides
 #define FRAGINDEX_MAX_COMBINATIONS  2000
 #define FRAGINDEX_MAX_MODS_PER_PEP  5
 #define FRAGINDEX_KEEP_ALL_PEPTIDES 1        // 1 = consider up to FRAGINDEX_MAX_COMBINATIONS of peptides; 0 = ignore all mods for peptide that exceed FRAGINDEX_MAX_COMBINATIONS
-#define FRAGINDEX_PRECURSORBINS     300      // bins for precursors, mass range of each bin will be (max_mass - min_mass)/FRAGINDEX_PRECURSORBINS
+#define FRAGINDEX_PRECURSORBINS     300      // default # of precursor bins; bin boundaries split the indexed peptides into equal counts
+#define FRAGINDEX_MAX_PRECURSORBINS 10000    // maximum fragindex_num_precursorbins
+#define FRAGINDEX_POSTINGBLOCKSIZE  64       // # of entries in each delta encoded block of a compressed fragment index list
 
 #define UNSET_TOLERANCE_MINUS       -99999.9 // default peptide_mass_tolerance_lower value; if this is not changed/set, use -(peptide_mass_tolerance)
 
@@ -55,6 +58,7 @@ class CometSearchManager;
 
 #define WIDTH_REFERENCE             512      // length of the protein accession field to store
 #define MAX_PROTEINS                50       // maximum number of proteins to return for each query; for index search only right now
+#define SEARCH_JOB_RESIDUES         10000    // residues packed into each search thread job; longer proteins are split across jobs
 
 #define HISTO_SIZE                  152      // some number greater than 150
 
@@ -143,6 +147,13 @@ struct Options             // output parameters
    int iFragIndexMinMatchedIons;
    int iFragIndexNumSpectrumPeaks;
    int iFragIndexMaxNumScored;
+   int iFragIndexNumPrecursorBins;
+   int bFragIndexCompress;       // store fragment index lists as delta encoded, bit-packed blocks
+   int bFragIndexPrunePrecursors; // build the fragment index only for peptides matching input precursors, ignoring .idx.frag
+   int iFragIndexNumPartitions;  // # of precursor mass partitions the .idx.frag file is built in
+   int bFragIndexShare;          // write a missing .idx.frag file and map it so concurrent searches share one copy
+   int iPeptideIndexMemory;      // MB of digested peptides held in memory while creating the .idx file; 0=no limit
+   int bPeptideIndexDecodeMods;  // store only the number of modification numbers in the .idx file and decode them when used
    long lMaxIterations;          // max # of modification permutations for each iStart position
    double dMinIntensity;         // intensity cutoff for each peak
    double dMinPercentageIntensity;  // intensity cutoff for each peak as % of base peak
@@ -217,6 +228,13 @@ struct Options             // output parameters
       iFragIndexMinMatchedIons = a.iFragIndexMinMatchedIons;      // minimum # of matched fragment ions peaks required to pass to xcorr
       iFragIndexNumSpectrumPeaks = a.iFragIndexNumSpectrumPeaks;  // # of peaks from spectrum to use for querying fragment index
       iFragIndexMaxNumScored = a.iFragIndexMaxNumScored;          // maximum # of peptides passed to xcorr for a spectrum
+      iFragIndexNumPrecursorBins = a.iFragIndexNumPrecursorBins;  // # of precursor mass bins the fragment index is split into
+      bFragIndexCompress = a.bFragIndexCompress;                  // compressed fragment index lists
+      bFragIndexPrunePrecursors = a.bFragIndexPrunePrecursors;    // query-aware fragment index
+      iFragIndexNumPartitions = a.iFragIndexNumPartitions;        // out-of-core .idx.frag build
+      bFragIndexShare = a.bFragIndexShare;                        // publish .idx.frag for other processes
+      iPeptideIndexMemory = a.iPeptideIndexMemory;                // external memory .idx creation
+      bPeptideIndexDecodeMods = a.bPeptideIndexDecodeMods;        // modification numbers decoded on demand
 
       return *this;
    }
@@ -235,7 +253,7 @@ struct Results
    int    iRankSp;
    int    iMatchedIons;
    int    iTotalIons;  
-   comet_fileoffset_t   lProteinFilePosition;  // for indexdb, this is the entry in g_pvProteinsList
+   comet_fileoffset_t   lProteinFilePosition;  // for indexdb, this is the peptide whose protein list to use
    long   lWhichProtein;
    int    piVarModSites[MAX_PEPTIDE_LEN_P2];   // store variable mods encoding, +2 to accomodate N/C-term
    double pdVarModSites[MAX_PEPTIDE_LEN_P2];   // store variable mods mass diffs, +2 to accomodate N/C-term
@@ -412,14 +430,14 @@ struct DBInfo
    }
 };
 
-// this duplicates PlainPeptideIndex but with fixed peptide char string for simplified binary write/read
+// peptide with fixed peptide char string for simplified binary write/read
 struct DBIndex
 {
    char   szPeptide[MAX_PEPTIDE_LEN];
    char   cPrevAA;
    char   cNextAA;
    char   pcVarModSites[MAX_PEPTIDE_LEN_P2]; // encodes 0-9 indicating which var mod at which position
-   comet_fileoffset_t   lIndexProteinFilePosition;         // points to entry in g_pvProteinsList
+   comet_fileoffset_t   lIndexProteinFilePosition;         // protein file position; protein list while creating .idx
    double dPepMass;                          // MH+ pep mass
 
    bool operator==(const DBIndex &rhs) const
@@ -452,28 +470,9 @@ struct DBIndex
    }
 };
 
-// This is used for fragment indexing; plain peptides are stored in index
-// file and read in to this data struct.  Same as DBIndex w/o pcVarModSites[]
-struct PlainPeptideIndex
-{
-   string sPeptide;
-   char   cPrevAA;
-   char   cNextAA;
-   comet_fileoffset_t   lIndexProteinFilePosition;  // points to entry in g_pvProteinsList
-   double dPepMass;                                 // MH+ pep mass, unmodified mass; modified mass in FragmentPeptidesStruct
-
-   bool operator==(const PlainPeptideIndex &rhs) const
-   {
-      if (!sPeptide.compare(rhs.sPeptide))
-         return true;
-      else
-      return false; // peptides are different
-   }
-};
-
 struct FragmentPeptidesStruct
 {
-   int iWhichPeptide;   // reference to raw peptide (sequence, proteins, etc.) in PlainPeptideIndex
+   int iWhichPeptide;   // reference to raw peptide (sequence, proteins, etc.) in the .idx file
    int modNumIdx;
    double dPepMass;     // peptide mass (modified or unmodified) after permuting mods
    short siNtermMod;
@@ -485,10 +484,46 @@ struct FragmentPeptidesStruct
    }
 };
 
-extern unsigned int** g_iFragmentIndex[FRAGINDEX_MAX_THREADS][FRAGINDEX_PRECURSORBINS];           // 4D array [thread][precursor_mass][BIN[fragment mass)][which entries in g_vFragmentPeptides]
-extern unsigned int* g_iCountFragmentIndex[FRAGINDEX_MAX_THREADS][FRAGINDEX_PRECURSORBINS];       // array of ints: [thread][precursor_mass][BIN(fragment mass)][which entries in g_vFragmentPeptides]
+// Fragment index in compressed sparse row layout.  Entries (which g_vFragmentPeptides) for
+// [precursor bin][BIN(fragment mass)] are g_uiFragmentIndex[g_ullFragmentIndexOffsets[i]] up to
+// g_ullFragmentIndexOffsets[i+1] where i = precursor bin * g_uiMaxFragmentArrayIndex + BIN(fragment mass)
+extern unsigned int* g_uiFragmentIndex;
+extern unsigned long long* g_ullFragmentIndexOffsets;
+extern float* g_fFragmentIndexPepMass;  // peptide mass of each g_uiFragmentIndex entry rounded to float; search key
+
+// Compressed fragment index (fragindex_compress = 1) replacing g_uiFragmentIndex and
+// g_fFragmentIndexPepMass.  g_vFragmentPeptides is in mass order so each list is in
+// increasing entry order.  List i is split into FRAGINDEX_POSTINGBLOCKSIZE entry blocks
+// g_ullFragmentIndexBlockOffsets[i] up to g_ullFragmentIndexBlockOffsets[i+1].  Each block
+// holds its first entry in g_uiFragmentIndexBlockFirst and, at g_ullFragmentIndexBlockPos
+// in g_ucFragmentIndexPacked, a byte with the bit width followed by the bit-packed deltas.
+extern unsigned long long* g_ullFragmentIndexBlockOffsets;
+extern unsigned int* g_uiFragmentIndexBlockFirst;
+extern unsigned long long* g_ullFragmentIndexBlockPos;
+extern unsigned char* g_ucFragmentIndexPacked;
 extern vector<struct FragmentPeptidesStruct> g_vFragmentPeptides;
-extern vector<PlainPeptideIndex> g_vRawPeptides;
+// Peptides the fragment index entries refer to: g_vFragmentPeptides for an index built
+// in memory, otherwise the peptides in the mapped .idx.frag file, used in place.
+extern FragmentPeptidesStruct* g_pFragmentPeptides;
+extern size_t g_tNumFragmentPeptides;
+
+// Plain peptide index (.idx file), used in place from the memory mapped file.  Peptides
+// are in mass order; peptide i is residues g_ullRawPeptideOffsets[i] up to
+// g_ullRawPeptideOffsets[i+1] of the 5 bit packed g_ucRawPeptideResidues, unpacked by
+// CometFragmentIndex::GetRawPeptide, and its proteins are the database file positions
+// g_lProteinListFilePositions[g_ullProteinListOffsets[i]] up to g_ullProteinListOffsets[i+1].
+extern size_t g_tNumRawPeptides;
+extern unsigned long long* g_ullRawPeptideOffsets;
+extern unsigned char* g_ucRawPeptideResidues;
+extern unsigned long long* g_ullProteinListOffsets;
+extern comet_fileoffset_t* g_lProteinListFilePositions;
+// Accessions of the database entries, so reporting the proteins of .idx search results
+// never reads the database: the entry at g_lProteinNameFilePositions[i] (ascending) has
+// the NUL terminated accession at g_szProteinNames + g_ullProteinNameOffsets[i].
+extern size_t g_tNumProteinNames;
+extern comet_fileoffset_t* g_lProteinNameFilePositions;
+extern unsigned long long* g_ullProteinNameOffsets;
+extern char* g_szProteinNames;
 extern bool *g_bIndexPrecursors;     // allocate an array of BIN(max_precursor, protonated) and use a bool to indicate if that precursor is present in input file(s)
 
 
@@ -683,6 +718,7 @@ struct StaticParams
    string          sDecoyPrefix;       // escaped version of szDecoyPrefix for output within XML files
    char            szOutputSuffix[256]; // used for suffix to append to output file base names
    char            szTxtFileExt[256];  // text file extension; default "txt"
+   char            szIndexCacheDir[SIZE_FILE]; // directory of .idx files searched in place of a fasta database; empty if not used
    int             iElapseTime;
    char            szDate[32];
    Options         options;
@@ -722,6 +758,7 @@ struct StaticParams
        strcpy(szDecoyPrefix, a.szDecoyPrefix);
        strcpy(szOutputSuffix, a.szOutputSuffix);
        strcpy(szTxtFileExt, a.szTxtFileExt);
+       strcpy(szIndexCacheDir, a.szIndexCacheDir);
        vectorMassOffsets = a.vectorMassOffsets;
        precursorNLIons= a.precursorNLIons;
        iPrecursorNLSize = a.iPrecursorNLSize;
@@ -761,6 +798,7 @@ struct StaticParams
       strcpy(szDecoyPrefix, "DECOY_");
       strcpy(szTxtFileExt, "txt");
       szOutputSuffix[0] = '\0';
+      szIndexCacheDir[0] = '\0';
 
       peffInfo.szPeffOBO[0] = '\0';
       peffInfo.iPeffSearch = 0;
@@ -900,6 +938,13 @@ struct StaticParams
       options.iFragIndexMinMatchedIons = FRAGINDEX_MIN_MATCHEDIONS;
       options.iFragIndexNumSpectrumPeaks = FRAGINDEX_MAX_NUMPEAKS;
       options.iFragIndexMaxNumScored = FRAGINDEX_MAX_NUMSCORED;
+      options.iFragIndexNumPrecursorBins = FRAGINDEX_PRECURSORBINS;
+      options.bFragIndexCompress = 0;
+      options.bFragIndexPrunePrecursors = 0;
+      options.iFragIndexNumPartitions = 1;
+      options.bFragIndexShare = 0;
+      options.iPeptideIndexMemory = 0;
+      options.bPeptideIndexDecodeMods = 0;
 
       options.clearMzRange.dStart = 0.0;
       options.clearMzRange.dEnd = 0.0;
@@ -933,26 +978,30 @@ extern map<long long, IndexProteinStruct>  g_pvProteinNames;
 
 extern vector<DBIndex> g_pvDBIndex;
 
-extern vector<vector<comet_fileoffset_t>> g_pvProteinsList;
-
-struct ModificationNumber
-{
-//   int modificationNumber;
-   int modStringLen;             // FIX: need to confirm if not needed  (MOD_SEQS.at(modSeqIdx)).size();
-   char* modifications;
-};
-
-extern vector<ModificationNumber> MOD_NUMBERS;
+// MOD_NUMBERS and MOD_SEQS are generated by ModificationsPermuter while creating the
+// .idx file; modification number i is MOD_NUMBERS from MOD_NUMBER_OFFSETS[i] up to
+// MOD_NUMBER_OFFSETS[i+1], with the modification of each residue of its modifiable
+// sequence.  Searches use them from the mapped file: modifiable sequence i is the NUL
+// terminated string at g_szModSeqs + g_ullModSeqOffsets[i] and modification number i
+// is the bytes of g_cModNumbers from g_ullModNumberOffsets[i] up to g_ullModNumberOffsets[i+1].
+// With peptide_index_decode_mods the modification numbers are not stored and g_cModNumbers
+// is NULL; modification number MOD_SEQ_MOD_NUM_START[i] + r of modifiable sequence i is
+// decoded by ModificationsPermuter::getModificationNumber(r).
+extern vector<char> MOD_NUMBERS;
+extern vector<unsigned long long> MOD_NUMBER_OFFSETS;
 extern vector<string> MOD_SEQS;    // Unique modifiable sequences.
-extern int* MOD_SEQ_MOD_NUM_START; // Start index in the MOD_NUMBERS vector for a modifiable sequence; -1 if no modification numbers were generated
+extern int* MOD_SEQ_MOD_NUM_START; // First modification number of a modifiable sequence; -1 if no modification numbers were generated
 extern int* MOD_SEQ_MOD_NUM_CNT;   // Total modifications numbers for a modifiable sequence.
+extern unsigned long long* g_ullModSeqOffsets;
+extern char* g_szModSeqs;
+extern unsigned long long* g_ullModNumberOffsets;
+extern char* g_cModNumbers;
 
-// Index into the MOD_SEQS vector
+// Index into the modifiable sequences
 // -1 for peptides that have no modifiable amino acids
 // -2 for peptides with no modifiable amino acids but contain n/c-term mods
 extern int* PEPTIDE_MOD_SEQ_IDXS;
 
-extern int MOD_NUM;
 extern bool g_bFragmentIndexRead;       // set to true when fragment index file is read
 extern bool g_bPlainPeptideIndexRead;   // set to true if plain peptide index file is read
 
@@ -1116,7 +1165,6 @@ extern vector<Query*>          g_pvQuery;
 extern vector<InputFileInfo*>  g_pvInputFiles;
 extern Mutex                   g_pvQueryMutex;
 extern Mutex                   g_preprocessMemoryPoolMutex;
-extern Mutex                   g_searchMemoryPoolMutex;
 extern Mutex                   g_dbIndexMutex;
 
 struct IonSeriesStruct         // defines which fragment ion series are considered
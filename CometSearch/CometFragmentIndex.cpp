@@ -25,16 +25,50 @@
 #include <stdio.h>
 #include <sstream>
 #include <bitset>
+#include <queue>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#endif
 
 
-vector<ModificationNumber> MOD_NUMBERS;
+vector<char> MOD_NUMBERS;
+vector<unsigned long long> MOD_NUMBER_OFFSETS;
 vector<string> MOD_SEQS;    // Unique modifiable sequences.
-int* MOD_SEQ_MOD_NUM_START; // Start index in the MOD_NUMBERS vector for a modifiable sequence; -1 if no modification numbers were generated
+int* MOD_SEQ_MOD_NUM_START; // First modification number of a modifiable sequence; -1 if no modification numbers were generated
 int* MOD_SEQ_MOD_NUM_CNT;   // Total modifications numbers for a modifiable sequence.
 int* PEPTIDE_MOD_SEQ_IDXS;  // Index into the MOD_SEQS vector; -1 for peptides that have no modifiable amino acids; -2 if only terminal mods.
-int MOD_NUM = 0;
 
-Mutex CometFragmentIndex::_vFragmentPeptidesMutex;
+vector<struct FragmentPeptidesStruct> CometFragmentIndex::_vThreadPeptides[FRAGINDEX_MAX_THREADS];
+vector<vector<unsigned int>> CometFragmentIndex::_vvuiThreadFragments[FRAGINDEX_MAX_THREADS];
+vector<unsigned long long> CometFragmentIndex::_vullThreadFragmentEnd[FRAGINDEX_MAX_THREADS];
+unsigned int* CometFragmentIndex::_puiFragmentPeptideOrder = NULL;
+unsigned int CometFragmentIndex::_uiThreadPeptideStart[FRAGINDEX_MAX_THREADS + 1];
+vector<size_t> CometFragmentIndex::_vtPrecursorBinFirstPeptide;
+bool CometFragmentIndex::_bPeptidesOnly = false;
+int CometFragmentIndex::_iPartitionFirstBin = 0;
+int CometFragmentIndex::_iPartitionEndBin = 0;
+double CometFragmentIndex::_dPartitionMassLow = 0.0;
+double CometFragmentIndex::_dPartitionMassHigh = 0.0;
+size_t CometFragmentIndex::_tPartitionFirstPeptide = 0;
+unsigned long long CometFragmentIndex::_ullPartitionFirstEntry = 0;
+unsigned long long CometFragmentIndex::_ullPartitionFirstBlock = 0;
+unsigned long long CometFragmentIndex::_ullPartitionFirstPackedByte = 0;
+int CometFragmentIndex::_iNumPrecursorBins = FRAGINDEX_PRECURSORBINS;
+vector<double> CometFragmentIndex::_vdPrecursorBinStartMass;
+size_t CometFragmentIndex::_tFragmentIndexPackedSize = 0;
+vector<string> CometFragmentIndex::_vstrIndexRunFiles;
+int CometFragmentIndex::_iNumIndexRunFiles = 0;
+
+MappedFileStruct CometFragmentIndex::_sPlainPeptideIndexMap;
+MappedFileStruct CometFragmentIndex::_sFragmentIndexMap;
+#ifdef _WIN32
+HANDLE CometFragmentIndex::_hFragmentIndexLockFile = INVALID_HANDLE_VALUE;
+#else
+int CometFragmentIndex::_iFragmentIndexLockFile = -1;
+#endif
 
 //comet_fileoffset_t clSizeCometFileOffset;
 #ifdef _WIN32
@@ -61,38 +95,43 @@ bool CometFragmentIndex::CreateFragmentIndex(ThreadPool *tp)
    if (!g_bPlainPeptideIndexRead)
       ReadPlainPeptideIndex();
 
-   // vFragmentPeptides is vector of modified peptides
-   // - raw peptide via iWhichPeptide referencing entry in g_vRawPeptides to access peptide and protein(s)
-   // - modification encoding index
-   // - modification mass
+   // use the fragment index persisted next to the .idx if it matches the current
+   // parameters; when creating the index, always build it from scratch.  With
+   // fragindex_prune_precursors the index is instead built in memory for just the
+   // peptides within tolerance of the input precursors (g_bIndexPrecursors), so its
+   // size follows the experiment rather than the database.  An RTS search has no
+   // input files to prune against so it still uses the persisted index.
+   bool bPrunePrecursors = g_staticParams.options.bFragIndexPrunePrecursors && g_pvInputFiles.size() > 0;
 
-   int iNumFragmentThreads = g_staticParams.options.iNumThreads > FRAGINDEX_MAX_THREADS ? FRAGINDEX_MAX_THREADS : g_staticParams.options.iNumThreads;
+   if (!g_staticParams.options.bCreateIndex && !bPrunePrecursors && ReadFragmentIndex())
+      return true;
 
-   for (int iWhichThread = 0; iWhichThread < iNumFragmentThreads; ++iWhichThread)
+   // with fragindex_share, write the missing or stale .idx.frag file and map it so that
+   // every comet process searching this database shares one copy of the index
+   if (!g_staticParams.options.bCreateIndex && !bPrunePrecursors && g_staticParams.options.bFragIndexShare
+         && PublishFragmentIndex(tp))
    {
-      for (int iPrecursorBin = 0; iPrecursorBin < FRAGINDEX_PRECURSORBINS; ++iPrecursorBin)
-      {
-         g_iFragmentIndex[iWhichThread][iPrecursorBin] = new unsigned int*[g_massRange.g_uiMaxFragmentArrayIndex];
-         g_iCountFragmentIndex[iWhichThread][iPrecursorBin] = new unsigned int[g_massRange.g_uiMaxFragmentArrayIndex];
-      }
+      return true;
    }
 
+   // vFragmentPeptides is vector of modified peptides
+   // - raw peptide via iWhichPeptide referencing the .idx peptide and its protein(s)
+   // - modification encoding index
+   // - modification mass
+
+   _iNumPrecursorBins = g_staticParams.options.iFragIndexNumPrecursorBins;
+
    // generate the modified peptides to calculate the fragment index
-   GenerateFragmentIndex(tp);
+   GenerateFragmentIndex(tp, g_staticParams.options.bCreateIndex);
 
    return true;
 }
 
 
-void CometFragmentIndex::PermuteIndexPeptideMods(vector<PlainPeptideIndex>& g_vRawPeptides)
+// the residues of each variable mod, in the order modification numbers refer to them
+void CometFragmentIndex::GetAllMods(vector<string>& ALL_MODS)
 {
-   vector<string> ALL_MODS; // An array of all the user specified amino acids that can be modified
-
-   // Pre-computed bitmask combinations for peptides of length MAX_PEPTIDE_LEN with up
-   // to FRAGINDEX_MAX_MODS_PER_PEP modified amino acids.
-
-   // Maximum number of bits that can be set in a modifiable sequence for a given modification.
-   // C(25, 5) = 53,130; C(25, 4) = 10,650; C(25, 3) = 2300.  This is more than FRAGINDEX_MAX_COMBINATIONS (65,534)
+   ALL_MODS.clear();
 
    for (int i = 0; i < VMODS; ++i)
    {
@@ -102,6 +141,24 @@ void CometFragmentIndex::PermuteIndexPeptideMods(vector<PlainPeptideIndex>& g_vR
          ALL_MODS.push_back(g_staticParams.variableModParameters.varModList[i].szVarModChar);
       }
    }
+}
+
+
+// Peptide i is residues pullPeptideOffsets[i] up to pullPeptideOffsets[i+1] of szPeptideResidues.
+// With bStoreModNumbers the modification numbers are generated into MOD_NUMBERS; otherwise
+// only the number of modification numbers of each modifiable sequence is determined and
+// they are decoded on demand by ModificationsPermuter::getModificationNumber.
+// Returns the number of modification numbers.
+int CometFragmentIndex::PermuteIndexPeptideMods(const unsigned long long *pullPeptideOffsets,
+                                                const char *szPeptideResidues,
+                                                size_t tNumPeptides,
+                                                int iMaxModsPerMod,
+                                                bool bStoreModNumbers,
+                                                ThreadPool *tp)
+{
+   vector<string> ALL_MODS; // An array of all the user specified amino acids that can be modified
+
+   GetAllMods(ALL_MODS);
 
    int MOD_CNT = (int)ALL_MODS.size();
 
@@ -115,137 +172,340 @@ void CometFragmentIndex::PermuteIndexPeptideMods(vector<PlainPeptideIndex>& g_vR
    }
    cout << endl;
 
-   unsigned long long* ALL_COMBINATIONS;
-   int ALL_COMBINATION_CNT = 0;
+   ModificationsPermuter::initModificationNumbers(ALL_MODS, iMaxModsPerMod);
+
+   // Get the unique modifiable sequences from the peptides
+   PEPTIDE_MOD_SEQ_IDXS = new int[tNumPeptides];
+
+   MOD_SEQS = ModificationsPermuter::getModifiableSequences(pullPeptideOffsets, szPeptideResidues, tNumPeptides,
+         PEPTIDE_MOD_SEQ_IDXS, ALL_MODS);
+
+   auto tStartTime = chrono::steady_clock::now();
+   cout <<  "   - get modification combinations ... "; fflush(stdout);
+   int iNumModNumbers;
+   if (bStoreModNumbers)  // Get the modification combinations for each unique modifiable substring
+      iNumModNumbers = ModificationsPermuter::getModificationCombinations(MOD_SEQS, tp);
+   else                   // or just their number
+      iNumModNumbers = ModificationsPermuter::getModificationNumberCounts(MOD_SEQS);
+   cout << ElapsedTime(tStartTime) << endl;
+
+   return iNumModNumbers;
+}
+
 
+// Up to this many residues of a modifiable sequence have the same variable mod
+int CometFragmentIndex::MaxModsPerMod(void)
+{
    int iMaxNumVariableMods = g_staticParams.variableModParameters.iMaxVarModPerPeptide;
    if (FRAGINDEX_MAX_MODS_PER_PEP < iMaxNumVariableMods)
       iMaxNumVariableMods = FRAGINDEX_MAX_MODS_PER_PEP;
 
-   // Pre-compute the combinatorial bitmasks that specify the positions of a modified residue
-   // iEnd is one larger than max peptide length
-   ModificationsPermuter::initCombinations(g_staticParams.options.peptideLengthRange.iEnd, iMaxNumVariableMods,
-         &ALL_COMBINATIONS, &ALL_COMBINATION_CNT);
+   return iMaxNumVariableMods;
+}
 
-   // Get the unique modifiable sequences from the peptides
-   PEPTIDE_MOD_SEQ_IDXS = new int[g_vRawPeptides.size()];
 
-   MOD_SEQS = ModificationsPermuter::getModifiableSequences(g_vRawPeptides, PEPTIDE_MOD_SEQ_IDXS, ALL_MODS);
+// 64-bit FNV-1a hash of every parameter that the peptides, proteins and modifications
+// of a .idx file depend on.  The parameters are hashed as text so the hash is the same
+// on every platform.
+unsigned long long CometFragmentIndex::IndexParamsHash(void)
+{
+   char szBuf[SIZE_BUF];
+   string strParams;
+
+   sprintf(szBuf, "MassType: %d %d\n", g_staticParams.massUtility.bMonoMassesParent, g_staticParams.massUtility.bMonoMassesFragment);
+   strParams += szBuf;
+   sprintf(szBuf, "MassRange: %lf %lf\n", g_staticParams.options.dPeptideMassLow, g_staticParams.options.dPeptideMassHigh);
+   strParams += szBuf;
+   sprintf(szBuf, "LengthRange: %d %d\n", g_staticParams.options.peptideLengthRange.iStart, g_staticParams.options.peptideLengthRange.iEnd);
+   strParams += szBuf;
+   sprintf(szBuf, "Enzyme: %s [%d %s %s]\n", g_staticParams.enzymeInformation.szSearchEnzymeName,
+      g_staticParams.enzymeInformation.iSearchEnzymeOffSet,
+      g_staticParams.enzymeInformation.szSearchEnzymeBreakAA,
+      g_staticParams.enzymeInformation.szSearchEnzymeNoBreakAA);
+   strParams += szBuf;
+   sprintf(szBuf, "Enzyme2: %s [%d %s %s]\n", g_staticParams.enzymeInformation.szSearchEnzyme2Name,
+      g_staticParams.enzymeInformation.iSearchEnzyme2OffSet,
+      g_staticParams.enzymeInformation.szSearchEnzyme2BreakAA,
+      g_staticParams.enzymeInformation.szSearchEnzyme2NoBreakAA);
+   strParams += szBuf;
+   sprintf(szBuf, "SampleEnzyme: %s [%d %s %s]\n", g_staticParams.enzymeInformation.szSampleEnzymeName,
+      g_staticParams.enzymeInformation.iSampleEnzymeOffSet,
+      g_staticParams.enzymeInformation.szSampleEnzymeBreakAA,
+      g_staticParams.enzymeInformation.szSampleEnzymeNoBreakAA);
+   strParams += szBuf;
+   sprintf(szBuf, "Digest: %d %d %d %d %d\n", g_staticParams.enzymeInformation.iAllowedMissedCleavage,
+      g_staticParams.options.iEnzymeTermini,
+      g_staticParams.options.bClipNtermMet,
+      g_staticParams.options.bClipNtermAA,
+      g_staticParams.options.iWhichReadingFrame);
+   strParams += szBuf;
+
+   strParams += "StaticMod:";
+   for (int x = 65; x <= 90; ++x)
+   {
+      sprintf(szBuf, " %lf", g_staticParams.staticModifications.pdStaticMods[x]);
+      strParams += szBuf;
+   }
+   sprintf(szBuf, " %lf %lf %lf %lf\n", g_staticParams.staticModifications.dAddNterminusPeptide,
+      g_staticParams.staticModifications.dAddCterminusPeptide,
+      g_staticParams.staticModifications.dAddNterminusProtein,
+      g_staticParams.staticModifications.dAddCterminusProtein);
+   strParams += szBuf;
 
-   auto tStartTime = chrono::steady_clock::now();
-   cout <<  "   - get modification combinations ... "; fflush(stdout);
-   // Get the modification combinations for each unique modifiable substring
-   ModificationsPermuter::getModificationCombinations(MOD_SEQS, iMaxNumVariableMods, ALL_MODS,
-         MOD_CNT, ALL_COMBINATION_CNT, ALL_COMBINATIONS);
-   cout << ElapsedTime(tStartTime) << endl;
+   strParams += "VariableMod:";
+   for (int x = 0; x < VMODS; ++x)
+   {
+      VarMods *pVarMod = &(g_staticParams.variableModParameters.varModList[x]);
+
+      sprintf(szBuf, " %lf:%lf:%s:%d:%d:%d:%d:%d:%d", pVarMod->dVarModMass, pVarMod->dNeutralLoss, pVarMod->szVarModChar,
+         pVarMod->iBinaryMod, pVarMod->iMinNumVarModAAPerMod, pVarMod->iMaxNumVarModAAPerMod,
+         pVarMod->iVarModTermDistance, pVarMod->iWhichTerm, pVarMod->bRequireThisMod);
+      strParams += szBuf;
+   }
+   sprintf(szBuf, "\nMaxMods: %d %d\n", g_staticParams.variableModParameters.iMaxVarModPerPeptide, MaxModsPerMod());
+   strParams += szBuf;
+
+   return HashString(strParams);
+}
+
+
+// 64-bit FNV-1a hash of strText
+unsigned long long CometFragmentIndex::HashString(const string& strText)
+{
+   unsigned long long ullHash = 14695981039346656037ULL;
+   for (size_t i = 0; i < strText.size(); ++i)
+   {
+      ullHash ^= (unsigned char)strText[i];
+      ullHash *= 1099511628211ULL;
+   }
+
+   return ullHash;
 }
 
 
-void CometFragmentIndex::GenerateFragmentIndex(ThreadPool *tp)
+// bPersist is set when the index is to be written to the .idx.frag file.
+void CometFragmentIndex::GenerateFragmentIndex(ThreadPool *tp,
+                                               bool bPersist)
 {
    cout <<  " - generate fragment index\n"; fflush(stdout);
    auto tStartTime = chrono::steady_clock::now();
 
-   Threading::CreateMutex(&_vFragmentPeptidesMutex);
-
    ThreadPool *pFragmentIndexPool = tp;
 
    int iNumIndexingThreads = g_staticParams.options.iNumThreads;
 
-   // Will create a fragment index for each thread, each of which will need
-   // to be queried, so limit this number to FRAGINDEX_MAX_THREADS
+   // Each thread calculates the fragments of its own subset of peptides
+   // into its own buffers.  Limit to FRAGINDEX_MAX_THREADS.
    if (iNumIndexingThreads > FRAGINDEX_MAX_THREADS)
       iNumIndexingThreads = FRAGINDEX_MAX_THREADS;
 
    // Create N number of threads, each of which will iterate through
-   // a subset of peptides to calculate their fragment ions
+   // a subset of peptides to calculate their fragment ions once
+
+   cout <<  "   - calculate fragment ions ... "; fflush(stdout);
 
-   cout <<  "   - count fragment index vector sizes ... "; fflush(stdout);
-   // stupid workaround for Visual Studio ... first calculate all fragments to find size
-   // of each fragment index vector
+   _bPeptidesOnly = false;
+   _dPartitionMassLow = 0.0;
+   _dPartitionMassHigh = g_massRange.dMaxMass + 1.0;
+
+   CalculateFragments(iNumIndexingThreads, pFragmentIndexPool);
+
+   cout << ElapsedTime(tStartTime) << endl;
+
+   tStartTime = chrono::steady_clock::now();
+   cout <<  "   - sorting peptides by mass ... "; fflush(stdout);
+
+   // g_vFragmentPeptides is all threads' peptides sorted by mass; entry order within
+   // each fragment index list is then mass order and each precursor bin is a range
+   // of consecutive g_vFragmentPeptides entries
+   unsigned long long ullNumFragments = 0;
    for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
+      ullNumFragments += _vullThreadFragmentEnd[iWhichThread].back();
+
+   SortFragmentPeptides(iNumIndexingThreads, g_vFragmentPeptides);
+   SetPrecursorBins(ullNumFragments, bPersist);
+
+   g_pFragmentPeptides = g_vFragmentPeptides.data();
+   g_tNumFragmentPeptides = g_vFragmentPeptides.size();
+
+   cout << ElapsedTime(tStartTime) << endl;
+
+   tStartTime = chrono::steady_clock::now();
+   cout <<  "   - populating index ... "; fflush(stdout);
+
+   size_t tNumLists = (size_t)_iNumPrecursorBins * g_massRange.g_uiMaxFragmentArrayIndex;
+
+   g_ullFragmentIndexOffsets = (unsigned long long*)AllocateIndexArray((tNumLists + 1) * sizeof(unsigned long long));
+
+   // the whole index is a single partition
+   SetPartition(0, _iNumPrecursorBins);
+   _ullPartitionFirstEntry = 0;
+   _ullPartitionFirstBlock = 0;
+   _ullPartitionFirstPackedByte = 0;
+
+   unsigned long long ullMax = BuildFragmentIndexPartition(iNumIndexingThreads, pFragmentIndexPool);
+   unsigned long long ullCount = g_ullFragmentIndexOffsets[tNumLists];
+
+   cout << ElapsedTime(tStartTime) << endl;
+
+   printf("   - precursor mass bins: %d\n", _iNumPrecursorBins);
+
+   if (g_staticParams.options.bFragIndexCompress)
    {
-      for (int iPrecursorBin = 0; iPrecursorBin < FRAGINDEX_PRECURSORBINS; ++iPrecursorBin)
+      tStartTime = chrono::steady_clock::now();
+      cout <<  "   - compressing fragment index ... "; fflush(stdout);
+
+      // an index that is only searched in memory stays plain if that is smaller, as
+      // when most lists are much shorter than a block (e.g. with precursor pruning)
+      if (CompressFragmentIndex(iNumIndexingThreads, pFragmentIndexPool, !bPersist))
+         cout << ElapsedTime(tStartTime) << endl;
+      else
       {
-         for (unsigned int iMass = 0; iMass < g_massRange.g_uiMaxFragmentArrayIndex; ++iMass)
-         {
-            g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iMass] = 0;
-         }
+         BuildFragmentIndexKeys(iNumIndexingThreads, pFragmentIndexPool);
+         cout << ElapsedTime(tStartTime) << " (kept plain lists, they are smaller)" << endl;
       }
    }
 
+   printf("   - total # of entries in the fragment index: %0.2E (max %lld)\n", (double)ullCount, ullMax);
+   printf("   - fragment index memory: %0.1f MB (%0.2f bytes per entry)\n", FragmentIndexMemory() / 1048576.0,
+         ullCount > 0 ? (double)FragmentIndexMemory() / ullCount : 0.0);
+}
+
+
+// Calculate the peptides (and, unless _bPeptidesOnly, their fragment ions) with masses
+// in the current partition's range into each thread's buffers.
+void CometFragmentIndex::CalculateFragments(int iNumIndexingThreads,
+                                            ThreadPool *tp)
+{
+   for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
+   {
+      _vThreadPeptides[iWhichThread].clear();
+      _vvuiThreadFragments[iWhichThread].clear();
+      _vullThreadFragmentEnd[iWhichThread].clear();
+      _vullThreadFragmentEnd[iWhichThread].push_back(0);
+   }
+
    for (int iWhichThread = 0; iWhichThread<iNumIndexingThreads; ++iWhichThread)
-      pFragmentIndexPool->doJob(std::bind(AddFragmentsThreadProc, iWhichThread, iNumIndexingThreads, 1, pFragmentIndexPool));
+      tp->doJob(std::bind(AddFragmentsThreadProc, iWhichThread, iNumIndexingThreads, tp));
 
-   pFragmentIndexPool->wait_on_threads();
+   tp->wait_on_threads();
+}
 
 
-   cout << ElapsedTime(tStartTime) << endl;
+// Set the range of precursor bins to build and the peptide masses they cover.
+void CometFragmentIndex::SetPartition(int iFirstBin,
+                                      int iEndBin)
+{
+   _iPartitionFirstBin = iFirstBin;
+   _iPartitionEndBin = iEndBin;
+   _tPartitionFirstPeptide = _vtPrecursorBinFirstPeptide[iFirstBin];
+
+   _dPartitionMassLow = (iFirstBin > 0 ? _vdPrecursorBinStartMass[iFirstBin - 1] : 0.0);
+   _dPartitionMassHigh = (iEndBin < _iNumPrecursorBins ? _vdPrecursorBinStartMass[iEndBin - 1] : g_massRange.dMaxMass + 1.0);
+}
 
-   tStartTime = chrono::steady_clock::now();
-   cout << "   - reserve memory ... "; fflush(stdout);
 
-   // now reserve memory for the fragment index vectors
+// Build the fragment index lists of the current partition from the fragment ions in the
+// thread buffers; returns the longest list.  g_uiFragmentIndex and g_fFragmentIndexPepMass
+// hold the partition's entries, the first being entry _ullPartitionFirstEntry of the index.
+unsigned long long CometFragmentIndex::BuildFragmentIndexPartition(int iNumIndexingThreads,
+                                                                   ThreadPool *tp)
+{
+   size_t tFirstList = (size_t)_iPartitionFirstBin * g_massRange.g_uiMaxFragmentArrayIndex;
+   size_t tEndList = (size_t)_iPartitionEndBin * g_massRange.g_uiMaxFragmentArrayIndex;
+
+   // Count the entries of each list, each thread taking a subset of precursor
+   // bins, then prefix sum the counts into g_ullFragmentIndexOffsets.
    for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
+      tp->doJob(std::bind(BuildFragmentIndexThreadProc, iWhichThread, iNumIndexingThreads, FRAGINDEX_PASS_COUNT));
+
+   tp->wait_on_threads();
+
+   // offsets are set to the end of each list; the fill pass moves them back to the start
+   unsigned long long ullCount = _ullPartitionFirstEntry;
+   unsigned long long ullMax = 0;
+
+   for (size_t tList = tFirstList; tList < tEndList; ++tList)
    {
-      for (int iPrecursorBin = 0; iPrecursorBin < FRAGINDEX_PRECURSORBINS; ++iPrecursorBin)
-      {
-         for (unsigned int iMass = 0; iMass < g_massRange.g_uiMaxFragmentArrayIndex; ++iMass)
-         {
-            if (g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iMass] > 0)
-            {
-               g_iFragmentIndex[iWhichThread][iPrecursorBin][iMass] = new unsigned int[g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iMass]];
-               g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iMass] = 0;  // reset to zero as this will  be used to determine g_iFragmentIndex fill position
-            }
-            else
-               g_iFragmentIndex[iWhichThread][iPrecursorBin][iMass] = NULL;
-         }
-      }
+      unsigned long long ullListCount = g_ullFragmentIndexOffsets[tList];
+
+      ullCount += ullListCount;
+      g_ullFragmentIndexOffsets[tList] = ullCount;
+
+      if (ullListCount > ullMax)
+         ullMax = ullListCount;
    }
+   g_ullFragmentIndexOffsets[tEndList] = ullCount;
 
-   cout << ElapsedTime(tStartTime) << endl;
+   size_t tNumEntries = (size_t)(ullCount - _ullPartitionFirstEntry);
 
-   tStartTime = chrono::steady_clock::now();
-   cout <<  "   - populating index ... "; fflush(stdout);
+   g_uiFragmentIndex = (unsigned int*)AllocateIndexArray(tNumEntries * sizeof(unsigned int));
 
-   // now populate the fragment index vector
    for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
-      pFragmentIndexPool->doJob(std::bind(AddFragmentsThreadProc, iWhichThread, iNumIndexingThreads, 0, pFragmentIndexPool));
+      tp->doJob(std::bind(BuildFragmentIndexThreadProc, iWhichThread, iNumIndexingThreads, FRAGINDEX_PASS_POPULATE));
 
-   pFragmentIndexPool->wait_on_threads();
+   tp->wait_on_threads();
 
-   cout << ElapsedTime(tStartTime) << endl;
+   // the fragment ion buffers are as large as g_uiFragmentIndex so release them
+   // before allocating the mass keys
+   for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
+   {
+      vector<vector<unsigned int>>().swap(_vvuiThreadFragments[iWhichThread]);
+      vector<unsigned long long>().swap(_vullThreadFragmentEnd[iWhichThread]);
+   }
 
-   tStartTime = chrono::steady_clock::now();
-   cout <<  "   - sorting fragment mass bins by peptide mass ... "; fflush(stdout);
+   delete[] _puiFragmentPeptideOrder;
+   _puiFragmentPeptideOrder = NULL;
 
-   // sort list of peptides at each fragment bin by peptide mass
-   for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
-      pFragmentIndexPool->doJob(std::bind(SortFragmentThreadProc, iWhichThread, iNumIndexingThreads, pFragmentIndexPool));
+   if (!g_staticParams.options.bFragIndexCompress)
+      BuildFragmentIndexKeys(iNumIndexingThreads, tp);
 
-   pFragmentIndexPool->wait_on_threads();
+   return ullMax;
+}
 
-   Threading::DestroyMutex(_vFragmentPeptidesMutex);
 
-   cout << ElapsedTime(tStartTime) << endl;
+// Fill g_fFragmentIndexPepMass, the peptide mass of each entry of the current partition's
+// plain lists, which a search without compressed lists uses to skip out of tolerance entries.
+void CometFragmentIndex::BuildFragmentIndexKeys(int iNumIndexingThreads,
+                                                ThreadPool *tp)
+{
+   size_t tEndList = (size_t)_iPartitionEndBin * g_massRange.g_uiMaxFragmentArrayIndex;
+   size_t tNumEntries = (size_t)(g_ullFragmentIndexOffsets[tEndList] - _ullPartitionFirstEntry);
+
+   g_fFragmentIndexPepMass = (float*)AllocateIndexArray(tNumEntries * sizeof(float));
 
-   unsigned long long ullCount = 0;
-   unsigned long long ullMax = 0;
    for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
+      tp->doJob(std::bind(BuildFragmentIndexThreadProc, iWhichThread, iNumIndexingThreads, FRAGINDEX_PASS_KEYS));
+
+   tp->wait_on_threads();
+}
+
+
+// Free the entries, mass keys and compressed blocks of the current partition; the
+// offsets (and block offsets) of the whole index are kept.
+void CometFragmentIndex::FreeFragmentIndexPartition(void)
+{
+   size_t tEndList = (size_t)_iPartitionEndBin * g_massRange.g_uiMaxFragmentArrayIndex;
+   size_t tNumEntries = (size_t)(g_ullFragmentIndexOffsets[tEndList] - _ullPartitionFirstEntry);
+
+   FreeIndexArray(g_uiFragmentIndex, tNumEntries * sizeof(unsigned int));
+   FreeIndexArray(g_fFragmentIndexPepMass, tNumEntries * sizeof(float));
+
+   if (g_ullFragmentIndexBlockOffsets != NULL)
    {
-      for (int iPrecursorBin = 0; iPrecursorBin < FRAGINDEX_PRECURSORBINS; ++iPrecursorBin)
-      {
-         for (unsigned int i = 0; i < g_massRange.g_uiMaxFragmentArrayIndex; ++i)
-         {
-            // count and report the # of entries in the fragment index
-            unsigned long long ullTmp = g_iCountFragmentIndex[iWhichThread][iPrecursorBin][i];
-            ullCount += ullTmp;
-            if (ullTmp > ullMax)
-               ullMax = ullTmp;
-         }
-      }
+      size_t tNumBlocks = (size_t)(g_ullFragmentIndexBlockOffsets[tEndList] - _ullPartitionFirstBlock);
+
+      FreeIndexArray(g_uiFragmentIndexBlockFirst, tNumBlocks * sizeof(unsigned int));
+      FreeIndexArray(g_ullFragmentIndexBlockPos, tNumBlocks * sizeof(unsigned long long));
+      FreeIndexArray(g_ucFragmentIndexPacked, _tFragmentIndexPackedSize);
    }
-   printf("   - total # of entries in the fragment index: %0.2E (max %lld)\n", (double)ullCount, ullMax);
+
+   g_uiFragmentIndex = NULL;
+   g_fFragmentIndexPepMass = NULL;
+   g_uiFragmentIndexBlockFirst = NULL;
+   g_ullFragmentIndexBlockPos = NULL;
+   g_ucFragmentIndexPacked = NULL;
+   _tFragmentIndexPackedSize = 0;
 }
 
 
@@ -270,15 +530,16 @@ string CometFragmentIndex::ElapsedTime(std::chrono::time_point<std::chrono::stea
 
 void CometFragmentIndex::AddFragmentsThreadProc(int iWhichThread,
                                                 int iNumIndexingThreads,
-                                                bool bCountOnly,
                                                 ThreadPool *tp)
 {
-   // each thread will loop through a subset of the g_vRawPeptides
-   for (size_t iWhichPeptide = iWhichThread; iWhichPeptide < g_vRawPeptides.size(); iWhichPeptide += iNumIndexingThreads)
+   SequenceModifications seqMods;  // mods of the peptide's modifiable sequence
+
+   // each thread will loop through a subset of the .idx peptides
+   for (size_t iWhichPeptide = iWhichThread; iWhichPeptide < g_tNumRawPeptides; iWhichPeptide += iNumIndexingThreads)
    {
       // AddFragments(iWhichPeptide, modNumIdx) for unmodified peptide
       // FIX: if require variable mod is set, this would not be called here
-      AddFragments(g_vRawPeptides, iWhichThread, iWhichPeptide, -1, -1, -1, bCountOnly);
+      AddFragments(iWhichThread, iWhichPeptide, -1, NULL, -1, -1);
 
       int modSeqIdx = PEPTIDE_MOD_SEQ_IDXS[iWhichPeptide];
 
@@ -289,14 +550,14 @@ void CometFragmentIndex::AddFragmentsThreadProc(int iWhichThread,
          for (short ctNtermMod=0; ctNtermMod<VMODS; ++ctNtermMod)
          {
             if (g_staticParams.variableModParameters.varModList[ctNtermMod].bNtermMod)
-               AddFragments(g_vRawPeptides, iWhichThread, iWhichPeptide, -1, ctNtermMod, -1, bCountOnly);
+               AddFragments(iWhichThread, iWhichPeptide, -1, NULL, ctNtermMod, -1);
          }
 
          // Add any c-term variable mods
          for (short ctCtermMod=0; ctCtermMod<VMODS; ++ctCtermMod)
          {
             if (g_staticParams.variableModParameters.varModList[ctCtermMod].bCtermMod)
-               AddFragments(g_vRawPeptides, iWhichThread, iWhichPeptide, -1, -1, ctCtermMod, bCountOnly);
+               AddFragments(iWhichThread, iWhichPeptide, -1, NULL, -1, ctCtermMod);
          }
 
          // Now consider combinations of n-term and c-term variable mods
@@ -307,7 +568,7 @@ void CometFragmentIndex::AddFragmentsThreadProc(int iWhichThread,
                if (g_staticParams.variableModParameters.varModList[ctNtermMod].bNtermMod
                      && g_staticParams.variableModParameters.varModList[ctCtermMod].bCtermMod)
                {
-                  AddFragments(g_vRawPeptides, iWhichThread, iWhichPeptide, -1, ctNtermMod, ctCtermMod, bCountOnly);
+                  AddFragments(iWhichThread, iWhichPeptide, -1, NULL, ctNtermMod, ctCtermMod);
                }
             }
          }
@@ -324,10 +585,25 @@ void CometFragmentIndex::AddFragmentsThreadProc(int iWhichThread,
          continue;
 
       int modNumCount = MOD_SEQ_MOD_NUM_CNT[modSeqIdx];
+      const char* modSeq = g_szModSeqs + g_ullModSeqOffsets[modSeqIdx];
+      int iLenModSeq = (int)(g_ullModSeqOffsets[modSeqIdx + 1] - g_ullModSeqOffsets[modSeqIdx]) - 1;
+      char szMods[MAX_PEPTIDE_LEN];
+      const char* mods = szMods;
+
+      if (g_cModNumbers == NULL)
+      {
+         ModificationsPermuter::getSequenceModifications(modSeq, iLenModSeq, &seqMods);
+         ModificationsPermuter::getSequenceCombinations(&seqMods);
+      }
 
       for (int modNumIdx = startIdx; modNumIdx < startIdx + modNumCount; ++modNumIdx)
       {
-         AddFragments(g_vRawPeptides, iWhichThread, iWhichPeptide, modNumIdx, -1, -1, bCountOnly);
+         if (g_cModNumbers != NULL)
+            mods = g_cModNumbers + g_ullModNumberOffsets[modNumIdx];
+         else if (!ModificationsPermuter::getModificationNumber(&seqMods, iLenModSeq, modNumIdx - startIdx, szMods))
+            continue;  // skip ranks that place two mods on one residue
+
+         AddFragments(iWhichThread, iWhichPeptide, modNumIdx, mods, -1, -1);
 
          if (g_staticParams.variableModParameters.bVarTermModSearch)
          {
@@ -335,14 +611,14 @@ void CometFragmentIndex::AddFragmentsThreadProc(int iWhichThread,
             for (short ctNtermMod=0; ctNtermMod<VMODS; ++ctNtermMod)
             {
                if (g_staticParams.variableModParameters.varModList[ctNtermMod].bNtermMod)
-                  AddFragments(g_vRawPeptides, iWhichThread, iWhichPeptide, modNumIdx, ctNtermMod, -1, bCountOnly);
+                  AddFragments(iWhichThread, iWhichPeptide, modNumIdx, mods, ctNtermMod, -1);
             }
 
             // Add any c-term variable mods
             for (short ctCtermMod=0; ctCtermMod<VMODS; ++ctCtermMod)
             {
                if (g_staticParams.variableModParameters.varModList[ctCtermMod].bCtermMod)
-                  AddFragments(g_vRawPeptides, iWhichThread, iWhichPeptide, modNumIdx, -1, ctCtermMod, bCountOnly);
+                  AddFragments(iWhichThread, iWhichPeptide, modNumIdx, mods, -1, ctCtermMod);
             }
 
             // Now consider combinations of n-term and c-term variable mods
@@ -353,7 +629,7 @@ void CometFragmentIndex::AddFragmentsThreadProc(int iWhichThread,
                   if (g_staticParams.variableModParameters.varModList[ctNtermMod].bNtermMod
                         && g_staticParams.variableModParameters.varModList[ctCtermMod].bCtermMod)
                   {
-                     AddFragments(g_vRawPeptides, iWhichThread, iWhichPeptide, modNumIdx, ctNtermMod, ctCtermMod, bCountOnly);
+                     AddFragments(iWhichThread, iWhichPeptide, modNumIdx, mods, ctNtermMod, ctCtermMod);
                   }
                }
             }
@@ -363,178 +639,445 @@ void CometFragmentIndex::AddFragmentsThreadProc(int iWhichThread,
 }
 
 
-void CometFragmentIndex::SortFragmentThreadProc(int iWhichThread,
-                                                int iNumIndexingThreads,
-                                                ThreadPool *tp)
+// Count (FRAGINDEX_PASS_COUNT), fill (FRAGINDEX_PASS_POPULATE) or set the mass keys
+// (FRAGINDEX_PASS_KEYS) of the fragment index lists of a subset of the partition's precursor bins.
+// The fill pass walks each bin's peptides from highest to lowest mass and places
+// entries backwards from the end of each list, so lists end up in increasing entry
+// (mass) order without sorting and g_ullFragmentIndexOffsets back at the list starts.
+void CometFragmentIndex::BuildFragmentIndexThreadProc(int iWhichThread,
+                                                      int iNumIndexingThreads,
+                                                      int iWhichPass)
 {
-   for (int iPrecursorBin = 0; iPrecursorBin < FRAGINDEX_PRECURSORBINS; ++iPrecursorBin)
+   unsigned long long ullFirstEntry = _ullPartitionFirstEntry;
+
+   for (int iPrecursorBin = _iPartitionFirstBin + iWhichThread; iPrecursorBin < _iPartitionEndBin; iPrecursorBin += iNumIndexingThreads)
    {
-      for (unsigned int iFragmentBin = 0; iFragmentBin < g_massRange.g_uiMaxFragmentArrayIndex; ++iFragmentBin)
+      size_t tListStart = (size_t)iPrecursorBin * g_massRange.g_uiMaxFragmentArrayIndex;
+
+      if (iWhichPass == FRAGINDEX_PASS_KEYS)
+      {
+         // float rounding is monotonic so the keys stay sorted and a key range
+         // computed from a double mass range never excludes a matching entry
+         unsigned long long ullEnd = g_ullFragmentIndexOffsets[tListStart + g_massRange.g_uiMaxFragmentArrayIndex];
+
+         for (unsigned long long i = g_ullFragmentIndexOffsets[tListStart]; i < ullEnd; ++i)
+            g_fFragmentIndexPepMass[i - ullFirstEntry] = (float)g_vFragmentPeptides[g_uiFragmentIndex[i - ullFirstEntry]].dPepMass;
+
+         continue;
+      }
+
+      if (iWhichPass == FRAGINDEX_PASS_COUNT)
+      {
+         for (unsigned int iFragmentBin = 0; iFragmentBin < g_massRange.g_uiMaxFragmentArrayIndex; ++iFragmentBin)
+            g_ullFragmentIndexOffsets[tListStart + iFragmentBin] = 0;
+      }
+
+      for (size_t tPeptide = _vtPrecursorBinFirstPeptide[iPrecursorBin + 1]; tPeptide > _vtPrecursorBinFirstPeptide[iPrecursorBin]; )
       {
-         if (g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iFragmentBin] > 0)
+         --tPeptide;
+
+         // locate this peptide's fragment ion bins in the buffers of the thread that calculated it
+         unsigned int uiWhichPeptide = _puiFragmentPeptideOrder[tPeptide - _tPartitionFirstPeptide];
+         int iWhichBuffer = (int)(std::upper_bound(_uiThreadPeptideStart, _uiThreadPeptideStart + iNumIndexingThreads, uiWhichPeptide)
+               - _uiThreadPeptideStart) - 1;
+         size_t tLocal = uiWhichPeptide - _uiThreadPeptideStart[iWhichBuffer];
+         const vector<vector<unsigned int>>& vvuiFragments = _vvuiThreadFragments[iWhichBuffer];
+         unsigned long long ullStart = _vullThreadFragmentEnd[iWhichBuffer][tLocal];
+         unsigned long long ullEnd = _vullThreadFragmentEnd[iWhichBuffer][tLocal + 1];
+
+         for (unsigned long long i = ullStart; i < ullEnd; ++i)
          {
-            std::sort(g_iFragmentIndex[iWhichThread][iPrecursorBin][iFragmentBin],
-               g_iFragmentIndex[iWhichThread][iPrecursorBin][iFragmentBin] + g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iFragmentBin],
-               SortFragmentsByPepMass);
+            size_t tList = tListStart + vvuiFragments[i >> FRAGINDEX_FRAGMENTCHUNKBITS][i & (FRAGINDEX_FRAGMENTCHUNKSIZE - 1)];
+
+            if (iWhichPass == FRAGINDEX_PASS_COUNT)
+               g_ullFragmentIndexOffsets[tList] += 1;
+            else
+               g_uiFragmentIndex[--g_ullFragmentIndexOffsets[tList] - ullFirstEntry] = (unsigned int)tPeptide;
          }
       }
    }
 }
 
 
-bool CometFragmentIndex::SortFragmentsByPepMass(unsigned int x, unsigned int y)
+// Gather the peptides calculated by each thread into vPeptides in mass order.
+// _puiFragmentPeptideOrder maps each vPeptides entry back to its position in
+// the threads' buffers, numbered consecutively thread after thread.
+void CometFragmentIndex::SortFragmentPeptides(int iNumIndexingThreads,
+                                              vector<struct FragmentPeptidesStruct>& vPeptides)
 {
-   if (g_vFragmentPeptides[x].dPepMass == g_vFragmentPeptides[y].dPepMass)
-      return (x < y);
-   else
-      return (g_vFragmentPeptides[x].dPepMass < g_vFragmentPeptides[y].dPepMass);
-}
+   size_t tNumPeptides = 0;
 
+   for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
+   {
+      _uiThreadPeptideStart[iWhichThread] = (unsigned int)tNumPeptides;
+      tNumPeptides += _vThreadPeptides[iWhichThread].size();
 
-void CometFragmentIndex::AddFragments(vector<PlainPeptideIndex>& g_vRawPeptides,
-                                      int iWhichThread,
-                                      int iWhichPeptide,
-                                      int modNumIdx,
-                                      short siNtermMod,
-                                      short siCtermMod,
-                                      bool bCountOnly)
-{
-   string sPeptide = g_vRawPeptides.at(iWhichPeptide).sPeptide;
+      if (tNumPeptides >= UINT_MAX)
+      {
+         printf(" Error in CometFragmentIndex; UINT_MAX (%u) peptides reached.\n", UINT_MAX);
+         exit(1);
+      }
+   }
+   _uiThreadPeptideStart[iNumIndexingThreads] = (unsigned int)tNumPeptides;
 
-   ModificationNumber modNum;
-   char* mods = NULL;
-   int modSeqIdx = -1;
-   string modSeq;
+   vPeptides.clear();
+   vPeptides.reserve(tNumPeptides);
 
-   if (modNumIdx >= 0)  // set modified peptide info
+   for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
    {
-      modNum = MOD_NUMBERS.at(modNumIdx);
-      mods = modNum.modifications;
-      modSeqIdx = PEPTIDE_MOD_SEQ_IDXS[iWhichPeptide];
-      modSeq = MOD_SEQS.at(modSeqIdx);
+      vPeptides.insert(vPeptides.end(), _vThreadPeptides[iWhichThread].begin(), _vThreadPeptides[iWhichThread].end());
+      vector<struct FragmentPeptidesStruct>().swap(_vThreadPeptides[iWhichThread]);
    }
 
-   double dCalcPepMass = g_staticParams.precalcMasses.dOH2ProtonCtermNterm;
-   double dBion = g_staticParams.precalcMasses.dNtermProton;
-   double dYion = g_staticParams.precalcMasses.dCtermOH2Proton;
-   int iPosReverse;  // points to residue in reverse order
+   _puiFragmentPeptideOrder = new unsigned int[tNumPeptides];
 
-   int j = 0; // track count of each modifiable residue
-   int k = 0; // track count of each modifiable residue in reverse
-   int iEndPos = (int)sPeptide.length() - 1;
+   for (size_t i = 0; i < tNumPeptides; ++i)
+      _puiFragmentPeptideOrder[i] = (unsigned int)i;
 
-   // first calculate peptide mass as that's needed in fragment loop
-   j = 0;
-   for (int i = 0; i <= iEndPos; ++i)
-   {
-      dCalcPepMass += g_staticParams.massUtility.pdAAMassFragment[(int)sPeptide[i]];
+   std::sort(_puiFragmentPeptideOrder, _puiFragmentPeptideOrder + tNumPeptides,
+         [&vPeptides](unsigned int x, unsigned int y) { return SortFragmentsByPepMass(vPeptides[x], vPeptides[y]); });
 
-      if (modNumIdx >= 0) // handle the variable mods if present on peptide
-      {
-         if (sPeptide[i] == modSeq[j])
-         {
-            if (mods[j] != -1)
-            {
-               dCalcPepMass += g_staticParams.variableModParameters.varModList[(int)mods[j]].dVarModMass;
-            }
-            j++;
-         }
-      }
-   }
+   vector<struct FragmentPeptidesStruct> vSorted(tNumPeptides);
 
-   if (siNtermMod >= 0)  // if -1, unused
-   {
-      dBion += g_staticParams.variableModParameters.varModList[(int)siNtermMod].dVarModMass;
-      dCalcPepMass += g_staticParams.variableModParameters.varModList[(int)siNtermMod].dVarModMass;
-   }
-   if (siCtermMod >= 0)  // if -1, unused
-   {
-      dYion += g_staticParams.variableModParameters.varModList[(int)siCtermMod].dVarModMass;
-      dCalcPepMass += g_staticParams.variableModParameters.varModList[(int)siCtermMod].dVarModMass;
-   }
+   for (size_t i = 0; i < tNumPeptides; ++i)
+      vSorted[i] = vPeptides[_puiFragmentPeptideOrder[i]];
 
-   if (dCalcPepMass > 99999.9)
-   {
-      printf(" Error, pepmass in AddFragments is %f, peptide %s, modNumIdx %d\n", dCalcPepMass, sPeptide.c_str(), modNumIdx);
-      exit(1);
-   }
+   vPeptides.swap(vSorted);
+}
 
-   if (dCalcPepMass > g_massRange.dMaxMass || dCalcPepMass < g_staticParams.options.dPeptideMassLow)
-      return;
 
-   if (!g_bIndexPrecursors[BIN(dCalcPepMass)])
-      return;
+// Replace g_uiFragmentIndex with delta encoded, bit-packed blocks of FRAGINDEX_POSTINGBLOCKSIZE
+// entries.  First pass sizes each block, then blocks are packed at their prefix summed positions.
+// With bPlainIfSmaller, the plain lists are kept and false returned when the blocks and their
+// offsets would take more memory than the entries and mass keys of the plain lists; each
+// block costs 13 bytes plus its deltas, so this is the case when most lists are short.
+bool CometFragmentIndex::CompressFragmentIndex(int iNumIndexingThreads,
+                                               ThreadPool *tp,
+                                               bool bPlainIfSmaller)
+{
+   size_t tNumLists = (size_t)_iNumPrecursorBins * g_massRange.g_uiMaxFragmentArrayIndex;
+   size_t tFirstList = (size_t)_iPartitionFirstBin * g_massRange.g_uiMaxFragmentArrayIndex;
+   size_t tEndList = (size_t)_iPartitionEndBin * g_massRange.g_uiMaxFragmentArrayIndex;
 
-   unsigned int uiCurrentFragmentPeptide = -1;
+   if (g_ullFragmentIndexBlockOffsets == NULL)
+      g_ullFragmentIndexBlockOffsets = (unsigned long long*)AllocateIndexArray((tNumLists + 1) * sizeof(unsigned long long));
 
-   if (!bCountOnly)
+   unsigned long long ullNumBlocks = _ullPartitionFirstBlock;
+   for (size_t tList = tFirstList; tList < tEndList; ++tList)
    {
-      struct FragmentPeptidesStruct sTmp;
-      sTmp.iWhichPeptide = iWhichPeptide;
-      sTmp.modNumIdx = modNumIdx;
-      sTmp.dPepMass = dCalcPepMass;
-      sTmp.siNtermMod = siNtermMod;
-      sTmp.siCtermMod = siCtermMod;
+      g_ullFragmentIndexBlockOffsets[tList] = ullNumBlocks;
+      ullNumBlocks += (g_ullFragmentIndexOffsets[tList + 1] - g_ullFragmentIndexOffsets[tList] + FRAGINDEX_POSTINGBLOCKSIZE - 1) / FRAGINDEX_POSTINGBLOCKSIZE;
+   }
+   g_ullFragmentIndexBlockOffsets[tEndList] = ullNumBlocks;
 
-      // Store the current peptide; uiCurrentFragmentPeptide references this peptide entry
-      // for use in the g_iFragmentIndex fragment index.  as this is a global list of
-      // peptides, need to lock when updating to avoid thread conflicts
+   size_t tNumBlocks = (size_t)(ullNumBlocks - _ullPartitionFirstBlock);
 
-      Threading::LockMutex(_vFragmentPeptidesMutex);
-      uiCurrentFragmentPeptide = g_vFragmentPeptides.size();  // index of current peptide in g_vFragmentPeptides
-      if (g_vFragmentPeptides.size() >= UINT_MAX)
-      {
-         printf(" Error in CometFragmentIndex; UINT_MAX (%d) peptides reached.\n", UINT_MAX);
-         exit(1);
-      }
-      // store peptide representation based on sequence (iWhichPeptide), modification state (modNumIdx), and mass (dPepMass)
-      g_vFragmentPeptides.push_back(sTmp);
-      Threading::UnlockMutex(_vFragmentPeptidesMutex);
+   g_uiFragmentIndexBlockFirst = (unsigned int*)AllocateIndexArray(tNumBlocks * sizeof(unsigned int));
+   g_ullFragmentIndexBlockPos = (unsigned long long*)AllocateIndexArray(tNumBlocks * sizeof(unsigned long long));
+
+   // g_ullFragmentIndexBlockPos holds the packed size of each block after this pass
+   for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
+      tp->doJob(std::bind(CompressFragmentThreadProc, iWhichThread, iNumIndexingThreads, true));
+
+   tp->wait_on_threads();
+
+   unsigned long long ullNumBytes = _ullPartitionFirstPackedByte;
+   for (size_t tBlock = 0; tBlock < tNumBlocks; ++tBlock)
+   {
+      unsigned long long ullSize = g_ullFragmentIndexBlockPos[tBlock];
+      g_ullFragmentIndexBlockPos[tBlock] = ullNumBytes;
+      ullNumBytes += ullSize;
    }
 
-/*
-if (!(iWhichPeptide%5000))
-{
-   // print out the peptide
-   printf("OK in AddFragments: ");
-   j=0;
-   for (int i = 0; i <= iEndPos; ++i)
+   if (bPlainIfSmaller)
    {
-      printf("%c", (char)sPeptide[i]);
-      if (sPeptide[i] == modSeq[j])
+      size_t tNumEntries = (size_t)(g_ullFragmentIndexOffsets[tEndList] - _ullPartitionFirstEntry);
+      size_t tPlainSize = tNumEntries * (sizeof(unsigned int) + sizeof(float));
+      size_t tCompressedSize = (tNumLists + 1) * sizeof(unsigned long long)
+         + tNumBlocks * (sizeof(unsigned int) + sizeof(unsigned long long))
+         + (size_t)(ullNumBytes - _ullPartitionFirstPackedByte);
+
+      if (tCompressedSize >= tPlainSize)
       {
-         if (modNumIdx != -1 && mods[j] != -1)
-         {
-            printf("%s", to_string(mods[j]).c_str());
-         }
-         j++;
+         FreeIndexArray(g_uiFragmentIndexBlockFirst, tNumBlocks * sizeof(unsigned int));
+         FreeIndexArray(g_ullFragmentIndexBlockPos, tNumBlocks * sizeof(unsigned long long));
+         FreeIndexArray(g_ullFragmentIndexBlockOffsets, (tNumLists + 1) * sizeof(unsigned long long));
+         g_uiFragmentIndexBlockFirst = NULL;
+         g_ullFragmentIndexBlockPos = NULL;
+         g_ullFragmentIndexBlockOffsets = NULL;
+         return false;
       }
    }
-   printf("\t%f\t%d\t%s\n", dCalcPepMass, modNumIdx, modSeq.c_str());
-}
-*/
 
-   int iPrecursorBin = WhichPrecursorBin(dCalcPepMass);
+   _tFragmentIndexPackedSize = (size_t)(ullNumBytes - _ullPartitionFirstPackedByte);
+   g_ucFragmentIndexPacked = (unsigned char*)AllocateIndexArray(_tFragmentIndexPackedSize);
 
-   j = 0;
-   k = modSeq.size() - 1;
+   for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
+      tp->doJob(std::bind(CompressFragmentThreadProc, iWhichThread, iNumIndexingThreads, false));
 
-   for (int i = 0; i < iEndPos; ++i)
-   {
-      iPosReverse = iEndPos - i;
+   tp->wait_on_threads();
 
-      dBion += g_staticParams.massUtility.pdAAMassFragment[(int)sPeptide[i]];
-      dYion += g_staticParams.massUtility.pdAAMassFragment[(int)sPeptide[iPosReverse]];
+   FreeIndexArray(g_uiFragmentIndex, (g_ullFragmentIndexOffsets[tEndList] - _ullPartitionFirstEntry) * sizeof(unsigned int));
+   g_uiFragmentIndex = NULL;
 
-      if (modNumIdx >= 0) // handle the variable mods if present on peptide
-      {
-         if (sPeptide[i] == modSeq[j])
-         {
+   return true;
+}
+
+
+void CometFragmentIndex::CompressFragmentThreadProc(int iWhichThread,
+                                                    int iNumIndexingThreads,
+                                                    bool bSizeOnly)
+{
+   // entries, blocks and packed bytes are held relative to the start of the partition
+   for (int iPrecursorBin = _iPartitionFirstBin + iWhichThread; iPrecursorBin < _iPartitionEndBin; iPrecursorBin += iNumIndexingThreads)
+   {
+      size_t tList = (size_t)iPrecursorBin * g_massRange.g_uiMaxFragmentArrayIndex;
+
+      for (unsigned int iFragmentBin = 0; iFragmentBin < g_massRange.g_uiMaxFragmentArrayIndex; ++iFragmentBin, ++tList)
+      {
+         unsigned long long ullBlock = g_ullFragmentIndexBlockOffsets[tList] - _ullPartitionFirstBlock;
+         unsigned long long ullListEnd = g_ullFragmentIndexOffsets[tList + 1] - _ullPartitionFirstEntry;
+
+         for (unsigned long long ullStart = g_ullFragmentIndexOffsets[tList] - _ullPartitionFirstEntry;
+               ullStart < ullListEnd;
+               ullStart += FRAGINDEX_POSTINGBLOCKSIZE, ++ullBlock)
+         {
+            unsigned long long ullEnd = ullStart + FRAGINDEX_POSTINGBLOCKSIZE;
+            if (ullEnd > ullListEnd)
+               ullEnd = ullListEnd;
+
+            // bit width of largest delta in block
+            unsigned int uiMaxDelta = 0;
+            for (unsigned long long i = ullStart + 1; i < ullEnd; ++i)
+            {
+               if (g_uiFragmentIndex[i] - g_uiFragmentIndex[i - 1] > uiMaxDelta)
+                  uiMaxDelta = g_uiFragmentIndex[i] - g_uiFragmentIndex[i - 1];
+            }
+
+            int iBitWidth = 0;
+            while (iBitWidth < 32 && (uiMaxDelta >> iBitWidth) != 0)
+               ++iBitWidth;
+
+            if (bSizeOnly)
+            {
+               g_ullFragmentIndexBlockPos[ullBlock] = 1 + ((ullEnd - ullStart - 1) * iBitWidth + 7) / 8;
+               continue;
+            }
+
+            g_uiFragmentIndexBlockFirst[ullBlock] = g_uiFragmentIndex[ullStart];
+
+            unsigned char *pucPacked = g_ucFragmentIndexPacked + (g_ullFragmentIndexBlockPos[ullBlock] - _ullPartitionFirstPackedByte);
+            *pucPacked++ = (unsigned char)iBitWidth;
+
+            unsigned long long ullBuffer = 0;
+            int iNumBits = 0;
+
+            for (unsigned long long i = ullStart + 1; i < ullEnd; ++i)
+            {
+               ullBuffer |= (unsigned long long)(g_uiFragmentIndex[i] - g_uiFragmentIndex[i - 1]) << iNumBits;
+               iNumBits += iBitWidth;
+
+               while (iNumBits >= 8)
+               {
+                  *pucPacked++ = (unsigned char)ullBuffer;
+                  ullBuffer >>= 8;
+                  iNumBits -= 8;
+               }
+            }
+
+            if (iNumBits > 0)
+               *pucPacked = (unsigned char)ullBuffer;
+         }
+      }
+   }
+}
+
+
+// Decode the uiNumEntries entries of compressed block tBlock into puiEntries.
+void CometFragmentIndex::DecodePostingBlock(size_t tBlock,
+                                            unsigned int uiNumEntries,
+                                            unsigned int *puiEntries)
+{
+   const unsigned char *pucPacked = g_ucFragmentIndexPacked + g_ullFragmentIndexBlockPos[tBlock];
+   int iBitWidth = *pucPacked++;
+   unsigned int uiEntry = g_uiFragmentIndexBlockFirst[tBlock];
+   unsigned long long ullMask = (1ULL << iBitWidth) - 1;
+   unsigned long long ullBuffer = 0;
+   int iNumBits = 0;
+
+   puiEntries[0] = uiEntry;
+
+   for (unsigned int i = 1; i < uiNumEntries; ++i)
+   {
+      while (iNumBits < iBitWidth)
+      {
+         ullBuffer |= (unsigned long long)(*pucPacked++) << iNumBits;
+         iNumBits += 8;
+      }
+
+      uiEntry += (unsigned int)(ullBuffer & ullMask);
+      ullBuffer >>= iBitWidth;
+      iNumBits -= iBitWidth;
+
+      puiEntries[i] = uiEntry;
+   }
+}
+
+
+// order by mass then by peptide and modification state so the order does not
+// depend on which thread calculated each peptide
+bool CometFragmentIndex::SortFragmentsByPepMass(const FragmentPeptidesStruct& a,
+                                                const FragmentPeptidesStruct& b)
+{
+   if (a.dPepMass != b.dPepMass)
+      return (a.dPepMass < b.dPepMass);
+   if (a.iWhichPeptide != b.iWhichPeptide)
+      return (a.iWhichPeptide < b.iWhichPeptide);
+   if (a.modNumIdx != b.modNumIdx)
+      return (a.modNumIdx < b.modNumIdx);
+   if (a.siNtermMod != b.siNtermMod)
+      return (a.siNtermMod < b.siNtermMod);
+   return (a.siCtermMod < b.siCtermMod);
+}
+
+
+// mods is the decoded modification number modNumIdx; NULL if modNumIdx is -1
+void CometFragmentIndex::AddFragments(int iWhichThread,
+                                      int iWhichPeptide,
+                                      int modNumIdx,
+                                      const char* mods,
+                                      short siNtermMod,
+                                      short siCtermMod)
+{
+   // unpack the sequence from the mapped .idx; most calls are rejected by the
+   // precursor mass checks below, especially when the index is pruned to the
+   // input precursors, so the mass calculation should be all they cost
+   char szPeptide[MAX_PEPTIDE_LEN];
+   int iLenPeptide = GetRawPeptide(iWhichPeptide, szPeptide);
+
+   const char* modSeq = "";
+   int iLenModSeq = 0;
+
+   if (modNumIdx >= 0)  // set modified peptide info
+   {
+      int modSeqIdx = PEPTIDE_MOD_SEQ_IDXS[iWhichPeptide];
+
+      modSeq = g_szModSeqs + g_ullModSeqOffsets[modSeqIdx];
+      iLenModSeq = (int)(g_ullModSeqOffsets[modSeqIdx + 1] - g_ullModSeqOffsets[modSeqIdx]) - 1;
+   }
+
+   double dCalcPepMass = g_staticParams.precalcMasses.dOH2ProtonCtermNterm;
+   double dBion = g_staticParams.precalcMasses.dNtermProton;
+   double dYion = g_staticParams.precalcMasses.dCtermOH2Proton;
+   int iPosReverse;  // points to residue in reverse order
+
+   int j = 0; // track count of each modifiable residue
+   int k = 0; // track count of each modifiable residue in reverse
+   int iEndPos = iLenPeptide - 1;
+
+   // first calculate peptide mass as that's needed in fragment loop
+   j = 0;
+   for (int i = 0; i <= iEndPos; ++i)
+   {
+      dCalcPepMass += g_staticParams.massUtility.pdAAMassFragment[(int)szPeptide[i]];
+
+      if (modNumIdx >= 0) // handle the variable mods if present on peptide
+      {
+         if (szPeptide[i] == modSeq[j])
+         {
+            if (mods[j] != -1)
+            {
+               dCalcPepMass += g_staticParams.variableModParameters.varModList[(int)mods[j]].dVarModMass;
+            }
+            j++;
+         }
+      }
+   }
+
+   if (siNtermMod >= 0)  // if -1, unused
+   {
+      dBion += g_staticParams.variableModParameters.varModList[(int)siNtermMod].dVarModMass;
+      dCalcPepMass += g_staticParams.variableModParameters.varModList[(int)siNtermMod].dVarModMass;
+   }
+   if (siCtermMod >= 0)  // if -1, unused
+   {
+      dYion += g_staticParams.variableModParameters.varModList[(int)siCtermMod].dVarModMass;
+      dCalcPepMass += g_staticParams.variableModParameters.varModList[(int)siCtermMod].dVarModMass;
+   }
+
+   if (dCalcPepMass > 99999.9)
+   {
+      printf(" Error, pepmass in AddFragments is %f, peptide %s, modNumIdx %d\n", dCalcPepMass, szPeptide, modNumIdx);
+      exit(1);
+   }
+
+   if (dCalcPepMass > g_massRange.dMaxMass || dCalcPepMass < g_staticParams.options.dPeptideMassLow)
+      return;
+
+   if (!g_bIndexPrecursors[BIN(dCalcPepMass)])
+      return;
+
+   if (dCalcPepMass < _dPartitionMassLow || dCalcPepMass >= _dPartitionMassHigh)
+      return;
+
+   struct FragmentPeptidesStruct sTmp;
+   sTmp.iWhichPeptide = iWhichPeptide;
+   sTmp.modNumIdx = modNumIdx;
+   sTmp.dPepMass = dCalcPepMass;
+   sTmp.siNtermMod = siNtermMod;
+   sTmp.siCtermMod = siCtermMod;
+
+   // Store peptide representation based on sequence (iWhichPeptide), modification state (modNumIdx),
+   // and mass (dPepMass) in this thread's own list; its fragment ion bins follow in _vvuiThreadFragments.
+   vector<vector<unsigned int>>& vvuiFragments = _vvuiThreadFragments[iWhichThread];
+   unsigned long long ullNumFragments = _vullThreadFragmentEnd[iWhichThread].back();
+
+   _vThreadPeptides[iWhichThread].push_back(sTmp);
+
+   if (_bPeptidesOnly)
+      return;
+
+/*
+if (!(iWhichPeptide%5000))
+{
+   // print out the peptide
+   printf("OK in AddFragments: ");
+   j=0;
+   for (int i = 0; i <= iEndPos; ++i)
+   {
+      printf("%c", (char)szPeptide[i]);
+      if (szPeptide[i] == modSeq[j])
+      {
+         if (modNumIdx != -1 && mods[j] != -1)
+         {
+            printf("%s", to_string(mods[j]).c_str());
+         }
+         j++;
+      }
+   }
+   printf("\t%f\t%d\t%s\n", dCalcPepMass, modNumIdx, modSeq);
+}
+*/
+
+   j = 0;
+   k = iLenModSeq - 1;
+
+   for (int i = 0; i < iEndPos; ++i)
+   {
+      iPosReverse = iEndPos - i;
+
+      dBion += g_staticParams.massUtility.pdAAMassFragment[(int)szPeptide[i]];
+      dYion += g_staticParams.massUtility.pdAAMassFragment[(int)szPeptide[iPosReverse]];
+
+      if (modNumIdx >= 0) // handle the variable mods if present on peptide
+      {
+         if (szPeptide[i] == modSeq[j])
+         {
             dBion += g_staticParams.variableModParameters.varModList[mods[j] - 1].dVarModMass;
             j++;
          }
 
-         if (sPeptide[iPosReverse] == modSeq[k])
+         if (szPeptide[iPosReverse] == modSeq[k])
          {
             dYion += g_staticParams.variableModParameters.varModList[mods[k] - 1].dVarModMass;
             k--;
@@ -547,34 +1090,31 @@ if (!(iWhichPeptide%5000))
       if (i > 1)  // skip first two low mass b- and y-ions
       {
          if (dBion > g_staticParams.options.dFragIndexMinMass && dBion < g_staticParams.options.dFragIndexMaxMass)
-         {
-            if (bCountOnly)
-               g_iCountFragmentIndex[iWhichThread][iPrecursorBin][BIN(dBion)] += 1;
-            else
-            {
-               int iBinBion = BIN(dBion);
-               int iEntry = g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iBinBion];
-
-               g_iFragmentIndex[iWhichThread][iPrecursorBin][iBinBion][iEntry] = uiCurrentFragmentPeptide;
-               g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iBinBion] += 1;
-            }
-         }
+            AppendFragment(vvuiFragments, ullNumFragments, BIN(dBion));
 
          if (dYion > g_staticParams.options.dFragIndexMinMass && dYion < g_staticParams.options.dFragIndexMaxMass)
-         {
-            if (bCountOnly)
-               g_iCountFragmentIndex[iWhichThread][iPrecursorBin][BIN(dYion)] += 1;
-            else
-            {
-               int iBinYion = BIN(dYion);
-               int iEntry = g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iBinYion];
-
-               g_iFragmentIndex[iWhichThread][iPrecursorBin][iBinYion][iEntry] = uiCurrentFragmentPeptide;
-               g_iCountFragmentIndex[iWhichThread][iPrecursorBin][iBinYion] += 1;
-            }
-         }
+            AppendFragment(vvuiFragments, ullNumFragments, BIN(dYion));
       }
    }
+
+   _vullThreadFragmentEnd[iWhichThread].push_back(ullNumFragments);
+}
+
+
+// The fragment ion buffers are kept in fixed size chunks so growing them never
+// copies (and briefly doubles) what has been calculated so far.
+void CometFragmentIndex::AppendFragment(vector<vector<unsigned int>>& vvuiFragments,
+                                        unsigned long long& ullNumFragments,
+                                        unsigned int uiBin)
+{
+   if ((ullNumFragments & (FRAGINDEX_FRAGMENTCHUNKSIZE - 1)) == 0)
+   {
+      vvuiFragments.push_back(vector<unsigned int>());
+      vvuiFragments.back().reserve(FRAGINDEX_FRAGMENTCHUNKSIZE);
+   }
+
+   vvuiFragments.back().push_back(uiBin);
+   ullNumFragments++;
 }
 
 
@@ -584,9 +1124,7 @@ bool CometFragmentIndex::WritePlainPeptideIndex(ThreadPool *tp)
    bool bSucceeded;
    string strOut;
 
-   string strIndexFile;
-
-   strIndexFile = g_staticParams.databaseInfo.szDatabase + string(".idx");
+   string strIndexFile = PlainPeptideIndexFileName();
 
    if ((fp = fopen(strIndexFile.c_str(), "wb")) == NULL)
    {
@@ -619,6 +1157,12 @@ bool CometFragmentIndex::WritePlainPeptideIndex(ThreadPool *tp)
       bSucceeded = CometSearch::RunSearch(0, 0, tp);
    }
 
+   // peptides went to sorted run files if the digest exceeded peptide_index_memory
+   bool bRunFiles = !_vstrIndexRunFiles.empty();
+
+   // gather the peptides each search thread collected
+   CometSearch::CollectIndexPeptides(g_staticParams.options.iNumThreads, bRunFiles);
+
    if (!bSucceeded)
    {
       char szErrorMsg[SIZE_ERROR];
@@ -629,7 +1173,7 @@ bool CometFragmentIndex::WritePlainPeptideIndex(ThreadPool *tp)
    }
 
    // sanity check
-   if (g_pvDBIndex.size() == 0)
+   if (!bRunFiles && g_pvDBIndex.size() == 0)
    {
       char szErrorMsg[SIZE_ERROR];
       sprintf(szErrorMsg, " Error - no peptides in index; check the input database file.\n");
@@ -638,63 +1182,100 @@ bool CometFragmentIndex::WritePlainPeptideIndex(ThreadPool *tp)
       return false;
    }
 
-   // remove duplicates
-   strOut = " - remove duplicate peptides\n";
-   logout(strOut.c_str());
-   fflush(stdout);
+   int iNumSortThreads = (g_staticParams.options.iNumThreads > 1 ? g_staticParams.options.iNumThreads : 1);
+   size_t tNumPeptides;
+   vector<vector<comet_fileoffset_t>> vProteinsList;
+
+   if (bRunFiles)
+   {
+      strOut = " - merge sorted peptide runs and remove duplicate peptides\n";
+      logout(strOut.c_str());
+      fflush(stdout);
 
-   // first sort by peptide then protein file position
-   sort(g_pvDBIndex.begin(), g_pvDBIndex.end(), CompareByPeptide);
+      if (!MergePeptideSortedRuns((size_t)g_staticParams.options.iPeptideIndexMemory * 1048576, iNumSortThreads, tp, &tNumPeptides))
+      {
+         for (auto it = _vstrIndexRunFiles.begin(); it != _vstrIndexRunFiles.end(); ++it)
+            remove((*it).c_str());
+         _vstrIndexRunFiles.clear();
 
-   // At this point, need to create g_pvProteinsList protein file position vector of vectors to map each peptide
-   // to every protein. g_pvDBIndex.at().lProteinFilePosition is now reference to protein vector entry
-   vector<comet_fileoffset_t> temp;  // stores list of duplicate proteins which gets pushed to g_pvProteinsList
+         fclose(fp);
 
-   // Create g_pvProteinsList.  This is a vector of vectors.  Each element is vector list
-   // of duplicate proteins (generated as "temp") ... these are generated by looping
-   // through g_pvDBIndex and looking for consecutive, same peptides.  Once the "temp"
-   // vector is assigned the lIndexProteinFilePosition offset, the g_pvDBIndex entry is
-   // is assigned lProtCount to lIndexProteinFilePosition.  This is used later to look up
-   // the right vector element of duplicate proteins later.
-   long lProtCount = 0;
-   for (size_t i = 0; i < g_pvDBIndex.size(); ++i)
+         char szErrorMsg[SIZE_ERROR];
+         sprintf(szErrorMsg, " Error - cannot merge sorted run files for index file %s\n", strIndexFile.c_str());
+         logerr(szErrorMsg);
+         return false;
+      }
+   }
+   else
    {
-      if (i == 0)
+      // remove duplicates
+      strOut = " - remove duplicate peptides\n";
+      logout(strOut.c_str());
+      fflush(stdout);
+
+      // first sort by peptide then protein file position
+      SortDBIndex(g_pvDBIndex, CompareByPeptide, iNumSortThreads, tp);
+
+      // At this point, need to create vProteinsList protein file position vector of vectors to map each peptide
+      // to every protein. g_pvDBIndex.at().lIndexProteinFilePosition then becomes the vProteinsList entry.
+      // The sorted entries are split into one range per thread without splitting any peptide's entries.
+      // Each thread builds the protein lists of its range and removes its duplicate entries, then the
+      // ranges are joined with their list entries offset by the number of lists before them.
+      size_t tNumEntries = g_pvDBIndex.size();
+      vector<size_t> vtBounds(iNumSortThreads + 1);
+
+      vtBounds[0] = 0;
+      for (int i = 1; i < iNumSortThreads; ++i)
       {
-         temp.push_back(g_pvDBIndex.at(i).lIndexProteinFilePosition);
-         g_pvDBIndex.at(i).lIndexProteinFilePosition = lProtCount;
+         size_t tBound = tNumEntries * i / iNumSortThreads;
+
+         if (tBound < vtBounds[i - 1])
+            tBound = vtBounds[i - 1];
+
+         while (tBound > 0 && tBound < tNumEntries && !strcmp(g_pvDBIndex[tBound].szPeptide, g_pvDBIndex[tBound - 1].szPeptide))
+            tBound++;
+
+         vtBounds[i] = tBound;
       }
-      else
+      vtBounds[iNumSortThreads] = tNumEntries;
+
+      vector<vector<vector<comet_fileoffset_t>>> vvProteinsList(iNumSortThreads);
+      vector<size_t> vtNumUnique(iNumSortThreads);
+
+      for (int i = 0; i < iNumSortThreads; ++i)
+         tp->doJob(std::bind(ProteinListsThreadProc, &g_pvDBIndex, vtBounds[i], vtBounds[i + 1], &vvProteinsList[i], &vtNumUnique[i]));
+      tp->wait_on_threads();
+
+      size_t tNumUnique = 0;
+
+      for (int i = 0; i < iNumSortThreads; ++i)
       {
-         // each unique peptide will have the same list of matched proteins
-         if (!strcmp(g_pvDBIndex.at(i).szPeptide, g_pvDBIndex.at(i-1).szPeptide))
-         {
-            // store protein as peptides are the same
-            temp.push_back(g_pvDBIndex.at(i).lIndexProteinFilePosition);
-            g_pvDBIndex.at(i).lIndexProteinFilePosition = lProtCount;
-         }
-         else
+         comet_fileoffset_t lFirstList = (comet_fileoffset_t)vProteinsList.size();
+
+         for (size_t j = vtBounds[i]; j < vtBounds[i] + vtNumUnique[i]; ++j)
          {
-            // different peptide so go ahead and push temp onto g_pvProteinsList
-            // and store current protein reference into new temp
-            g_pvProteinsList.push_back(temp);
-
-            lProtCount++; // start new row in g_pvProteinsList
-            temp.clear();
-            temp.push_back(g_pvDBIndex.at(i).lIndexProteinFilePosition);
-            g_pvDBIndex.at(i).lIndexProteinFilePosition = lProtCount;
+            g_pvDBIndex[tNumUnique] = g_pvDBIndex[j];
+            g_pvDBIndex[tNumUnique].lIndexProteinFilePosition += lFirstList;
+            tNumUnique++;
          }
+
+         for (auto it = vvProteinsList[i].begin(); it != vvProteinsList[i].end(); ++it)
+            vProteinsList.push_back(std::move(*it));
+         vector<vector<comet_fileoffset_t>>().swap(vvProteinsList[i]);
       }
-   }
-   // now at end of loop, push last temp onto g_pvProteinsList
-   sort(temp.begin(), temp.end());
-   temp.erase(unique(temp.begin(), temp.end()), temp.end() );
-   g_pvProteinsList.push_back(temp);
 
-   g_pvDBIndex.erase(unique(g_pvDBIndex.begin(), g_pvDBIndex.end()), g_pvDBIndex.end());
+      g_pvDBIndex.resize(tNumUnique);
 
-   // sort by mass;
-   sort(g_pvDBIndex.begin(), g_pvDBIndex.end(), CompareByMass);
+      // the last protein list is made unique as it always has been
+      vector<comet_fileoffset_t>& temp = vProteinsList.back();
+      sort(temp.begin(), temp.end());
+      temp.erase(unique(temp.begin(), temp.end()), temp.end() );
+
+      // sort by mass;
+      SortDBIndex(g_pvDBIndex, CompareByMass, iNumSortThreads, tp);
+
+      tNumPeptides = g_pvDBIndex.size();
+   }
 
    cout << " - write peptides/proteins to file" << endl;
 
@@ -712,7 +1293,8 @@ bool CometFragmentIndex::WritePlainPeptideIndex(ThreadPool *tp)
       g_staticParams.enzymeInformation.iSearchEnzyme2OffSet, 
       g_staticParams.enzymeInformation.szSearchEnzyme2BreakAA, 
       g_staticParams.enzymeInformation.szSearchEnzyme2NoBreakAA);
-   fprintf(fp, "NumPeptides: %ld\n", (long)g_pvDBIndex.size());
+   fprintf(fp, "NumPeptides: %ld\n", (long)tNumPeptides);
+   fprintf(fp, "ParamsHash: %016llx\n", IndexParamsHash());
 
    // write out static mod params A to Z is ascii 65 to 90 then terminal mods
    fprintf(fp, "StaticMod:");
@@ -731,82 +1313,225 @@ bool CometFragmentIndex::WritePlainPeptideIndex(ThreadPool *tp)
          g_staticParams.variableModParameters.varModList[x].szVarModChar);
    fprintf(fp, "\n");
 
-   size_t tTmp = (int)g_pvProteinNames.size();
-   comet_fileoffset_t *lProteinIndex = new comet_fileoffset_t[tTmp];
-   for (size_t i = 0; i < tTmp; ++i)
-      lProteinIndex[i] = -1;
-
-   comet_fileoffset_t clPeptidesFilePos = comet_ftell(fp);
-   size_t tNumPeptides = g_pvDBIndex.size();
-   fwrite(&tNumPeptides, sizeof(size_t), 1, fp);  // write # of peptides
+   // Binary part of the index follows the text header.  Its PlainPeptideIndexHeader
+   // is rewritten once the position of every section is known.
+   PlainPeptideIndexHeader sHeader;
+   memset(&sHeader, 0, sizeof(PlainPeptideIndexHeader));
+   strcpy(sHeader.szMagic, "CMTPIDX");
+   sHeader.iVersion = PLAINIDX_FILE_VERSION;
+   sHeader.iSizeofFileOffset = (int)sizeof(comet_fileoffset_t);
+   sHeader.ullParamsHash = IndexParamsHash();
+   GetFileStat(g_staticParams.databaseInfo.szDatabase, &sHeader.llFastaFileSize, &sHeader.llFastaMTime);
+   sHeader.ullNumPeptides = tNumPeptides;
+
+   WritePadding(fp);
+   unsigned long long ullHeaderPos = comet_ftell(fp);
+   fwrite(&sHeader, sizeof(PlainPeptideIndexHeader), 1, fp);
+
+   unsigned long long ullOffset = 0;
+
+   // peptides to permute mods on
+   const unsigned long long *pullPeptideOffsets;
+   const char *szPeptideResidues;
+   vector<unsigned long long> vullPeptideOffsets;
+   vector<char> vcPeptideResidues;
+   MappedFileStruct sPeptideOffsetsMap = MappedFileStruct();   // pMap NULL until mapped
+   MappedFileStruct sPeptideResiduesMap = MappedFileStruct();
+   string strTmpFile = strIndexFile + ".tmp";
+
+   if (bRunFiles)
+   {
+      // the spooled peptide residue offsets and residues are mapped to be packed and to permute mods on
+      bSucceeded = WriteMergedPeptideSections(fp, &sHeader, strTmpFile)
+            && MapFile(strTmpFile + "1", &sPeptideOffsetsMap)
+            && MapFile(strTmpFile + "2", &sPeptideResiduesMap);
 
-   for (std::vector<DBIndex>::iterator it = g_pvDBIndex.begin(); it != g_pvDBIndex.end(); ++it)
+      pullPeptideOffsets = (const unsigned long long*)sPeptideOffsetsMap.pMap;
+      szPeptideResidues = sPeptideResiduesMap.pMap;
+   }
+   else
    {
-      int iLen = (int)strlen((*it).szPeptide);
-      struct PlainPeptideIndex sTmp;
+      // protein lists in peptide (mass) order so that peptide i has protein list i
+      sHeader.ullProteinOffsetsPos = comet_ftell(fp);
+      fwrite(&ullOffset, sizeof(unsigned long long), 1, fp);
+      for (std::vector<DBIndex>::iterator it = g_pvDBIndex.begin(); it != g_pvDBIndex.end(); ++it)
+      {
+         ullOffset += vProteinsList.at((*it).lIndexProteinFilePosition).size();
+         fwrite(&ullOffset, sizeof(unsigned long long), 1, fp);
+      }
+      sHeader.ullNumProteins = ullOffset;
+
+      sHeader.ullProteinsPos = comet_ftell(fp);
+      for (std::vector<DBIndex>::iterator it = g_pvDBIndex.begin(); it != g_pvDBIndex.end(); ++it)
+      {
+         vector<comet_fileoffset_t>& vProteins = vProteinsList.at((*it).lIndexProteinFilePosition);
+         fwrite(&(vProteins[0]), sizeof(comet_fileoffset_t), vProteins.size(), fp);
+      }
+      WritePadding(fp);
 
-      fwrite(&iLen, sizeof(int), 1, fp);
-      fwrite((*it).szPeptide, sizeof(char), iLen, fp);
-      fwrite(&((*it).dPepMass), sizeof(double), 1, fp);
-      fwrite(&((*it).lIndexProteinFilePosition), clSizeCometFileOffset, 1, fp);
+      // residue offsets and the concatenated residues of the peptides
+      vullPeptideOffsets.reserve(tNumPeptides + 1);
+      vullPeptideOffsets.push_back(0);
+      for (std::vector<DBIndex>::iterator it = g_pvDBIndex.begin(); it != g_pvDBIndex.end(); ++it)
+      {
+         vcPeptideResidues.insert(vcPeptideResidues.end(), (*it).szPeptide, (*it).szPeptide + strlen((*it).szPeptide));
+         vullPeptideOffsets.push_back(vcPeptideResidues.size());
+      }
 
-      sTmp.sPeptide = (*it).szPeptide;
-      sTmp.lIndexProteinFilePosition = clSizeCometFileOffset;
-      sTmp.dPepMass = (*it).dPepMass;
-      g_vRawPeptides.push_back(sTmp);
+      pullPeptideOffsets = &(vullPeptideOffsets[0]);
+      szPeptideResidues = &(vcPeptideResidues[0]);
    }
 
-   // Now write out: vector<vector<comet_fileoffset_t>> g_pvProteinsList
-   comet_fileoffset_t clProteinsFilePos = comet_ftell(fp);
-   tTmp = g_pvProteinsList.size();
-   fwrite(&tTmp, clSizeCometFileOffset, 1, fp);
-   for (auto it = g_pvProteinsList.begin(); it != g_pvProteinsList.end(); ++it)
+   // peptide residue offsets then the 5 bit packed residues
+   if (bSucceeded)
    {
-      tTmp = (*it).size();
-      fwrite(&tTmp, sizeof(size_t), 1, fp);
-      for (size_t it2 = 0; it2 < tTmp; ++it2)
-      {
-         fwrite(&((*it).at(it2)), clSizeCometFileOffset, 1, fp);
-      }
+      sHeader.ullPeptideOffsetsPos = comet_ftell(fp);
+      bSucceeded = (fwrite(pullPeptideOffsets, sizeof(unsigned long long), tNumPeptides + 1, fp) == tNumPeptides + 1);
+
+      sHeader.ullResiduesPos = comet_ftell(fp);
+      bSucceeded = bSucceeded
+            && WritePackedResidues(fp, szPeptideResidues, (size_t)pullPeptideOffsets[tNumPeptides], &(sHeader.ullNumResidueBytes))
+            && WritePadding(fp);
    }
 
-   // now permute mods on the peptides
-   PermuteIndexPeptideMods(g_vRawPeptides);
- 
-   unsigned long ulSizeModSeqs = MOD_SEQS.size();              // size of MOD_SEQS
-   unsigned long ulSizevRawPeptides = g_vRawPeptides.size();   // size of g_vRawPeptides
-   unsigned long ulModNumSize = MOD_NUMBERS.size();            // size of MOD_NUMBERS
+   if (!bSucceeded)
+   {
+      UnmapFile(&sPeptideOffsetsMap);
+      UnmapFile(&sPeptideResiduesMap);
+      remove((strTmpFile + "1").c_str());
+      remove((strTmpFile + "2").c_str());
+      fclose(fp);
+
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot write index file %s\n", strIndexFile.c_str());
+      logerr(szErrorMsg);
+      return false;
+   }
 
-   comet_fileoffset_t clPermutationsFilePos = comet_ftell(fp);
+   // protein accessions (first word of each description line) in database order
+   char szAccession[WIDTH_REFERENCE];
 
-   fwrite(&ulSizeModSeqs, sizeof(unsigned long), 1, fp);
-   fwrite(&ulSizevRawPeptides, sizeof(unsigned long), 1, fp);
-   fwrite(&ulModNumSize, sizeof(unsigned long), 1, fp);
-   fwrite(MOD_SEQ_MOD_NUM_START, sizeof(int), ulSizeModSeqs, fp);
-   fwrite(MOD_SEQ_MOD_NUM_CNT, sizeof(int), ulSizeModSeqs, fp);
-   fwrite(PEPTIDE_MOD_SEQ_IDXS, sizeof(int), ulSizevRawPeptides, fp);
-   int iTmp;
-   for (unsigned long i = 0; i < ulSizeModSeqs; ++i)
+   ullOffset = 0;
+   sHeader.ullNumProteinNames = g_pvProteinNames.size();
+   sHeader.ullProteinNamePositionsPos = comet_ftell(fp);
+   for (auto it = g_pvProteinNames.begin(); it != g_pvProteinNames.end(); ++it)
    {
-      iTmp = MOD_SEQS[i].size();
-      fwrite(&iTmp, sizeof(int), 1, fp); // write length
-      fwrite(MOD_SEQS[i].c_str(), 1, iTmp, fp);
+      comet_fileoffset_t lFilePosition = (comet_fileoffset_t)it->first;
+      bSucceeded = bSucceeded && (fwrite(&lFilePosition, sizeof(comet_fileoffset_t), 1, fp) == 1);
    }
-   for (unsigned long i = 0; i < ulModNumSize; ++i)
+   bSucceeded = bSucceeded && WritePadding(fp);
+
+   sHeader.ullProteinNameOffsetsPos = comet_ftell(fp);
+   bSucceeded = bSucceeded && (fwrite(&ullOffset, sizeof(unsigned long long), 1, fp) == 1);
+   for (auto it = g_pvProteinNames.begin(); it != g_pvProteinNames.end(); ++it)
    {
-      fwrite(&(MOD_NUMBERS[i].modStringLen), sizeof(int), 1, fp);
-      fwrite(MOD_NUMBERS[i].modifications, 1, MOD_NUMBERS[i].modStringLen, fp);
+      szAccession[0] = '\0';
+      sscanf(it->second.szProt, "%511s", szAccession);  // WIDTH_REFERENCE-1
+      ullOffset += strlen(szAccession) + 1;
+      bSucceeded = bSucceeded && (fwrite(&ullOffset, sizeof(unsigned long long), 1, fp) == 1);
    }
+   sHeader.ullNumProteinNameBytes = ullOffset;
 
-   fwrite(&clPeptidesFilePos, clSizeCometFileOffset, 1, fp);
-   fwrite(&clProteinsFilePos, clSizeCometFileOffset, 1, fp);
-   fwrite(&clPermutationsFilePos, clSizeCometFileOffset, 1, fp);
+   sHeader.ullProteinNamesPos = comet_ftell(fp);
+   for (auto it = g_pvProteinNames.begin(); it != g_pvProteinNames.end(); ++it)
+   {
+      szAccession[0] = '\0';
+      sscanf(it->second.szProt, "%511s", szAccession);
+      size_t tLen = strlen(szAccession) + 1;
+      bSucceeded = bSucceeded && (fwrite(szAccession, sizeof(char), tLen, fp) == tLen);
+   }
+   bSucceeded = bSucceeded && WritePadding(fp);
 
    g_pvDBIndex.clear();
    g_pvProteinNames.clear();
-   delete[] lProteinIndex;
+   vector<vector<comet_fileoffset_t>>().swap(vProteinsList);
 
-   fclose(fp);
+   // now permute mods on the peptides
+   sHeader.iMaxModsPerMod = MaxModsPerMod();
+   sHeader.bModNumbersStored = !g_staticParams.options.bPeptideIndexDecodeMods;
+   sHeader.ullNumModNumbers = PermuteIndexPeptideMods(pullPeptideOffsets, szPeptideResidues, tNumPeptides,
+         sHeader.iMaxModsPerMod, sHeader.bModNumbersStored, tp);
+
+   UnmapFile(&sPeptideOffsetsMap);
+   UnmapFile(&sPeptideResiduesMap);
+   remove((strTmpFile + "1").c_str());
+   remove((strTmpFile + "2").c_str());
+   vector<unsigned long long>().swap(vullPeptideOffsets);
+   vector<char>().swap(vcPeptideResidues);
+
+   size_t tNumModSeqs = MOD_SEQS.size();
+
+   sHeader.ullNumModSeqs = tNumModSeqs;
+
+   sHeader.ullModSeqModNumStartPos = comet_ftell(fp);
+   fwrite(MOD_SEQ_MOD_NUM_START, sizeof(int), tNumModSeqs, fp);
+   WritePadding(fp);
+
+   sHeader.ullModSeqModNumCntPos = comet_ftell(fp);
+   fwrite(MOD_SEQ_MOD_NUM_CNT, sizeof(int), tNumModSeqs, fp);
+   WritePadding(fp);
+
+   sHeader.ullPeptideModSeqIdxsPos = comet_ftell(fp);
+   fwrite(PEPTIDE_MOD_SEQ_IDXS, sizeof(int), tNumPeptides, fp);
+   WritePadding(fp);
+
+   ullOffset = 0;
+   sHeader.ullModSeqOffsetsPos = comet_ftell(fp);
+   fwrite(&ullOffset, sizeof(unsigned long long), 1, fp);
+   for (size_t i = 0; i < tNumModSeqs; ++i)
+   {
+      ullOffset += MOD_SEQS[i].size() + 1;
+      fwrite(&ullOffset, sizeof(unsigned long long), 1, fp);
+   }
+   sHeader.ullNumModSeqBytes = ullOffset;
+
+   sHeader.ullModSeqsPos = comet_ftell(fp);
+   for (size_t i = 0; i < tNumModSeqs; ++i)
+      fwrite(MOD_SEQS[i].c_str(), sizeof(char), MOD_SEQS[i].size() + 1, fp);
+   WritePadding(fp);
+
+   if (sHeader.bModNumbersStored)
+   {
+      sHeader.ullModNumberOffsetsPos = comet_ftell(fp);
+      fwrite(MOD_NUMBER_OFFSETS.data(), sizeof(unsigned long long), MOD_NUMBER_OFFSETS.size(), fp);
+      sHeader.ullNumModNumberBytes = MOD_NUMBERS.size();
+
+      sHeader.ullModNumbersPos = comet_ftell(fp);
+      fwrite(MOD_NUMBERS.data(), sizeof(char), MOD_NUMBERS.size(), fp);
+      WritePadding(fp);
+   }
+
+   // the last 8 bytes locate the header
+   fwrite(&ullHeaderPos, sizeof(unsigned long long), 1, fp);
+
+   comet_fseek(fp, ullHeaderPos, SEEK_SET);
+   fwrite(&sHeader, sizeof(PlainPeptideIndexHeader), 1, fp);
+
+   if (ferror(fp))
+      bSucceeded = false;
+   if (fclose(fp) != 0)
+      bSucceeded = false;
+
+   // searches use the permutations in place from the mapped .idx
+   vector<char>().swap(MOD_NUMBERS);
+   vector<unsigned long long>().swap(MOD_NUMBER_OFFSETS);
+   vector<string>().swap(MOD_SEQS);
+   delete[] MOD_SEQ_MOD_NUM_START;
+   delete[] MOD_SEQ_MOD_NUM_CNT;
+   delete[] PEPTIDE_MOD_SEQ_IDXS;
+   MOD_SEQ_MOD_NUM_START = NULL;
+   MOD_SEQ_MOD_NUM_CNT = NULL;
+   PEPTIDE_MOD_SEQ_IDXS = NULL;
+
+   if (!bSucceeded)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot write index file %s\n", strIndexFile.c_str());
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   bSucceeded = ReadPlainPeptideIndex();
 
    strOut = " - done. " + strIndexFile + " (" + to_string(tNumPeptides) + " peptides)\n\n";
    logout(strOut.c_str());
@@ -816,21 +1541,20 @@ bool CometFragmentIndex::WritePlainPeptideIndex(ThreadPool *tp)
 }
 
 
-// read the raw peptides from disk
+// read the index parameters from the .idx text header then memory map the raw
+// peptides, protein lists and mod permutations
 bool CometFragmentIndex::ReadPlainPeptideIndex(void)
 {
    FILE *fp;
-   size_t tTmp;
    char szBuf[SIZE_BUF];
-   string strIndexFile;
 
    if (g_bPlainPeptideIndexRead)
       return 1;
 
-   if (g_staticParams.options.bCreateIndex)
-      strIndexFile = g_staticParams.databaseInfo.szDatabase + string(".idx");
-   else // database already is .idx
-      strIndexFile = g_staticParams.databaseInfo.szDatabase;
+   string strIndexFile = PlainPeptideIndexFileName();
+
+   // parameters of this search before the .idx text header replaces them
+   unsigned long long ullParamsHash = IndexParamsHash();
 
    if ((fp = fopen(strIndexFile.c_str(), "rb")) == NULL)
    {
@@ -992,117 +1716,1707 @@ bool CometFragmentIndex::ReadPlainPeptideIndex(void)
       return false;
    }
 
-   comet_fileoffset_t clTmp;
-   comet_fileoffset_t clPeptidesFilePos;      // file position of raw peptides
-   comet_fileoffset_t clProteinsFilePos;      // file position of g_pvProteinsList
-   comet_fileoffset_t clPermutationsFilePos;  // file position of permutations variables
+   // the last 8 bytes of the file are the position of its PlainPeptideIndexHeader
+   unsigned long long ullHeaderPos = 0;
+   bool bValid = (comet_fseek(fp, -(comet_fileoffset_t)sizeof(unsigned long long), SEEK_END) == 0
+         && fread(&ullHeaderPos, sizeof(unsigned long long), 1, fp) == 1);
 
-   comet_fseek(fp, -clSizeCometFileOffset*3, SEEK_END);
-   fread(&clPeptidesFilePos, clSizeCometFileOffset, 1, fp);
-   fread(&clProteinsFilePos, clSizeCometFileOffset, 1, fp);
-   fread(&clPermutationsFilePos, clSizeCometFileOffset, 1, fp);
-
-   comet_fseek(fp, clPeptidesFilePos, SEEK_SET);
-
-   size_t tNumPeptides;
-   fread(&tNumPeptides, sizeof(size_t), 1, fp);  // read # of peptides
+   fclose(fp);
 
-   struct PlainPeptideIndex sTmp;
-   int iLen;
-   char szPeptide[MAX_PEPTIDE_LEN];
-   for (size_t it = 0; it < tNumPeptides; ++it)
+   UnmapFile(&_sPlainPeptideIndexMap);  // still mapped if the search created the .idx file
+
+   bValid = bValid && MapFile(strIndexFile, &_sPlainPeptideIndexMap)
+         && ullHeaderPos + sizeof(PlainPeptideIndexHeader) <= _sPlainPeptideIndexMap.tSize;
+
+   char *pMap = _sPlainPeptideIndexMap.pMap;
+   size_t tFileSize = _sPlainPeptideIndexMap.tSize;
+   PlainPeptideIndexHeader *pHeader = (PlainPeptideIndexHeader*)(pMap + ullHeaderPos);
+
+   bValid = bValid
+         && !memcmp(pHeader->szMagic, "CMTPIDX", sizeof(pHeader->szMagic))
+         && pHeader->iVersion == PLAINIDX_FILE_VERSION
+         && pHeader->iSizeofFileOffset == (int)sizeof(comet_fileoffset_t)
+         && pHeader->ullPeptideOffsetsPos + (pHeader->ullNumPeptides + 1) * sizeof(unsigned long long) <= tFileSize
+         && pHeader->ullResiduesPos + pHeader->ullNumResidueBytes <= tFileSize
+         && pHeader->ullProteinOffsetsPos + (pHeader->ullNumPeptides + 1) * sizeof(unsigned long long) <= tFileSize
+         && pHeader->ullProteinsPos + pHeader->ullNumProteins * sizeof(comet_fileoffset_t) <= tFileSize
+         && pHeader->ullModSeqModNumStartPos + pHeader->ullNumModSeqs * sizeof(int) <= tFileSize
+         && pHeader->ullModSeqModNumCntPos + pHeader->ullNumModSeqs * sizeof(int) <= tFileSize
+         && pHeader->ullPeptideModSeqIdxsPos + pHeader->ullNumPeptides * sizeof(int) <= tFileSize
+         && pHeader->ullModSeqOffsetsPos + (pHeader->ullNumModSeqs + 1) * sizeof(unsigned long long) <= tFileSize
+         && pHeader->ullModSeqsPos + pHeader->ullNumModSeqBytes <= tFileSize
+         && (!pHeader->bModNumbersStored
+            || (pHeader->ullModNumberOffsetsPos + (pHeader->ullNumModNumbers + 1) * sizeof(unsigned long long) <= tFileSize
+               && pHeader->ullModNumbersPos + pHeader->ullNumModNumberBytes <= tFileSize))
+         && pHeader->ullProteinNamePositionsPos + pHeader->ullNumProteinNames * sizeof(comet_fileoffset_t) <= tFileSize
+         && pHeader->ullProteinNameOffsetsPos + (pHeader->ullNumProteinNames + 1) * sizeof(unsigned long long) <= tFileSize
+         && pHeader->ullProteinNamesPos + pHeader->ullNumProteinNameBytes <= tFileSize;
+
+   // each offset table must end at the size of the section it indexes
+   bValid = bValid
+         && PackedResidueBytes(((unsigned long long*)(pMap + pHeader->ullPeptideOffsetsPos))[pHeader->ullNumPeptides]) == pHeader->ullNumResidueBytes
+         && ((unsigned long long*)(pMap + pHeader->ullProteinOffsetsPos))[pHeader->ullNumPeptides] == pHeader->ullNumProteins
+         && ((unsigned long long*)(pMap + pHeader->ullModSeqOffsetsPos))[pHeader->ullNumModSeqs] == pHeader->ullNumModSeqBytes
+         && (!pHeader->bModNumbersStored
+            || ((unsigned long long*)(pMap + pHeader->ullModNumberOffsetsPos))[pHeader->ullNumModNumbers] == pHeader->ullNumModNumberBytes)
+         && ((unsigned long long*)(pMap + pHeader->ullProteinNameOffsetsPos))[pHeader->ullNumProteinNames] == pHeader->ullNumProteinNameBytes;
+
+   if (!bValid)
    {
-      fread(&iLen, sizeof(int), 1, fp);
-      fread(szPeptide, sizeof(char), iLen, fp);
-      szPeptide[iLen] = '\0';
-      sTmp.sPeptide = szPeptide;
-      fread(&(sTmp.dPepMass), sizeof(double), 1, fp);
-      fread(&(sTmp.lIndexProteinFilePosition), clSizeCometFileOffset, 1, fp);
-
-      g_vRawPeptides.push_back(sTmp);
+      UnmapFile(&_sPlainPeptideIndexMap);
+      printf(" Error - index file %s is not a version %d Comet peptide index; recreate it with -i\n", strIndexFile.c_str(), PLAINIDX_FILE_VERSION);
+      exit(1);
    }
 
-   comet_fseek(fp, clProteinsFilePos, SEEK_SET);  // should be at this file position here anyways already
-
-   // now read in: vector<vector<comet_fileoffset_t>> g_pvProteinsList
-   size_t tSize;
-   fread(&tSize, clSizeCometFileOffset, 1, fp);
-   vector<comet_fileoffset_t> vTmp;
-
-   g_pvProteinsList.clear();
-   g_pvProteinsList.reserve(tSize);
+   // never search other digest/modification parameters than the ones requested
+   if (!g_staticParams.options.bCreateIndex && pHeader->ullParamsHash != ullParamsHash)
+   {
+      UnmapFile(&_sPlainPeptideIndexMap);
+      printf(" Error - index file %s was created with different digest/modification parameters;\n"
+             " recreate it with -i, or search the fasta database with peptide_index_cache_dir set\n", strIndexFile.c_str());
+      exit(1);
+   }
 
-   for (size_t it = 0; it < tSize; ++it)
+   // use the peptides, protein lists, protein accessions and mod permutations in place
+   g_tNumRawPeptides = (size_t)pHeader->ullNumPeptides;
+   g_ullRawPeptideOffsets = (unsigned long long*)(pMap + pHeader->ullPeptideOffsetsPos);
+   g_ucRawPeptideResidues = (unsigned char*)(pMap + pHeader->ullResiduesPos);
+   g_ullProteinListOffsets = (unsigned long long*)(pMap + pHeader->ullProteinOffsetsPos);
+   g_lProteinListFilePositions = (comet_fileoffset_t*)(pMap + pHeader->ullProteinsPos);
+   g_tNumProteinNames = (size_t)pHeader->ullNumProteinNames;
+   g_lProteinNameFilePositions = (comet_fileoffset_t*)(pMap + pHeader->ullProteinNamePositionsPos);
+   g_ullProteinNameOffsets = (unsigned long long*)(pMap + pHeader->ullProteinNameOffsetsPos);
+   g_szProteinNames = pMap + pHeader->ullProteinNamesPos;
+
+   MOD_SEQ_MOD_NUM_START = (int*)(pMap + pHeader->ullModSeqModNumStartPos);
+   MOD_SEQ_MOD_NUM_CNT = (int*)(pMap + pHeader->ullModSeqModNumCntPos);
+   PEPTIDE_MOD_SEQ_IDXS = (int*)(pMap + pHeader->ullPeptideModSeqIdxsPos);
+   g_ullModSeqOffsets = (unsigned long long*)(pMap + pHeader->ullModSeqOffsetsPos);
+   g_szModSeqs = pMap + pHeader->ullModSeqsPos;
+
+   if (pHeader->bModNumbersStored)
    {
-      fread(&tTmp, clSizeCometFileOffset, 1, fp);
-      
-      vTmp.clear();
-      for (size_t it2 = 0; it2 < tTmp; ++it2)
+      g_ullModNumberOffsets = (unsigned long long*)(pMap + pHeader->ullModNumberOffsetsPos);
+      g_cModNumbers = pMap + pHeader->ullModNumbersPos;
+   }
+   else
+   {
+      g_ullModNumberOffsets = NULL;
+      g_cModNumbers = NULL;
+   }
+
+   // otherwise modification numbers are decoded with the mods the .idx file was created with
+   vector<string> ALL_MODS;
+   GetAllMods(ALL_MODS);
+   ModificationsPermuter::initModificationNumbers(ALL_MODS, pHeader->iMaxModsPerMod);
+
+   return true;
+}
+
+
+// fragment index file lives next to the .idx file
+string CometFragmentIndex::FragmentIndexFileName(void)
+{
+   return PlainPeptideIndexFileName() + ".frag";
+}
+
+
+// .idx file being created (-i, or a search with peptide_index_cache_dir set that found no
+// matching .idx file) or searched
+string CometFragmentIndex::PlainPeptideIndexFileName(void)
+{
+   if (!g_staticParams.options.bCreateIndex)  // database already is .idx
+      return g_staticParams.databaseInfo.szDatabase;
+
+   if (g_staticParams.szIndexCacheDir[0] != '\0')
+      return IndexCacheFileName();
+
+   return g_staticParams.databaseInfo.szDatabase + string(".idx");
+}
+
+
+// .idx file in peptide_index_cache_dir for the fasta database and the current parameters:
+// <cache dir>/<fasta file name>.<hash of full fasta path>.<IndexParamsHash()>.idx
+// The path hash keeps databases with the same file name in different directories apart.
+string CometFragmentIndex::IndexCacheFileName(void)
+{
+   char szHash[64];
+   char szFullPath[PATH_MAX];
+   const char *pStr;
+   string strIndexFile = g_staticParams.szIndexCacheDir;
+
+   if (strIndexFile.back() != '/' && strIndexFile.back() != '\\')
+#ifdef _WIN32
+      strIndexFile += '\\';
+#else
+      strIndexFile += '/';
+#endif
+
+   if ((pStr = strrchr(g_staticParams.databaseInfo.szDatabase, '\\')) == NULL
+         && (pStr = strrchr(g_staticParams.databaseInfo.szDatabase, '/')) == NULL)
+      pStr = g_staticParams.databaseInfo.szDatabase;
+   else
+      pStr++;
+
+   // realpath is #defined to _fullpath in WIN32
+   if (!realpath(g_staticParams.databaseInfo.szDatabase, szFullPath))
+      strcpy(szFullPath, g_staticParams.databaseInfo.szDatabase);
+
+   sprintf(szHash, ".%08llx.%016llx.idx", HashString(szFullPath) & 0xFFFFFFFFULL, IndexParamsHash());
+
+   return strIndexFile + pStr + szHash;
+}
+
+
+// Returns true if strIndexFile is a .idx file created with the current parameters from the
+// current contents of the fasta database (going by its size and modification time).
+bool CometFragmentIndex::IsIndexCacheCurrent(const string& strIndexFile)
+{
+   FILE *fp;
+   PlainPeptideIndexHeader sHeader;
+   unsigned long long ullHeaderPos = 0;
+   long long llFastaFileSize;
+   long long llFastaMTime;
+
+   if ((fp = fopen(strIndexFile.c_str(), "rb")) == NULL)
+      return false;
+
+   // the last 8 bytes of the file are the position of its PlainPeptideIndexHeader
+   bool bValid = comet_fseek(fp, -(comet_fileoffset_t)sizeof(unsigned long long), SEEK_END) == 0
+         && fread(&ullHeaderPos, sizeof(unsigned long long), 1, fp) == 1
+         && comet_fseek(fp, (comet_fileoffset_t)ullHeaderPos, SEEK_SET) == 0
+         && fread(&sHeader, sizeof(PlainPeptideIndexHeader), 1, fp) == 1;
+
+   fclose(fp);
+
+   return bValid
+      && !memcmp(sHeader.szMagic, "CMTPIDX", sizeof(sHeader.szMagic))
+      && sHeader.iVersion == PLAINIDX_FILE_VERSION
+      && sHeader.iSizeofFileOffset == (int)sizeof(comet_fileoffset_t)
+      && sHeader.ullParamsHash == IndexParamsHash()
+      && GetFileStat(g_staticParams.databaseInfo.szDatabase, &llFastaFileSize, &llFastaMTime)
+      && sHeader.llFastaFileSize == llFastaFileSize
+      && sHeader.llFastaMTime == llFastaMTime;
+}
+
+
+// size and modification time of the .idx file; used to tie the fragment index file to it
+bool CometFragmentIndex::GetIdxFileStat(long long *llSize,
+                                        long long *llMTime)
+{
+   return GetFileStat(PlainPeptideIndexFileName().c_str(), llSize, llMTime);
+}
+
+
+bool CometFragmentIndex::GetFileStat(const char *szFile,
+                                     long long *llSize,
+                                     long long *llMTime)
+{
+#ifdef _WIN32
+   struct _stat64 st;
+   if (_stat64(szFile, &st) != 0)
+      return false;
+#else
+   struct stat st;
+   if (stat(szFile, &st) != 0)
+      return false;
+#endif
+
+   *llSize = (long long)st.st_size;
+   *llMTime = (long long)st.st_mtime;
+
+   return true;
+}
+
+
+// populate header with everything the fragment index depends on; sizes and file positions are set by caller
+void CometFragmentIndex::InitFragmentIndexHeader(FragmentIndexFileHeader *pHeader)
+{
+   memset(pHeader, 0, sizeof(FragmentIndexFileHeader));
+
+   strcpy(pHeader->szMagic, "CMTFRAG");
+   pHeader->iVersion = FRAGINDEX_FILE_VERSION;
+   pHeader->iSizeofFragmentPeptide = (int)sizeof(FragmentPeptidesStruct);
+   pHeader->iNumPrecursorBins = g_staticParams.options.iFragIndexNumPrecursorBins;
+   pHeader->bCompressed = g_staticParams.options.bFragIndexCompress;
+   pHeader->ullMaxFragmentArrayIndex = g_massRange.g_uiMaxFragmentArrayIndex;
+   pHeader->dInverseBinWidth = g_staticParams.dInverseBinWidth;
+   pHeader->dOneMinusBinOffset = g_staticParams.dOneMinusBinOffset;
+   pHeader->dFragIndexMinMass = g_staticParams.options.dFragIndexMinMass;
+   pHeader->dFragIndexMaxMass = g_staticParams.options.dFragIndexMaxMass;
+   pHeader->dPeptideMassLow = g_staticParams.options.dPeptideMassLow;
+   pHeader->dPeptideMassHigh = g_staticParams.options.dPeptideMassHigh;
+
+   if (!GetIdxFileStat(&(pHeader->llIdxFileSize), &(pHeader->llIdxFileMTime)))
+   {
+      pHeader->llIdxFileSize = -1;
+      pHeader->llIdxFileMTime = -1;
+   }
+}
+
+
+// file position of each section of the .idx.frag file from the counts in pHeader
+void CometFragmentIndex::SetFragmentIndexFilePositions(FragmentIndexFileHeader *pHeader)
+{
+   size_t tNumOffsets = (size_t)_iNumPrecursorBins * g_massRange.g_uiMaxFragmentArrayIndex + 1;
+
+   pHeader->ullFragmentPeptidesPos = sizeof(FragmentIndexFileHeader);
+   pHeader->ullPrecursorBinsPos = pHeader->ullFragmentPeptidesPos + pHeader->ullNumFragmentPeptides * sizeof(FragmentPeptidesStruct);
+   pHeader->ullOffsetsPos = pHeader->ullPrecursorBinsPos + _vdPrecursorBinStartMass.size() * sizeof(double);
+   if (pHeader->bCompressed)
+   {
+      pHeader->ullBlockOffsetsPos = pHeader->ullOffsetsPos + tNumOffsets * sizeof(unsigned long long);
+      pHeader->ullBlockPosPos = pHeader->ullBlockOffsetsPos + tNumOffsets * sizeof(unsigned long long);
+      pHeader->ullBlockFirstPos = pHeader->ullBlockPosPos + pHeader->ullNumBlocks * sizeof(unsigned long long);
+      pHeader->ullPackedPos = pHeader->ullBlockFirstPos + pHeader->ullNumBlocks * sizeof(unsigned int);
+   }
+   else
+   {
+      pHeader->ullEntriesPos = pHeader->ullOffsetsPos + tNumOffsets * sizeof(unsigned long long);
+      pHeader->ullPepMassesPos = pHeader->ullEntriesPos + pHeader->ullNumEntries * sizeof(unsigned int);
+   }
+}
+
+
+// copy the contents of file strFile to the end of fp
+bool CometFragmentIndex::AppendFile(FILE *fp,
+                                    const string& strFile)
+{
+   FILE *fpIn;
+
+   if ((fpIn = fopen(strFile.c_str(), "rb")) == NULL)
+      return false;
+
+   vector<char> vBuffer(FRAGINDEX_FILEBUFFERSIZE);
+   size_t tRead;
+   bool bSucceeded = true;
+
+   while (bSucceeded && (tRead = fread(&(vBuffer[0]), 1, vBuffer.size(), fpIn)) > 0)
+      bSucceeded = (fwrite(&(vBuffer[0]), 1, tRead, fp) == tRead);
+
+   if (ferror(fpIn))
+      bSucceeded = false;
+
+   fclose(fpIn);
+
+   return bSucceeded;
+}
+
+
+// Build and write the .idx.frag file one range of precursor bins at a time
+// (fragindex_num_partitions) so that only one partition's fragment ions and entries
+// are ever in memory.  All peptides are first enumerated without fragment ions to
+// place the precursor bins, then each partition recalculates the fragment ions of just
+// the peptides in its mass range.  The file has the same layout as WriteFragmentIndex;
+// the first variable size section is written in place while the ones after it are
+// spooled to temporary files and appended once all partitions are built.
+bool CometFragmentIndex::WritePartitionedFragmentIndex(ThreadPool *tp)
+{
+   if (!g_bPlainPeptideIndexRead)
+      ReadPlainPeptideIndex();
+
+   _iNumPrecursorBins = g_staticParams.options.iFragIndexNumPrecursorBins;
+
+   int iNumIndexingThreads = g_staticParams.options.iNumThreads;
+   if (iNumIndexingThreads > FRAGINDEX_MAX_THREADS)
+      iNumIndexingThreads = FRAGINDEX_MAX_THREADS;
+
+   int iNumPartitions = g_staticParams.options.iFragIndexNumPartitions;
+   if (iNumPartitions > _iNumPrecursorBins)
+      iNumPartitions = _iNumPrecursorBins;
+
+   bool bCompressed = (g_staticParams.options.bFragIndexCompress != 0);
+
+   printf(" - generate fragment index in %d partitions\n", iNumPartitions); fflush(stdout);
+
+   auto tStartTime = chrono::steady_clock::now();
+   cout <<  "   - calculate peptide masses ... "; fflush(stdout);
+
+   _bPeptidesOnly = true;
+   _dPartitionMassLow = 0.0;
+   _dPartitionMassHigh = g_massRange.dMaxMass + 1.0;
+
+   CalculateFragments(iNumIndexingThreads, tp);
+   SortFragmentPeptides(iNumIndexingThreads, g_vFragmentPeptides);
+   SetPrecursorBins(0, true);
+
+   delete[] _puiFragmentPeptideOrder;
+   _puiFragmentPeptideOrder = NULL;
+   _bPeptidesOnly = false;
+
+   cout << ElapsedTime(tStartTime) << endl;
+
+   size_t tNumLists = (size_t)_iNumPrecursorBins * g_massRange.g_uiMaxFragmentArrayIndex;
+
+   g_ullFragmentIndexOffsets = (unsigned long long*)AllocateIndexArray((tNumLists + 1) * sizeof(unsigned long long));
+   if (bCompressed)
+      g_ullFragmentIndexBlockOffsets = (unsigned long long*)AllocateIndexArray((tNumLists + 1) * sizeof(unsigned long long));
+
+   string strFragmentIndexFile = FragmentIndexFileName();
+   string strTmpFile = strFragmentIndexFile + ".tmp";
+   string strTmpFile2 = strFragmentIndexFile + ".tmp2";   // mass keys, or compressed block first entries
+   string strTmpFile3 = strFragmentIndexFile + ".tmp3";   // compressed packed blocks
+
+   FILE *fp = fopen(strTmpFile.c_str(), "wb");
+   FILE *fp2 = fopen(strTmpFile2.c_str(), "wb");
+   FILE *fp3 = (bCompressed ? fopen(strTmpFile3.c_str(), "wb") : NULL);
+
+   bool bSucceeded = (fp != NULL && fp2 != NULL && (!bCompressed || fp3 != NULL));
+
+   FragmentIndexFileHeader sHeader;
+   InitFragmentIndexHeader(&sHeader);
+   sHeader.ullNumFragmentPeptides = g_vFragmentPeptides.size();
+   SetFragmentIndexFilePositions(&sHeader);
+
+   // the header and offsets are written again once all partitions are built
+   if (bSucceeded)
+      bSucceeded = (fwrite(&sHeader, sizeof(FragmentIndexFileHeader), 1, fp) == 1);
+
+   if (bSucceeded && sHeader.ullNumFragmentPeptides > 0)
+      bSucceeded = (fwrite(&(g_vFragmentPeptides[0]), sizeof(FragmentPeptidesStruct), g_vFragmentPeptides.size(), fp) == g_vFragmentPeptides.size());
+
+   if (bSucceeded && _vdPrecursorBinStartMass.size() > 0)
+      bSucceeded = (fwrite(&(_vdPrecursorBinStartMass[0]), sizeof(double), _vdPrecursorBinStartMass.size(), fp) == _vdPrecursorBinStartMass.size());
+
+   if (bSucceeded)
+      bSucceeded = (fwrite(g_ullFragmentIndexOffsets, sizeof(unsigned long long), tNumLists + 1, fp) == tNumLists + 1);
+
+   if (bSucceeded && bCompressed)
+      bSucceeded = (fwrite(g_ullFragmentIndexBlockOffsets, sizeof(unsigned long long), tNumLists + 1, fp) == tNumLists + 1);
+
+   unsigned long long ullNumEntries = 0;
+   unsigned long long ullNumBlocks = 0;
+   unsigned long long ullNumPackedBytes = 0;
+   unsigned long long ullMax = 0;
+   vector<struct FragmentPeptidesStruct> vPartitionPeptides;
+
+   for (int iPartition = 0; bSucceeded && iPartition < iNumPartitions; ++iPartition)
+   {
+      tStartTime = chrono::steady_clock::now();
+      printf("   - partition %d of %d ... ", iPartition + 1, iNumPartitions); fflush(stdout);
+
+      SetPartition(iPartition * _iNumPrecursorBins / iNumPartitions, (iPartition + 1) * _iNumPrecursorBins / iNumPartitions);
+      _ullPartitionFirstEntry = ullNumEntries;
+      _ullPartitionFirstBlock = ullNumBlocks;
+      _ullPartitionFirstPackedByte = ullNumPackedBytes;
+
+      CalculateFragments(iNumIndexingThreads, tp);
+      SortFragmentPeptides(iNumIndexingThreads, vPartitionPeptides);
+
+      // the partition's peptides must be exactly its range of g_vFragmentPeptides
+      if (vPartitionPeptides.size() != _vtPrecursorBinFirstPeptide[_iPartitionEndBin] - _tPartitionFirstPeptide)
+      {
+         printf(" Error in CometFragmentIndex; partition %d has %zu peptides, expected %zu.\n", iPartition + 1,
+               vPartitionPeptides.size(), _vtPrecursorBinFirstPeptide[_iPartitionEndBin] - _tPartitionFirstPeptide);
+         exit(1);
+      }
+      vector<struct FragmentPeptidesStruct>().swap(vPartitionPeptides);
+
+      unsigned long long ullPartitionMax = BuildFragmentIndexPartition(iNumIndexingThreads, tp);
+      if (ullPartitionMax > ullMax)
+         ullMax = ullPartitionMax;
+
+      size_t tEndList = (size_t)_iPartitionEndBin * g_massRange.g_uiMaxFragmentArrayIndex;
+      size_t tNumPartitionEntries = (size_t)(g_ullFragmentIndexOffsets[tEndList] - ullNumEntries);
+
+      if (bCompressed)
+      {
+         CompressFragmentIndex(iNumIndexingThreads, tp, false);
+
+         size_t tNumPartitionBlocks = (size_t)(g_ullFragmentIndexBlockOffsets[tEndList] - ullNumBlocks);
+
+         bSucceeded = (fwrite(g_ullFragmentIndexBlockPos, sizeof(unsigned long long), tNumPartitionBlocks, fp) == tNumPartitionBlocks
+               && fwrite(g_uiFragmentIndexBlockFirst, sizeof(unsigned int), tNumPartitionBlocks, fp2) == tNumPartitionBlocks
+               && fwrite(g_ucFragmentIndexPacked, 1, _tFragmentIndexPackedSize, fp3) == _tFragmentIndexPackedSize);
+
+         ullNumBlocks += tNumPartitionBlocks;
+         ullNumPackedBytes += _tFragmentIndexPackedSize;
+      }
+      else
+      {
+         bSucceeded = (fwrite(g_uiFragmentIndex, sizeof(unsigned int), tNumPartitionEntries, fp) == tNumPartitionEntries
+               && fwrite(g_fFragmentIndexPepMass, sizeof(float), tNumPartitionEntries, fp2) == tNumPartitionEntries);
+      }
+
+      ullNumEntries += tNumPartitionEntries;
+
+      FreeFragmentIndexPartition();
+
+      cout << ElapsedTime(tStartTime) << endl;
+   }
+
+   if (fp2 != NULL && fclose(fp2) != 0)
+      bSucceeded = false;
+   if (fp3 != NULL && fclose(fp3) != 0)
+      bSucceeded = false;
+
+   if (bSucceeded)
+   {
+      tStartTime = chrono::steady_clock::now();
+      cout <<  " - write fragment index ... "; fflush(stdout);
+
+      sHeader.ullNumEntries = ullNumEntries;
+      sHeader.ullNumBlocks = ullNumBlocks;
+      sHeader.ullNumPackedBytes = ullNumPackedBytes;
+      SetFragmentIndexFilePositions(&sHeader);
+
+      bSucceeded = AppendFile(fp, strTmpFile2) && (!bCompressed || AppendFile(fp, strTmpFile3));
+
+      if (bSucceeded)
+      {
+         bSucceeded = (comet_fseek(fp, 0, SEEK_SET) == 0
+               && fwrite(&sHeader, sizeof(FragmentIndexFileHeader), 1, fp) == 1
+               && comet_fseek(fp, (comet_fileoffset_t)sHeader.ullOffsetsPos, SEEK_SET) == 0
+               && fwrite(g_ullFragmentIndexOffsets, sizeof(unsigned long long), tNumLists + 1, fp) == tNumLists + 1);
+      }
+
+      if (bSucceeded && bCompressed)
+      {
+         bSucceeded = (comet_fseek(fp, (comet_fileoffset_t)sHeader.ullBlockOffsetsPos, SEEK_SET) == 0
+               && fwrite(g_ullFragmentIndexBlockOffsets, sizeof(unsigned long long), tNumLists + 1, fp) == tNumLists + 1);
+      }
+   }
+
+   if (fp != NULL && fclose(fp) != 0)
+      bSucceeded = false;
+
+   remove(strTmpFile2.c_str());
+   remove(strTmpFile3.c_str());
+
+   // rename into place only when complete so a concurrent search never maps a partial file
+   if (bSucceeded)
+   {
+      remove(strFragmentIndexFile.c_str());
+      bSucceeded = (rename(strTmpFile.c_str(), strFragmentIndexFile.c_str()) == 0);
+   }
+
+   FreeIndexArray(g_ullFragmentIndexBlockOffsets, (tNumLists + 1) * sizeof(unsigned long long));
+   FreeIndexArray(g_ullFragmentIndexOffsets, (tNumLists + 1) * sizeof(unsigned long long));
+   g_ullFragmentIndexBlockOffsets = NULL;
+   g_ullFragmentIndexOffsets = NULL;
+
+   if (!bSucceeded)
+   {
+      remove(strTmpFile.c_str());
+
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot write fragment index file %s\n", strFragmentIndexFile.c_str());
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   cout << ElapsedTime(tStartTime) << endl;
+   printf("   - total # of entries in the fragment index: %0.2E (max %lld)\n", (double)ullNumEntries, ullMax);
+
+   string strOut = " - done. " + strFragmentIndexFile + "\n\n";
+   logout(strOut.c_str());
+   fflush(stdout);
+
+   return true;
+}
+
+
+// Write the in-memory fragment index to the .idx.frag file.  Layout is the
+// header, g_vFragmentPeptides, precursor bin start masses, g_ullFragmentIndexOffsets, then
+// g_uiFragmentIndex and g_fFragmentIndexPepMass or, for a compressed index, the block offsets,
+// positions, first entries and packed data so that ReadFragmentIndex can use the memory mapped
+// file as is.
+bool CometFragmentIndex::WriteFragmentIndex(void)
+{
+   FILE *fp;
+   string strFragmentIndexFile = FragmentIndexFileName();
+   string strTmpFile = strFragmentIndexFile + ".tmp";
+
+   auto tStartTime = chrono::steady_clock::now();
+   cout <<  " - write fragment index ... "; fflush(stdout);
+
+   if ((fp = fopen(strTmpFile.c_str(), "wb")) == NULL)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot open fragment index file %s to write\n", strTmpFile.c_str());
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   FragmentIndexFileHeader sHeader;
+   InitFragmentIndexHeader(&sHeader);
+
+   size_t tNumOffsets = (size_t)_iNumPrecursorBins * g_massRange.g_uiMaxFragmentArrayIndex + 1;
+   size_t tNumEntries = (size_t)g_ullFragmentIndexOffsets[tNumOffsets - 1];
+
+   sHeader.ullNumFragmentPeptides = g_vFragmentPeptides.size();
+   sHeader.ullNumEntries = tNumEntries;
+   if (sHeader.bCompressed)
+   {
+      sHeader.ullNumBlocks = g_ullFragmentIndexBlockOffsets[tNumOffsets - 1];
+      sHeader.ullNumPackedBytes = _tFragmentIndexPackedSize;
+   }
+   SetFragmentIndexFilePositions(&sHeader);
+
+   bool bSucceeded = (fwrite(&sHeader, sizeof(FragmentIndexFileHeader), 1, fp) == 1);
+
+   if (bSucceeded && sHeader.ullNumFragmentPeptides > 0)
+      bSucceeded = (fwrite(&(g_vFragmentPeptides[0]), sizeof(FragmentPeptidesStruct), g_vFragmentPeptides.size(), fp) == g_vFragmentPeptides.size());
+
+   if (bSucceeded && _vdPrecursorBinStartMass.size() > 0)
+      bSucceeded = (fwrite(&(_vdPrecursorBinStartMass[0]), sizeof(double), _vdPrecursorBinStartMass.size(), fp) == _vdPrecursorBinStartMass.size());
+
+   if (bSucceeded)
+      bSucceeded = (fwrite(g_ullFragmentIndexOffsets, sizeof(unsigned long long), tNumOffsets, fp) == tNumOffsets);
+
+   if (sHeader.bCompressed)
+   {
+      size_t tNumBlocks = (size_t)sHeader.ullNumBlocks;
+
+      if (bSucceeded)
+         bSucceeded = (fwrite(g_ullFragmentIndexBlockOffsets, sizeof(unsigned long long), tNumOffsets, fp) == tNumOffsets);
+
+      if (bSucceeded && tNumBlocks > 0)
+         bSucceeded = (fwrite(g_ullFragmentIndexBlockPos, sizeof(unsigned long long), tNumBlocks, fp) == tNumBlocks);
+
+      if (bSucceeded && tNumBlocks > 0)
+         bSucceeded = (fwrite(g_uiFragmentIndexBlockFirst, sizeof(unsigned int), tNumBlocks, fp) == tNumBlocks);
+
+      if (bSucceeded && _tFragmentIndexPackedSize > 0)
+         bSucceeded = (fwrite(g_ucFragmentIndexPacked, 1, _tFragmentIndexPackedSize, fp) == _tFragmentIndexPackedSize);
+   }
+   else
+   {
+      if (bSucceeded && tNumEntries > 0)
+         bSucceeded = (fwrite(g_uiFragmentIndex, sizeof(unsigned int), tNumEntries, fp) == tNumEntries);
+
+      if (bSucceeded && tNumEntries > 0)
+         bSucceeded = (fwrite(g_fFragmentIndexPepMass, sizeof(float), tNumEntries, fp) == tNumEntries);
+   }
+
+   if (fclose(fp) != 0)
+      bSucceeded = false;
+
+   // rename into place only when complete so a concurrent search never maps a partial file
+   if (bSucceeded)
+   {
+      remove(strFragmentIndexFile.c_str());
+      bSucceeded = (rename(strTmpFile.c_str(), strFragmentIndexFile.c_str()) == 0);
+   }
+
+   if (!bSucceeded)
+   {
+      remove(strTmpFile.c_str());
+
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot write fragment index file %s\n", strFragmentIndexFile.c_str());
+      logerr(szErrorMsg);
+      return false;
+   }
+
+   cout << ElapsedTime(tStartTime) << endl;
+
+   string strOut = " - done. " + strFragmentIndexFile + "\n\n";
+   logout(strOut.c_str());
+   fflush(stdout);
+
+   return true;
+}
+
+
+// Memory map the .idx.frag file and point g_ullFragmentIndexOffsets, g_uiFragmentIndex
+// and g_fFragmentIndexPepMass into it.  Returns false, leaving nothing allocated, if the file is not present
+// or was generated from a different .idx or different fragment index parameters.
+bool CometFragmentIndex::ReadFragmentIndex(void)
+{
+   string strFragmentIndexFile = FragmentIndexFileName();
+
+   if (!MapFile(strFragmentIndexFile, &_sFragmentIndexMap))
+      return false;
+
+   char *pMap = _sFragmentIndexMap.pMap;
+   size_t tFileSize = _sFragmentIndexMap.tSize;
+
+   if (tFileSize < sizeof(FragmentIndexFileHeader))
+   {
+      UnmapFile(&_sFragmentIndexMap);
+      return false;
+   }
+
+   FragmentIndexFileHeader sExpected;
+   FragmentIndexFileHeader *pHeader = (FragmentIndexFileHeader*)pMap;
+
+   InitFragmentIndexHeader(&sExpected);
+
+   unsigned long long ullNumOffsets = (unsigned long long)pHeader->iNumPrecursorBins * pHeader->ullMaxFragmentArrayIndex + 1;
+
+   if (memcmp(pHeader->szMagic, sExpected.szMagic, sizeof(sExpected.szMagic))
+         || pHeader->iVersion != sExpected.iVersion
+         || pHeader->iSizeofFragmentPeptide != sExpected.iSizeofFragmentPeptide
+         || pHeader->iNumPrecursorBins != sExpected.iNumPrecursorBins
+         || pHeader->ullMaxFragmentArrayIndex != sExpected.ullMaxFragmentArrayIndex
+         || pHeader->llIdxFileSize != sExpected.llIdxFileSize
+         || pHeader->llIdxFileMTime != sExpected.llIdxFileMTime
+         || pHeader->dInverseBinWidth != sExpected.dInverseBinWidth
+         || pHeader->dOneMinusBinOffset != sExpected.dOneMinusBinOffset
+         || pHeader->dFragIndexMinMass != sExpected.dFragIndexMinMass
+         || pHeader->dFragIndexMaxMass != sExpected.dFragIndexMaxMass
+         || pHeader->dPeptideMassLow != sExpected.dPeptideMassLow
+         || pHeader->dPeptideMassHigh != sExpected.dPeptideMassHigh
+         || pHeader->ullFragmentPeptidesPos + pHeader->ullNumFragmentPeptides * sizeof(FragmentPeptidesStruct) > pHeader->ullPrecursorBinsPos
+         || pHeader->ullPrecursorBinsPos + (pHeader->iNumPrecursorBins - 1) * sizeof(double) > pHeader->ullOffsetsPos
+         || pHeader->bCompressed != sExpected.bCompressed
+         || (!pHeader->bCompressed
+            && (pHeader->ullOffsetsPos + ullNumOffsets * sizeof(unsigned long long) > pHeader->ullEntriesPos
+               || pHeader->ullEntriesPos + pHeader->ullNumEntries * sizeof(unsigned int) > pHeader->ullPepMassesPos
+               || pHeader->ullPepMassesPos + pHeader->ullNumEntries * sizeof(float) > tFileSize))
+         || (pHeader->bCompressed
+            && (pHeader->ullOffsetsPos + ullNumOffsets * sizeof(unsigned long long) > pHeader->ullBlockOffsetsPos
+               || pHeader->ullBlockOffsetsPos + ullNumOffsets * sizeof(unsigned long long) > pHeader->ullBlockPosPos
+               || pHeader->ullBlockPosPos + pHeader->ullNumBlocks * sizeof(unsigned long long) > pHeader->ullBlockFirstPos
+               || pHeader->ullBlockFirstPos + pHeader->ullNumBlocks * sizeof(unsigned int) > pHeader->ullPackedPos
+               || pHeader->ullPackedPos + pHeader->ullNumPackedBytes > tFileSize)))
+   {
+      printf(" - fragment index file %s does not match current parameters; building index in memory\n", strFragmentIndexFile.c_str());
+      UnmapFile(&_sFragmentIndexMap);
+      return false;
+   }
+
+   auto tStartTime = chrono::steady_clock::now();
+   cout <<  " - map fragment index ... "; fflush(stdout);
+
+   double *pdPrecursorBinStartMass = (double*)(pMap + pHeader->ullPrecursorBinsPos);
+   unsigned long long *pullOffsets = (unsigned long long*)(pMap + pHeader->ullOffsetsPos);
+   unsigned long long ullMax = 0;
+   bool bValid = (pullOffsets[0] == 0 && pullOffsets[ullNumOffsets - 1] == pHeader->ullNumEntries);
+
+   for (int i = 1; bValid && i < pHeader->iNumPrecursorBins - 1; ++i)
+   {
+      if (pdPrecursorBinStartMass[i] < pdPrecursorBinStartMass[i - 1])
+         bValid = false;
+   }
+
+   for (unsigned long long i = 1; bValid && i < ullNumOffsets; ++i)
+   {
+      if (pullOffsets[i] < pullOffsets[i - 1])
+         bValid = false;
+      else if (pullOffsets[i] - pullOffsets[i - 1] > ullMax)
+         ullMax = pullOffsets[i] - pullOffsets[i - 1];
+   }
+
+   // each compressed list must have exactly the blocks its entries need
+   // and each block must start within the packed data
+   unsigned long long *pullBlockOffsets = (unsigned long long*)(pMap + pHeader->ullBlockOffsetsPos);
+   unsigned long long *pullBlockPos = (unsigned long long*)(pMap + pHeader->ullBlockPosPos);
+
+   if (bValid && pHeader->bCompressed)
+   {
+      bValid = (pullBlockOffsets[0] == 0 && pullBlockOffsets[ullNumOffsets - 1] == pHeader->ullNumBlocks);
+
+      for (unsigned long long i = 1; bValid && i < ullNumOffsets; ++i)
+      {
+         if (pullBlockOffsets[i] - pullBlockOffsets[i - 1]
+               != (pullOffsets[i] - pullOffsets[i - 1] + FRAGINDEX_POSTINGBLOCKSIZE - 1) / FRAGINDEX_POSTINGBLOCKSIZE)
+         {
+            bValid = false;
+         }
+      }
+
+      for (unsigned long long i = 0; bValid && i < pHeader->ullNumBlocks; ++i)
+      {
+         if (pullBlockPos[i] >= pHeader->ullNumPackedBytes)
+            bValid = false;
+      }
+   }
+
+   if (!bValid)
+   {
+      printf(" - fragment index file %s is corrupt; building index in memory\n", strFragmentIndexFile.c_str());
+      UnmapFile(&_sFragmentIndexMap);
+      return false;
+   }
+
+   // the peptides are used in place so concurrent searches share them too
+   g_pFragmentPeptides = (FragmentPeptidesStruct*)(pMap + pHeader->ullFragmentPeptidesPos);
+   g_tNumFragmentPeptides = (size_t)pHeader->ullNumFragmentPeptides;
+
+   _iNumPrecursorBins = pHeader->iNumPrecursorBins;
+   _vdPrecursorBinStartMass.assign(pdPrecursorBinStartMass, pdPrecursorBinStartMass + _iNumPrecursorBins - 1);
+
+   g_ullFragmentIndexOffsets = pullOffsets;
+
+   if (pHeader->bCompressed)
+   {
+      g_ullFragmentIndexBlockOffsets = pullBlockOffsets;
+      g_ullFragmentIndexBlockPos = pullBlockPos;
+      g_uiFragmentIndexBlockFirst = (unsigned int*)(pMap + pHeader->ullBlockFirstPos);
+      g_ucFragmentIndexPacked = (unsigned char*)(pMap + pHeader->ullPackedPos);
+      _tFragmentIndexPackedSize = (size_t)pHeader->ullNumPackedBytes;
+   }
+   else
+   {
+      g_uiFragmentIndex = (unsigned int*)(pMap + pHeader->ullEntriesPos);
+      g_fFragmentIndexPepMass = (float*)(pMap + pHeader->ullPepMassesPos);
+   }
+
+   cout << ElapsedTime(tStartTime) << endl;
+   printf("   - total # of entries in the fragment index: %0.2E (max %lld)\n", (double)pHeader->ullNumEntries, ullMax);
+   printf("   - fragment index memory: %0.1f MB (%0.2f bytes per entry)\n", FragmentIndexMemory() / 1048576.0,
+         pHeader->ullNumEntries > 0 ? (double)FragmentIndexMemory() / pHeader->ullNumEntries : 0.0);
+
+   return true;
+}
+
+
+// Build the full fragment index, write it to the .idx.frag file and map it.  Concurrent
+// searches of the same database serialize on the .idx.frag.lock file so only the first
+// one builds the index; the rest map the file it writes.  The file is renamed into place
+// when complete so searches already mapping a stale version keep their copy.  Returns
+// false, with g_bIndexPrecursors unchanged, if the index could not be written or mapped.
+bool CometFragmentIndex::PublishFragmentIndex(ThreadPool *tp)
+{
+   if (!LockFragmentIndexFile())
+   {
+      printf(" - cannot lock fragment index file %s.lock; building index in memory\n", FragmentIndexFileName().c_str());
+      return false;
+   }
+
+   // another process may have written the file while this one waited for the lock
+   bool bSucceeded = ReadFragmentIndex();
+
+   if (!bSucceeded)
+   {
+      // the shared index covers all precursors, not just this search's
+      int iNumPrecursorBINs = BIN(g_staticParams.options.dPeptideMassHigh);
+      bool *pbSavedIndexPrecursors = (bool*)malloc(iNumPrecursorBINs);
+
+      if (pbSavedIndexPrecursors == NULL)
+      {
+         printf("\n Error cannot allocate memory for g_bIndexPrecursors(%d)\n", iNumPrecursorBINs);
+         UnlockFragmentIndexFile();
+         return false;
+      }
+
+      memcpy(pbSavedIndexPrecursors, g_bIndexPrecursors, iNumPrecursorBINs);
+      for (int x = 0; x < iNumPrecursorBINs; ++x)
+         g_bIndexPrecursors[x] = true;
+
+      printf(" - publishing fragment index file %s\n", FragmentIndexFileName().c_str());
+
+      _iNumPrecursorBins = g_staticParams.options.iFragIndexNumPrecursorBins;
+
+      if (g_staticParams.options.iFragIndexNumPartitions > 1)
+         bSucceeded = WritePartitionedFragmentIndex(tp);
+      else
+      {
+         GenerateFragmentIndex(tp, true);
+         bSucceeded = WriteFragmentIndex();
+         DeallocateFragmentIndex();
+      }
+
+      // searches use the peptides in the mapped file
+      vector<struct FragmentPeptidesStruct>().swap(g_vFragmentPeptides);
+
+      memcpy(g_bIndexPrecursors, pbSavedIndexPrecursors, iNumPrecursorBINs);
+      free(pbSavedIndexPrecursors);
+
+      if (bSucceeded)
+         bSucceeded = ReadFragmentIndex();
+   }
+
+   UnlockFragmentIndexFile();
+
+   return bSucceeded;
+}
+
+
+// Block until this process holds the exclusive lock on the .idx.frag.lock file.  The
+// lock file is left in place; removing it would let a waiting process lock an unlinked file.
+bool CometFragmentIndex::LockFragmentIndexFile(void)
+{
+   string strLockFile = FragmentIndexFileName() + ".lock";
+
+#ifdef _WIN32
+   _hFragmentIndexLockFile = CreateFileA(strLockFile.c_str(), GENERIC_READ | GENERIC_WRITE,
+         FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (_hFragmentIndexLockFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   OVERLAPPED sOverlapped;
+   memset(&sOverlapped, 0, sizeof(OVERLAPPED));
+
+   if (!LockFileEx(_hFragmentIndexLockFile, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &sOverlapped))
+   {
+      CloseHandle(_hFragmentIndexLockFile);
+      _hFragmentIndexLockFile = INVALID_HANDLE_VALUE;
+      return false;
+   }
+#else
+   _iFragmentIndexLockFile = open(strLockFile.c_str(), O_RDWR | O_CREAT, 0666);
+   if (_iFragmentIndexLockFile < 0)
+      return false;
+
+   if (flock(_iFragmentIndexLockFile, LOCK_EX) != 0)
+   {
+      close(_iFragmentIndexLockFile);
+      _iFragmentIndexLockFile = -1;
+      return false;
+   }
+#endif
+
+   return true;
+}
+
+
+// closing the lock file releases the lock
+void CometFragmentIndex::UnlockFragmentIndexFile(void)
+{
+#ifdef _WIN32
+   if (_hFragmentIndexLockFile != INVALID_HANDLE_VALUE)
+   {
+      CloseHandle(_hFragmentIndexLockFile);
+      _hFragmentIndexLockFile = INVALID_HANDLE_VALUE;
+   }
+#else
+   if (_iFragmentIndexLockFile >= 0)
+   {
+      close(_iFragmentIndexLockFile);
+      _iFragmentIndexLockFile = -1;
+   }
+#endif
+}
+
+
+// pad the file with zeros up to the next 8 byte aligned position
+bool CometFragmentIndex::WritePadding(FILE *fp)
+{
+   static const char szZeros[8] = {0};
+   size_t tPad = (size_t)((8 - comet_ftell(fp) % 8) % 8);
+
+   return (tPad == 0 || fwrite(szZeros, 1, tPad, fp) == tPad);
+}
+
+
+// Memory map strFile read-only.  The mapping is shared so that concurrent searches
+// share the page cache copy of the file.
+bool CometFragmentIndex::MapFile(const string& strFile,
+                                 MappedFileStruct *pMappedFile)
+{
+   pMappedFile->pMap = NULL;
+   pMappedFile->tSize = 0;
+
+#ifdef _WIN32
+   HANDLE hFile = CreateFileA(strFile.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   LARGE_INTEGER liSize;
+   if (!GetFileSizeEx(hFile, &liSize) || liSize.QuadPart == 0)
+   {
+      CloseHandle(hFile);
+      return false;
+   }
+
+   HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (hMapping == NULL)
+   {
+      CloseHandle(hFile);
+      return false;
+   }
+
+   char *pMap = (char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+   if (pMap == NULL)
+   {
+      CloseHandle(hMapping);
+      CloseHandle(hFile);
+      return false;
+   }
+
+   pMappedFile->hFile = hFile;
+   pMappedFile->hMapping = hMapping;
+   pMappedFile->pMap = pMap;
+   pMappedFile->tSize = (size_t)liSize.QuadPart;
+#else
+   int fd = open(strFile.c_str(), O_RDONLY);
+   if (fd < 0)
+      return false;
+
+   struct stat st;
+   if (fstat(fd, &st) != 0 || st.st_size == 0)
+   {
+      close(fd);
+      return false;
+   }
+
+   void *pTmp = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (pTmp == MAP_FAILED)
+      return false;
+
+   pMappedFile->pMap = (char*)pTmp;
+   pMappedFile->tSize = (size_t)st.st_size;
+#endif
+
+   return true;
+}
+
+
+void CometFragmentIndex::UnmapFile(MappedFileStruct *pMappedFile)
+{
+   if (pMappedFile->pMap == NULL)
+      return;
+
+#ifdef _WIN32
+   UnmapViewOfFile(pMappedFile->pMap);
+   CloseHandle(pMappedFile->hMapping);
+   CloseHandle(pMappedFile->hFile);
+#else
+   munmap(pMappedFile->pMap, pMappedFile->tSize);
+#endif
+
+   pMappedFile->pMap = NULL;
+   pMappedFile->tSize = 0;
+}
+
+
+// release fragment index whether it was built in memory or mapped from file
+void CometFragmentIndex::DeallocateFragmentIndex(void)
+{
+   if (_sFragmentIndexMap.pMap != NULL)
+      UnmapFile(&_sFragmentIndexMap);
+   else if (g_ullFragmentIndexOffsets != NULL)
+   {
+      size_t tNumOffsets = (size_t)_iNumPrecursorBins * g_massRange.g_uiMaxFragmentArrayIndex + 1;
+
+      // an index built in memory is a single partition
+      FreeFragmentIndexPartition();
+
+      FreeIndexArray(g_ullFragmentIndexBlockOffsets, tNumOffsets * sizeof(unsigned long long));
+      FreeIndexArray(g_ullFragmentIndexOffsets, tNumOffsets * sizeof(unsigned long long));
+   }
+
+   g_ullFragmentIndexOffsets = NULL;
+   g_uiFragmentIndex = NULL;
+   g_fFragmentIndexPepMass = NULL;
+   g_ullFragmentIndexBlockOffsets = NULL;
+   g_uiFragmentIndexBlockFirst = NULL;
+   g_ullFragmentIndexBlockPos = NULL;
+   g_ucFragmentIndexPacked = NULL;
+   _tFragmentIndexPackedSize = 0;
+   g_pFragmentPeptides = NULL;
+   g_tNumFragmentPeptides = 0;
+}
+
+
+// Allocate one of the large fragment index arrays.  On Linux these are anonymous
+// mappings flagged for transparent huge pages to cut TLB misses on the random
+// accesses made while querying the index.
+void* CometFragmentIndex::AllocateIndexArray(size_t tBytes)
+{
+   void *pArray;
+
+   if (tBytes == 0)
+      tBytes = sizeof(unsigned long long);
+
+#ifdef __linux__
+   pArray = mmap(NULL, tBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (pArray == MAP_FAILED)
+      pArray = NULL;
+#ifdef MADV_HUGEPAGE
+   else
+      madvise(pArray, tBytes, MADV_HUGEPAGE);
+#endif
+#else
+   pArray = malloc(tBytes);
+#endif
+
+   if (pArray == NULL)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - cannot allocate %zu bytes for fragment index\n", tBytes);
+      logerr(szErrorMsg);
+      exit(1);
+   }
+
+   return pArray;
+}
+
+
+void CometFragmentIndex::FreeIndexArray(void *pArray,
+                                        size_t tBytes)
+{
+   if (pArray == NULL)
+      return;
+
+   if (tBytes == 0)
+      tBytes = sizeof(unsigned long long);
+
+#ifdef __linux__
+   munmap(pArray, tBytes);
+#else
+   free(pArray);
+#endif
+}
+
+
+// bytes used by the offsets, entries and mass keys (or compressed blocks) of the fragment index
+size_t CometFragmentIndex::FragmentIndexMemory(void)
+{
+   if (g_ullFragmentIndexOffsets == NULL)
+      return 0;
+
+   size_t tNumOffsets = (size_t)_iNumPrecursorBins * g_massRange.g_uiMaxFragmentArrayIndex + 1;
+
+   if (g_ullFragmentIndexBlockOffsets != NULL)
+   {
+      return 2 * tNumOffsets * sizeof(unsigned long long)
+         + g_ullFragmentIndexBlockOffsets[tNumOffsets - 1] * (sizeof(unsigned int) + sizeof(unsigned long long))
+         + _tFragmentIndexPackedSize;
+   }
+
+   return tNumOffsets * sizeof(unsigned long long)
+      + g_ullFragmentIndexOffsets[tNumOffsets - 1] * (sizeof(unsigned int) + sizeof(float));
+}
+
+
+// for a given MH+ precursor mass, return the precursor bin used to locate entries in g_ullFragmentIndexOffsets
+int CometFragmentIndex::WhichPrecursorBin(double dMass)
+{
+   // # of precursor bins starting at or below dMass
+   return (int)(std::upper_bound(_vdPrecursorBinStartMass.begin(), _vdPrecursorBinStartMass.end(), dMass)
+         - _vdPrecursorBinStartMass.begin());
+}
+
+
+// Place the precursor bin boundaries so each bin holds the same number of the
+// mass ordered g_vFragmentPeptides, and record the first peptide of each bin.
+// Peptide masses are concentrated in a narrow range so uniform width bins would
+// leave a few bins holding most of the fragment index entries.
+void CometFragmentIndex::SetPrecursorBins(unsigned long long ullNumFragments,
+                                          bool bPersist)
+{
+   size_t tNumPeptides = g_vFragmentPeptides.size();
+
+   // Every precursor bin costs g_uiMaxFragmentArrayIndex offsets whether or not it
+   // holds any entries.  An index pruned to the input precursors can be small enough
+   // for those offsets to dominate its memory, so use fewer bins when they would
+   // average fewer entries than lists.  Only the default bin count is lowered; a
+   // count set in fragindex_num_precursorbins, and the one a persisted index
+   // records, are kept.
+   if (!bPersist && g_staticParams.options.iFragIndexNumPrecursorBins == FRAGINDEX_PRECURSORBINS)
+   {
+      unsigned long long ullMaxBins = ullNumFragments / g_massRange.g_uiMaxFragmentArrayIndex;
+
+      if (ullMaxBins < 1)
+         ullMaxBins = 1;
+      if ((unsigned long long)_iNumPrecursorBins > ullMaxBins)
+         _iNumPrecursorBins = (int)ullMaxBins;
+   }
+
+   _vdPrecursorBinStartMass.clear();
+
+   for (int iPrecursorBin = 1; iPrecursorBin < _iNumPrecursorBins; ++iPrecursorBin)
+   {
+      if (tNumPeptides == 0)
       {
-         fread(&clTmp, clSizeCometFileOffset, 1, fp);
-         vTmp.push_back(clTmp);
+         // nothing to index; fall back to uniform width bins
+         _vdPrecursorBinStartMass.push_back(g_staticParams.options.dPeptideMassLow
+               + iPrecursorBin * (g_massRange.dMaxMass - g_staticParams.options.dPeptideMassLow) / _iNumPrecursorBins);
       }
-      g_pvProteinsList.push_back(vTmp);
+      else
+         _vdPrecursorBinStartMass.push_back(g_vFragmentPeptides[tNumPeptides * iPrecursorBin / _iNumPrecursorBins].dPepMass);
+   }
+
+   // peptides of equal mass all fall in the bin WhichPrecursorBin() returns for that mass
+   _vtPrecursorBinFirstPeptide.assign(_iNumPrecursorBins + 1, tNumPeptides);
+   _vtPrecursorBinFirstPeptide[0] = 0;
+
+   for (int iPrecursorBin = 1; iPrecursorBin < _iNumPrecursorBins; ++iPrecursorBin)
+   {
+      _vtPrecursorBinFirstPeptide[iPrecursorBin] = std::lower_bound(g_vFragmentPeptides.begin(), g_vFragmentPeptides.end(),
+            _vdPrecursorBinStartMass[iPrecursorBin - 1],
+            [](const FragmentPeptidesStruct& a, double dMass) { return a.dPepMass < dMass; }) - g_vFragmentPeptides.begin();
    }
+}
 
-   comet_fseek(fp, clPermutationsFilePos, SEEK_SET);  // should be at this file position here anyways already
 
-   unsigned long ulSizeModSeqs;        // size of MOD_SEQS
-   unsigned long ulSizevRawPeptides;   // size of g_vRawPeptides
-   unsigned long ulModNumSize;         // size of MOD_NUMBERS
+// Sort vDBIndex with pfnCompare.  Each thread sorts one chunk, then pairs of adjacent
+// sorted runs are merged in parallel until a single run is left.
+void CometFragmentIndex::SortDBIndex(vector<DBIndex>& vDBIndex,
+                                     bool (*pfnCompare)(const DBIndex&, const DBIndex&),
+                                     int iNumThreads,
+                                     ThreadPool *tp)
+{
+   vector<size_t> vtBounds(iNumThreads + 1);
 
-   fread(&ulSizeModSeqs, sizeof(unsigned long), 1, fp);
-   fread(&ulSizevRawPeptides, sizeof(unsigned long), 1, fp);
-   fread(&ulModNumSize, sizeof(unsigned long), 1, fp);
+   for (int i = 0; i <= iNumThreads; ++i)
+      vtBounds[i] = vDBIndex.size() * i / iNumThreads;
 
-   MOD_SEQ_MOD_NUM_START = new int[ulSizeModSeqs];
-   MOD_SEQ_MOD_NUM_CNT = new int[ulSizeModSeqs];
-   PEPTIDE_MOD_SEQ_IDXS = new int[ulSizevRawPeptides];
+   for (int i = 0; i < iNumThreads; ++i)
+      tp->doJob(std::bind(SortDBIndexThreadProc, &vDBIndex, vtBounds[i], vtBounds[i + 1], vtBounds[i + 1], pfnCompare));
+   tp->wait_on_threads();
 
-   fread(MOD_SEQ_MOD_NUM_START, sizeof(int), ulSizeModSeqs, fp);
-   fread(MOD_SEQ_MOD_NUM_CNT, sizeof(int), ulSizeModSeqs, fp);
-   fread(PEPTIDE_MOD_SEQ_IDXS, sizeof(int), ulSizevRawPeptides, fp);  //FIX
-   int iTmp;
-   char szTmp[MAX_PEPTIDE_LEN];
-   for (unsigned long i = 0; i < ulSizeModSeqs; ++i)
+   for (int iWidth = 1; iWidth < iNumThreads; iWidth *= 2)
    {
-      fread(&iTmp, sizeof(int), 1, fp); // read length
-      fread(szTmp, 1, iTmp, fp);
-      szTmp[iTmp]='\0';
-      MOD_SEQS.push_back(szTmp);
+      for (int i = 0; i + iWidth < iNumThreads; i += 2 * iWidth)
+      {
+         int iLast = (i + 2 * iWidth < iNumThreads ? i + 2 * iWidth : iNumThreads);
+
+         tp->doJob(std::bind(SortDBIndexThreadProc, &vDBIndex, vtBounds[i], vtBounds[i + iWidth], vtBounds[iLast], pfnCompare));
+      }
+      tp->wait_on_threads();
    }
-   for (unsigned long i = 0; i < ulModNumSize; ++i)
+}
+
+
+// Sort entries tFirst up to tLast when tMiddle is tLast; otherwise merge the sorted
+// runs tFirst up to tMiddle and tMiddle up to tLast.
+void CometFragmentIndex::SortDBIndexThreadProc(vector<DBIndex>* pvDBIndex,
+                                               size_t tFirst,
+                                               size_t tMiddle,
+                                               size_t tLast,
+                                               bool (*pfnCompare)(const DBIndex&, const DBIndex&))
+{
+   if (tMiddle == tLast)
+      sort(pvDBIndex->begin() + tFirst, pvDBIndex->begin() + tLast, pfnCompare);
+   else
+      inplace_merge(pvDBIndex->begin() + tFirst, pvDBIndex->begin() + tMiddle, pvDBIndex->begin() + tLast, pfnCompare);
+}
+
+
+// Create the protein list of each peptide in the peptide sorted entries tFirst up to
+// tLast, set each entry's lIndexProteinFilePosition to its list's index within the range,
+// then remove duplicate entries, leaving the *ptNumUnique remaining ones at tFirst.
+void CometFragmentIndex::ProteinListsThreadProc(vector<DBIndex>* pvDBIndex,
+                                                size_t tFirst,
+                                                size_t tLast,
+                                                vector<vector<comet_fileoffset_t>>* pvProteinsList,
+                                                size_t* ptNumUnique)
+{
+   vector<DBIndex>& vDBIndex = *pvDBIndex;
+   vector<comet_fileoffset_t> temp;  // stores list of duplicate proteins which gets pushed to pvProteinsList
+   comet_fileoffset_t lProtCount = 0;
+
+   for (size_t i = tFirst; i < tLast; ++i)
    {
-      ModificationNumber sTmp;
-      fread(&iTmp, sizeof(int), 1, fp); // read length
-      fread(szTmp, 1, iTmp, fp);
-      szTmp[iTmp]='\0';
-      sTmp.modStringLen = iTmp;
-      sTmp.modifications = new char[iTmp];
-      memcpy(sTmp.modifications, szTmp, iTmp);
-      MOD_NUMBERS.push_back(sTmp);
+      // each unique peptide will have the same list of matched proteins
+      if (i > tFirst && strcmp(vDBIndex[i].szPeptide, vDBIndex[i - 1].szPeptide))
+      {
+         // different peptide so go ahead and push temp onto pvProteinsList
+         pvProteinsList->push_back(temp);
+
+         lProtCount++; // start new row in pvProteinsList
+         temp.clear();
+      }
+
+      temp.push_back(vDBIndex[i].lIndexProteinFilePosition);
+      vDBIndex[i].lIndexProteinFilePosition = lProtCount;
    }
 
-   fclose(fp);
+   if (tLast > tFirst)
+      pvProteinsList->push_back(temp);
+
+   *ptNumUnique = unique(vDBIndex.begin() + tFirst, vDBIndex.begin() + tLast) - (vDBIndex.begin() + tFirst);
+}
+
+
+// Number of bytes holding tNumResidues 5 bit packed residues plus one pad byte so that
+// GetRawPeptide can always read the two bytes a residue may span.
+unsigned long long CometFragmentIndex::PackedResidueBytes(unsigned long long ullNumResidues)
+{
+   return (ullNumResidues * 5 + 7) / 8 + 1;
+}
+
+
+// Pack tNumResidues residues (A to Z) to 5 bits each, see GetRawPeptide, and write them
+// to fp.  *pullNumBytes is set to the # of bytes written.
+bool CometFragmentIndex::WritePackedResidues(FILE *fp,
+                                             const char *szResidues,
+                                             size_t tNumResidues,
+                                             unsigned long long *pullNumBytes)
+{
+   vector<unsigned char> vucBuffer;
+   unsigned long long ullBits = 0;
+   int iNumBits = 0;
+   bool bSucceeded = true;
+
+   vucBuffer.reserve(FRAGINDEX_FILEBUFFERSIZE);
+   *pullNumBytes = 0;
+
+   for (size_t i = 0; bSucceeded && i <= tNumResidues; ++i)
+   {
+      if (i < tNumResidues)
+      {
+         if (szResidues[i] < 'A' || szResidues[i] > 'Z')
+            return false;
+
+         ullBits |= (unsigned long long)(szResidues[i] - 'A') << iNumBits;
+         iNumBits += 5;
+      }
+      else
+      {
+         iNumBits += 15;  // flush the last partial byte and add the pad byte
+      }
+
+      while (iNumBits >= 8)
+      {
+         vucBuffer.push_back((unsigned char)(ullBits & 0xFF));
+         ullBits >>= 8;
+         iNumBits -= 8;
+      }
+
+      if (vucBuffer.size() + 8 >= FRAGINDEX_FILEBUFFERSIZE || i == tNumResidues)
+      {
+         bSucceeded = (fwrite(&(vucBuffer[0]), 1, vucBuffer.size(), fp) == vucBuffer.size());
+         *pullNumBytes += vucBuffer.size();
+         vucBuffer.clear();
+      }
+   }
+
+   return (bSucceeded && *pullNumBytes == PackedResidueBytes(tNumResidues));
+}
+
+
+// Unpack .idx peptide tWhichPeptide into szPeptide, NUL terminated, and return its
+// length.  Residue r of g_ucRawPeptideResidues is bits 5r to 5r+4, least significant
+// bit first, holding the residue letter minus 'A'.
+int CometFragmentIndex::GetRawPeptide(size_t tWhichPeptide,
+                                      char *szPeptide)
+{
+   unsigned long long ullBit = g_ullRawPeptideOffsets[tWhichPeptide] * 5;
+   int iLenPeptide = (int)(g_ullRawPeptideOffsets[tWhichPeptide + 1] - g_ullRawPeptideOffsets[tWhichPeptide]);
+
+   for (int i = 0; i < iLenPeptide; ++i, ullBit += 5)
+   {
+      const unsigned char *pucByte = g_ucRawPeptideResidues + (ullBit >> 3);
+      unsigned int uiBits = pucByte[0] | ((unsigned int)pucByte[1] << 8);
+
+      szPeptide[i] = (char)('A' + ((uiBits >> (ullBit & 7)) & 0x1F));
+   }
+   szPeptide[iLenPeptide] = '\0';
+
+   return iLenPeptide;
+}
+
+
+// Name and record a new sorted run file next to the .idx file.  Search threads write
+// run files concurrently so this is done under g_pvQueryMutex.
+string CometFragmentIndex::NewIndexRunFile(void)
+{
+   Threading::LockMutex(g_pvQueryMutex);
+
+   string strRunFile = PlainPeptideIndexFileName() + ".run" + to_string(_iNumIndexRunFiles);
+   _iNumIndexRunFiles++;
+   _vstrIndexRunFiles.push_back(strRunFile);
+
+   Threading::UnlockMutex(g_pvQueryMutex);
+
+   return strRunFile;
+}
+
+
+// Sort the peptides a search thread digested while creating the .idx file and write
+// them to a new run file once the thread holds its share of peptide_index_memory.
+// vDBIndex is emptied, keeping its capacity, for the thread to refill.
+void CometFragmentIndex::WriteIndexPeptideRun(vector<DBIndex>& vDBIndex)
+{
+   FILE *fp;
+
+   sort(vDBIndex.begin(), vDBIndex.end(), CompareByPeptide);
+
+   string strRunFile = NewIndexRunFile();
+
+   if ((fp = fopen(strRunFile.c_str(), "wb")) == NULL)
+   {
+      printf(" Error - cannot open sorted run file %s to write\n", strRunFile.c_str());
+      exit(1);
+   }
+
+   bool bSucceeded = true;
+   for (std::vector<DBIndex>::iterator it = vDBIndex.begin(); bSucceeded && it != vDBIndex.end(); ++it)
+      bSucceeded = WriteIndexRunEntry(fp, *it, NULL);
+
+   if (fclose(fp) != 0)
+      bSucceeded = false;
+
+   if (!bSucceeded)
+   {
+      printf(" Error - cannot write sorted run file %s\n", strRunFile.c_str());
+      exit(1);
+   }
+
+   vDBIndex.clear();
+}
+
+
+// Write one run file entry; see IndexRunStruct.  pvProteins is NULL for peptide sorted runs.
+bool CometFragmentIndex::WriteIndexRunEntry(FILE *fp,
+                                            const DBIndex& sEntry,
+                                            const vector<comet_fileoffset_t> *pvProteins)
+{
+   unsigned char ucLen = (unsigned char)strlen(sEntry.szPeptide);
+   comet_fileoffset_t lProteins = (pvProteins == NULL ? sEntry.lIndexProteinFilePosition : (comet_fileoffset_t)pvProteins->size());
+
+   if (fwrite(&(sEntry.dPepMass), sizeof(double), 1, fp) != 1
+         || fwrite(&lProteins, sizeof(comet_fileoffset_t), 1, fp) != 1
+         || fwrite(&ucLen, 1, 1, fp) != 1
+         || fwrite(sEntry.szPeptide, 1, ucLen, fp) != ucLen)
+   {
+      return false;
+   }
+
+   if (pvProteins != NULL && pvProteins->size() > 0)
+      return (fwrite(&((*pvProteins)[0]), sizeof(comet_fileoffset_t), pvProteins->size(), fp) == pvProteins->size());
 
    return true;
 }
 
 
-// for a given MH+ precursor mass, return the precursor bin value used in g_iFragmentIndex[][bin]
-int CometFragmentIndex::WhichPrecursorBin(double dMass)
+// Read the next entry of a run file into pRun; false at the end of the file.  For mass
+// sorted runs (bProteins) sEntry.lIndexProteinFilePosition is the # of proteins.
+bool CometFragmentIndex::ReadIndexRunEntry(IndexRunStruct *pRun,
+                                           bool bProteins)
+{
+   DBIndex& sEntry = pRun->sEntry;
+   unsigned char ucLen;
+
+   if (fread(&(sEntry.dPepMass), sizeof(double), 1, pRun->fp) != 1
+         || fread(&(sEntry.lIndexProteinFilePosition), sizeof(comet_fileoffset_t), 1, pRun->fp) != 1
+         || fread(&ucLen, 1, 1, pRun->fp) != 1
+         || ucLen >= MAX_PEPTIDE_LEN
+         || fread(sEntry.szPeptide, 1, ucLen, pRun->fp) != ucLen)
+   {
+      return false;
+   }
+
+   sEntry.szPeptide[ucLen] = '\0';
+   sEntry.cPrevAA = '-';
+   sEntry.cNextAA = '-';
+   memset(sEntry.pcVarModSites, 0, sizeof(char) * (ucLen + 2));
+
+   if (bProteins)
+   {
+      pRun->vProteins.resize((size_t)sEntry.lIndexProteinFilePosition);
+
+      if (pRun->vProteins.size() > 0
+            && fread(&(pRun->vProteins[0]), sizeof(comet_fileoffset_t), pRun->vProteins.size(), pRun->fp) != pRun->vProteins.size())
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+bool CometFragmentIndex::OpenIndexRuns(const vector<string>& vstrRunFiles,
+                                       vector<IndexRunStruct>& vRuns)
+{
+   bool bSucceeded = true;
+
+   vRuns.resize(vstrRunFiles.size());
+
+   for (size_t i = 0; i < vstrRunFiles.size(); ++i)
+   {
+      if ((vRuns[i].fp = fopen(vstrRunFiles[i].c_str(), "rb")) == NULL)
+         bSucceeded = false;
+      else
+         setvbuf(vRuns[i].fp, NULL, _IOFBF, PLAINIDX_RUNBUFFERSIZE);
+   }
+
+   return bSucceeded;
+}
+
+
+// close the runs then delete their files
+bool CometFragmentIndex::CloseIndexRuns(const vector<string>& vstrRunFiles,
+                                        vector<IndexRunStruct>& vRuns)
+{
+   bool bSucceeded = true;
+
+   for (size_t i = 0; i < vRuns.size(); ++i)
+   {
+      if (vRuns[i].fp != NULL)
+      {
+         if (ferror(vRuns[i].fp))
+            bSucceeded = false;
+         fclose(vRuns[i].fp);
+      }
+   }
+   vRuns.clear();
+
+   for (size_t i = 0; i < vstrRunFiles.size(); ++i)
+      remove(vstrRunFiles[i].c_str());
+
+   return bSucceeded;
+}
+
+
+// Merge the open runs in pfnCompare order, passing each entry to fnEntry.  Entries
+// that compare equal are taken in run order.  Returns false as soon as fnEntry does.
+bool CometFragmentIndex::MergeIndexRuns(vector<IndexRunStruct>& vRuns,
+                                        bool bProteins,
+                                        bool (*pfnCompare)(const DBIndex&, const DBIndex&),
+                                        const std::function<bool(IndexRunStruct&)>& fnEntry)
+{
+   // priority_queue keeps the run that compares last on top so reverse the order
+   auto fnAfter = [&vRuns, pfnCompare](int iRunA, int iRunB)
+   {
+      if (pfnCompare(vRuns[iRunB].sEntry, vRuns[iRunA].sEntry))
+         return true;
+      if (pfnCompare(vRuns[iRunA].sEntry, vRuns[iRunB].sEntry))
+         return false;
+      return iRunA > iRunB;
+   };
+
+   std::priority_queue<int, vector<int>, decltype(fnAfter)> pqRuns(fnAfter);
+
+   for (int i = 0; i < (int)vRuns.size(); ++i)
+   {
+      if (ReadIndexRunEntry(&vRuns[i], bProteins))
+         pqRuns.push(i);
+   }
+
+   while (!pqRuns.empty())
+   {
+      int iRun = pqRuns.top();
+      pqRuns.pop();
+
+      if (!fnEntry(vRuns[iRun]))
+         return false;
+
+      if (ReadIndexRunEntry(&vRuns[iRun], bProteins))
+         pqRuns.push(iRun);
+   }
+
+   return true;
+}
+
+
+// Merge the oldest run files PLAINIDX_MAX_RUNFILES at a time into a new run file
+// until no more than PLAINIDX_MAX_RUNFILES are left to be merged at once.
+bool CometFragmentIndex::ReduceIndexRuns(bool bProteins,
+                                         bool (*pfnCompare)(const DBIndex&, const DBIndex&))
+{
+   while (_vstrIndexRunFiles.size() > PLAINIDX_MAX_RUNFILES)
+   {
+      vector<string> vstrRunFiles(_vstrIndexRunFiles.begin(), _vstrIndexRunFiles.begin() + PLAINIDX_MAX_RUNFILES);
+      _vstrIndexRunFiles.erase(_vstrIndexRunFiles.begin(), _vstrIndexRunFiles.begin() + PLAINIDX_MAX_RUNFILES);
+
+      string strRunFile = NewIndexRunFile();
+      FILE *fp = fopen(strRunFile.c_str(), "wb");
+      vector<IndexRunStruct> vRuns;
+
+      bool bSucceeded = (fp != NULL && OpenIndexRuns(vstrRunFiles, vRuns));
+
+      if (bSucceeded)
+      {
+         bSucceeded = MergeIndexRuns(vRuns, bProteins, pfnCompare, [fp, bProteins](IndexRunStruct& sRun)
+         {
+            return WriteIndexRunEntry(fp, sRun.sEntry, (bProteins ? &(sRun.vProteins) : NULL));
+         });
+      }
+
+      if (!CloseIndexRuns(vstrRunFiles, vRuns))
+         bSucceeded = false;
+      if (fp != NULL && fclose(fp) != 0)
+         bSucceeded = false;
+
+      if (!bSucceeded)
+         return false;
+   }
+
+   return true;
+}
+
+
+// Sort unique peptides by mass and write them along with their protein lists to a new
+// run file, then empty vDBIndex and vProteinsList.
+bool CometFragmentIndex::WriteMassSortedRun(vector<DBIndex>& vDBIndex,
+                                            vector<vector<comet_fileoffset_t>>& vProteinsList,
+                                            int iNumThreads,
+                                            ThreadPool *tp)
+{
+   SortDBIndex(vDBIndex, CompareByMass, iNumThreads, tp);
+
+   string strRunFile = NewIndexRunFile();
+   FILE *fp = fopen(strRunFile.c_str(), "wb");
+   bool bSucceeded = (fp != NULL);
+
+   for (std::vector<DBIndex>::iterator it = vDBIndex.begin(); bSucceeded && it != vDBIndex.end(); ++it)
+      bSucceeded = WriteIndexRunEntry(fp, *it, &(vProteinsList.at((*it).lIndexProteinFilePosition)));
+
+   if (fp != NULL && fclose(fp) != 0)
+      bSucceeded = false;
+
+   vDBIndex.clear();
+   vProteinsList.clear();
+
+   return bSucceeded;
+}
+
+
+// Merge the peptide sorted run files written while digesting the database.  Duplicate
+// peptides are removed and each peptide's protein list is built just as WritePlainPeptideIndex
+// does in memory.  Up to tMaxBytes of unique peptides at a time are written along with
+// their protein lists to mass sorted run files for WriteMergedPeptideSections.
+bool CometFragmentIndex::MergePeptideSortedRuns(size_t tMaxBytes,
+                                                int iNumThreads,
+                                                ThreadPool *tp,
+                                                size_t *ptNumPeptides)
+{
+   if (!ReduceIndexRuns(false, CompareByPeptide))
+      return false;
+
+   vector<string> vstrRunFiles;
+   vstrRunFiles.swap(_vstrIndexRunFiles);
+
+   vector<IndexRunStruct> vRuns;
+   vector<DBIndex> vDBIndex;                          // unique peptides not yet written to a mass sorted run
+   vector<vector<comet_fileoffset_t>> vProteinsList;  // their protein lists
+   vector<DBIndex> vPeptideEntries;                   // unique entries of the current peptide
+   vector<comet_fileoffset_t> vProteins;              // proteins of the current peptide
+   size_t tBytes = 0;
+
+   *ptNumPeptides = 0;
+
+   // each unique entry of a peptide points to the peptide's protein list
+   auto fnAddPeptide = [&]()
+   {
+      for (std::vector<DBIndex>::iterator it = vPeptideEntries.begin(); it != vPeptideEntries.end(); ++it)
+      {
+         (*it).lIndexProteinFilePosition = (comet_fileoffset_t)vProteinsList.size();
+         vDBIndex.push_back(*it);
+      }
+
+      tBytes += vPeptideEntries.size() * sizeof(DBIndex) + sizeof(vector<comet_fileoffset_t>) + vProteins.size() * sizeof(comet_fileoffset_t);
+      *ptNumPeptides += vPeptideEntries.size();
+
+      vProteinsList.push_back(vProteins);
+      vPeptideEntries.clear();
+      vProteins.clear();
+   };
+
+   bool bSucceeded = OpenIndexRuns(vstrRunFiles, vRuns);
+
+   if (bSucceeded)
+   {
+      bSucceeded = MergeIndexRuns(vRuns, false, CompareByPeptide, [&](IndexRunStruct& sRun)
+      {
+         if (vPeptideEntries.size() > 0 && strcmp(sRun.sEntry.szPeptide, vPeptideEntries[0].szPeptide))
+         {
+            fnAddPeptide();
+
+            if (tBytes >= tMaxBytes)
+            {
+               tBytes = 0;
+               if (!WriteMassSortedRun(vDBIndex, vProteinsList, iNumThreads, tp))
+                  return false;
+            }
+         }
+
+         vProteins.push_back(sRun.sEntry.lIndexProteinFilePosition);
+
+         if (vPeptideEntries.size() == 0 || !(vPeptideEntries.back() == sRun.sEntry))
+            vPeptideEntries.push_back(sRun.sEntry);
+
+         return true;
+      });
+   }
+
+   if (!CloseIndexRuns(vstrRunFiles, vRuns))
+      bSucceeded = false;
+
+   if (bSucceeded && vPeptideEntries.size() > 0)
+   {
+      fnAddPeptide();
+
+      // the last protein list is made unique as in WritePlainPeptideIndex
+      vector<comet_fileoffset_t>& temp = vProteinsList.back();
+      sort(temp.begin(), temp.end());
+      temp.erase(unique(temp.begin(), temp.end()), temp.end() );
+
+      bSucceeded = WriteMassSortedRun(vDBIndex, vProteinsList, iNumThreads, tp);
+   }
+
+   return (bSucceeded && ReduceIndexRuns(true, CompareByMass));
+}
+
+
+// Merge the mass sorted run files and write the protein list sections of the .idx file
+// at the end of fp.  The sections are spooled to strTmpFile + "1" to "4" as their sizes
+// are not known until the merge is done.  The peptide residue offsets ("1") and the
+// concatenated residues ("2") are left for WritePlainPeptideIndex to permute mods on
+// and to write packed.
+bool CometFragmentIndex::WriteMergedPeptideSections(FILE *fp,
+                                                    PlainPeptideIndexHeader *pHeader,
+                                                    const string& strTmpFile)
 {
-   // need to round up iBinSize
-   int iBinSize = (int)(0.5 + (g_staticParams.options.dPeptideMassHigh - g_staticParams.options.dPeptideMassLow)/ FRAGINDEX_PRECURSORBINS);
+   vector<string> vstrRunFiles;
+   vstrRunFiles.swap(_vstrIndexRunFiles);
+
+   string strTmpFile1 = strTmpFile + "1";   // peptide residue offsets
+   string strTmpFile2 = strTmpFile + "2";   // peptide residues
+   string strTmpFile3 = strTmpFile + "3";   // protein list offsets
+   string strTmpFile4 = strTmpFile + "4";   // protein lists
+
+   FILE *fp1 = fopen(strTmpFile1.c_str(), "wb");
+   FILE *fp2 = fopen(strTmpFile2.c_str(), "wb");
+   FILE *fp3 = fopen(strTmpFile3.c_str(), "wb");
+   FILE *fp4 = fopen(strTmpFile4.c_str(), "wb");
+
+   vector<IndexRunStruct> vRuns;
+   unsigned long long ullNumPeptides = 0;
+   unsigned long long ullResidueOffset = 0;
+   unsigned long long ullProteinOffset = 0;
 
-   int iWhichBin = (int) ( (dMass - g_staticParams.options.dPeptideMassLow) / iBinSize);
+   bool bSucceeded = (fp1 != NULL && fp2 != NULL && fp3 != NULL && fp4 != NULL
+         && fwrite(&ullResidueOffset, sizeof(unsigned long long), 1, fp1) == 1
+         && fwrite(&ullProteinOffset, sizeof(unsigned long long), 1, fp3) == 1
+         && OpenIndexRuns(vstrRunFiles, vRuns));
 
-   if (iWhichBin < 0)
-      iWhichBin = 0;
-   else if (iWhichBin > FRAGINDEX_PRECURSORBINS - 1)
-      iWhichBin = FRAGINDEX_PRECURSORBINS - 1;
+   if (bSucceeded)
+   {
+      bSucceeded = MergeIndexRuns(vRuns, true, CompareByMass, [&](IndexRunStruct& sRun)
+      {
+         size_t tLen = strlen(sRun.sEntry.szPeptide);
+
+         ullNumPeptides++;
+         ullResidueOffset += tLen;
+         ullProteinOffset += sRun.vProteins.size();
+
+         return (fwrite(sRun.sEntry.szPeptide, 1, tLen, fp2) == tLen
+               && fwrite(&ullResidueOffset, sizeof(unsigned long long), 1, fp1) == 1
+               && fwrite(&(sRun.vProteins[0]), sizeof(comet_fileoffset_t), sRun.vProteins.size(), fp4) == sRun.vProteins.size()
+               && fwrite(&ullProteinOffset, sizeof(unsigned long long), 1, fp3) == 1);
+      });
+   }
+
+   if (!CloseIndexRuns(vstrRunFiles, vRuns))
+      bSucceeded = false;
+   if (ullNumPeptides != pHeader->ullNumPeptides)
+      bSucceeded = false;
+
+   if (fp1 != NULL && fclose(fp1) != 0)
+      bSucceeded = false;
+   if (fp2 != NULL && fclose(fp2) != 0)
+      bSucceeded = false;
+   if (fp3 != NULL && fclose(fp3) != 0)
+      bSucceeded = false;
+   if (fp4 != NULL && fclose(fp4) != 0)
+      bSucceeded = false;
 
-   return (iWhichBin);
+   if (bSucceeded)
+   {
+      pHeader->ullNumProteins = ullProteinOffset;
+
+      pHeader->ullProteinOffsetsPos = comet_ftell(fp);
+      bSucceeded = AppendFile(fp, strTmpFile3);
+
+      pHeader->ullProteinsPos = comet_ftell(fp);
+      bSucceeded = bSucceeded && AppendFile(fp, strTmpFile4) && WritePadding(fp);
+   }
+
+   remove(strTmpFile3.c_str());
+   remove(strTmpFile4.c_str());
+
+   return bSucceeded;
 }
 
 
@@ -21,6 +21,117 @@
 #include "CometSearch.h"
 #include <functional>
 
+#define FRAGINDEX_FILE_VERSION      6        // bump whenever the layout of the .idx.frag file changes
+#define PLAINIDX_FILE_VERSION       7        // bump whenever the layout of the binary part of the .idx file changes
+
+// BuildFragmentIndexThreadProc passes over the precursor bins
+#define FRAGINDEX_PASS_COUNT        0        // count entries of each fragment index list
+#define FRAGINDEX_PASS_POPULATE     1        // fill g_uiFragmentIndex
+#define FRAGINDEX_PASS_KEYS         2        // fill g_fFragmentIndexPepMass from g_uiFragmentIndex
+
+#define FRAGINDEX_FRAGMENTCHUNKBITS 24       // per-thread fragment ion buffers grow in chunks of 2^24 entries
+#define FRAGINDEX_FRAGMENTCHUNKSIZE (1ULL << FRAGINDEX_FRAGMENTCHUNKBITS)
+
+#define FRAGINDEX_FILEBUFFERSIZE    4194304  // buffer used to append spooled sections of a partitioned .idx.frag file
+
+#define PLAINIDX_MAX_RUNFILES       128      // max # of sorted run files merged at once while creating the .idx file
+#define PLAINIDX_RUNBUFFERSIZE      262144   // read buffer of each sorted run file being merged
+
+// Header of the binary part of the .idx file that follows its text header.  Every
+// section starts at an 8 byte aligned file position so that ReadPlainPeptideIndex can
+// memory map the file and use the sections in place.  The last 8 bytes of the file
+// are the file position of this header.
+struct PlainPeptideIndexHeader
+{
+   char szMagic[8];                          // "CMTPIDX"
+   int  iVersion;                            // PLAINIDX_FILE_VERSION
+   int  iSizeofFileOffset;                   // sizeof(comet_fileoffset_t)
+   int  iMaxModsPerMod;                      // max_mods_per_mod of the modification numbers
+   int  bModNumbersStored;                   // modification numbers are stored; 0 with peptide_index_decode_mods
+   unsigned long long ullParamsHash;         // IndexParamsHash() of the parameters the .idx was created with
+   long long llFastaFileSize;                // size of the fasta database the .idx was created from
+   long long llFastaMTime;                   // modification time of that fasta database
+   unsigned long long ullNumPeptides;
+   unsigned long long ullNumResidueBytes;    // size of g_ucRawPeptideResidues
+   unsigned long long ullNumProteins;        // size of g_lProteinListFilePositions
+   unsigned long long ullNumModSeqs;
+   unsigned long long ullNumModSeqBytes;     // size of g_szModSeqs
+   unsigned long long ullNumModNumbers;
+   unsigned long long ullNumModNumberBytes;  // size of g_cModNumbers; 0 if not stored
+   unsigned long long ullPeptideOffsetsPos;  // file position of g_ullRawPeptideOffsets
+   unsigned long long ullResiduesPos;        // file position of g_ucRawPeptideResidues
+   unsigned long long ullProteinOffsetsPos;  // file position of g_ullProteinListOffsets
+   unsigned long long ullProteinsPos;        // file position of g_lProteinListFilePositions
+   unsigned long long ullModSeqModNumStartPos; // file position of MOD_SEQ_MOD_NUM_START
+   unsigned long long ullModSeqModNumCntPos; // file position of MOD_SEQ_MOD_NUM_CNT
+   unsigned long long ullPeptideModSeqIdxsPos; // file position of PEPTIDE_MOD_SEQ_IDXS
+   unsigned long long ullModSeqOffsetsPos;   // file position of g_ullModSeqOffsets
+   unsigned long long ullModSeqsPos;         // file position of g_szModSeqs
+   unsigned long long ullModNumberOffsetsPos; // file position of g_ullModNumberOffsets
+   unsigned long long ullModNumbersPos;      // file position of g_cModNumbers
+   unsigned long long ullNumProteinNames;    // size of g_lProteinNameFilePositions
+   unsigned long long ullNumProteinNameBytes; // size of g_szProteinNames
+   unsigned long long ullProteinNamePositionsPos; // file position of g_lProteinNameFilePositions
+   unsigned long long ullProteinNameOffsetsPos; // file position of g_ullProteinNameOffsets
+   unsigned long long ullProteinNamesPos;    // file position of g_szProteinNames
+};
+
+// Sorted run file being merged while creating a .idx file with peptide_index_memory set.
+// Each run file entry is the peptide mass, its protein file position (peptide sorted
+// runs) or # of proteins (mass sorted runs), the peptide length and residues, then for
+// mass sorted runs that many protein file positions.
+struct IndexRunStruct
+{
+   FILE *fp;
+   DBIndex sEntry;                           // current entry
+   vector<comet_fileoffset_t> vProteins;     // protein list of current entry of a mass sorted run
+};
+
+// read-only memory mapping of an index file
+struct MappedFileStruct
+{
+   char *pMap;                               // NULL if not mapped
+   size_t tSize;
+#ifdef _WIN32
+   HANDLE hFile;
+   HANDLE hMapping;
+#endif
+};
+
+// Header of the persisted fragment index file written next to the .idx file.
+// Parameters that the fragment index depends on but which are not stored in
+// the .idx itself are recorded here so a stale file is never used.
+struct FragmentIndexFileHeader
+{
+   char szMagic[8];                          // "CMTFRAG"
+   int  iVersion;                            // FRAGINDEX_FILE_VERSION
+   int  iSizeofFragmentPeptide;              // sizeof(FragmentPeptidesStruct)
+   int  iNumPrecursorBins;                   // fragindex_num_precursorbins
+   int  bCompressed;                         // fragindex_compress
+   unsigned long long ullMaxFragmentArrayIndex;
+   long long llIdxFileSize;                  // size of .idx the fragment index was built from
+   long long llIdxFileMTime;                 // modification time of that .idx
+   double dInverseBinWidth;
+   double dOneMinusBinOffset;
+   double dFragIndexMinMass;
+   double dFragIndexMaxMass;
+   double dPeptideMassLow;
+   double dPeptideMassHigh;
+   unsigned long long ullNumFragmentPeptides; // # of g_vFragmentPeptides entries
+   unsigned long long ullNumEntries;         // total # of entries in the fragment index
+   unsigned long long ullFragmentPeptidesPos; // file position of g_vFragmentPeptides
+   unsigned long long ullPrecursorBinsPos;   // file position of the precursor bin start masses
+   unsigned long long ullOffsetsPos;         // file position of g_ullFragmentIndexOffsets
+   unsigned long long ullEntriesPos;         // file position of g_uiFragmentIndex entries
+   unsigned long long ullPepMassesPos;       // file position of g_fFragmentIndexPepMass keys
+   unsigned long long ullNumBlocks;          // # of compressed blocks
+   unsigned long long ullNumPackedBytes;     // size of g_ucFragmentIndexPacked
+   unsigned long long ullBlockOffsetsPos;    // file position of g_ullFragmentIndexBlockOffsets
+   unsigned long long ullBlockFirstPos;      // file position of g_uiFragmentIndexBlockFirst
+   unsigned long long ullBlockPosPos;        // file position of g_ullFragmentIndexBlockPos
+   unsigned long long ullPackedPos;          // file position of g_ucFragmentIndexPacked
+};
+
 class CometFragmentIndex
 {
 public:
@@ -28,45 +139,194 @@ public:
    ~CometFragmentIndex();
 
    static bool WritePlainPeptideIndex(ThreadPool *tp);
+   static void WriteIndexPeptideRun(vector<DBIndex>& vDBIndex);
    static bool ReadPlainPeptideIndex(void);
+   static string PlainPeptideIndexFileName(void);
+   static string IndexCacheFileName(void);
+   static bool IsIndexCacheCurrent(const string& strIndexFile);
    static bool CreateFragmentIndex(ThreadPool *tp);
+   static bool WriteFragmentIndex(void);
+   static bool WritePartitionedFragmentIndex(ThreadPool *tp);
+   static void DeallocateFragmentIndex(void);
    static string ElapsedTime(std::chrono::time_point<std::chrono::steady_clock> tStartTime);
    static int WhichPrecursorBin(double dMass);
+   static int GetRawPeptide(size_t tWhichPeptide,
+                            char *szPeptide);
+   static bool MapFile(const string& strFile,
+                       MappedFileStruct *pMappedFile);
+   static void UnmapFile(MappedFileStruct *pMappedFile);
+   static void DecodePostingBlock(size_t tBlock,
+                                  unsigned int uiNumEntries,
+                                  unsigned int *puiEntries);
 
 private:
 
-   static void PermuteIndexPeptideMods(vector<PlainPeptideIndex>& vRawPeptides);
-   static void GenerateFragmentIndex(ThreadPool *tp);
-   static void AddFragments(vector<PlainPeptideIndex>& vRawPeptides,
-                            int iWhichThread,
+   static void GetAllMods(vector<string>& ALL_MODS);
+   static int MaxModsPerMod(void);
+   static unsigned long long IndexParamsHash(void);
+   static unsigned long long HashString(const string& strText);
+   static bool GetFileStat(const char *szFile,
+                           long long *llSize,
+                           long long *llMTime);
+   static int PermuteIndexPeptideMods(const unsigned long long *pullPeptideOffsets,
+                                      const char *szPeptideResidues,
+                                      size_t tNumPeptides,
+                                      int iMaxModsPerMod,
+                                      bool bStoreModNumbers,
+                                      ThreadPool *tp);
+   static void GenerateFragmentIndex(ThreadPool *tp,
+                                     bool bPersist);
+   static void AddFragments(int iWhichThread,
                             int iWhichPeptide,
                             int modNumIdx,
+                            const char* mods,
                             short siNtermMod,
-                            short siCtermMod,
-                            bool bCountOnly);
+                            short siCtermMod);
    static void AddFragmentsThreadProc(int iWhichThread,
                                       int iNumIndexingThreads,
-                                      bool bCountOnly,
                                       ThreadPool *tp);
-   static bool SortFragmentsByPepMass(unsigned int x,
-                                      unsigned int y);
-   static void SortFragmentThreadProc(int iWhichThread,
-                                      int iNumIndexingThreads,
-                                      ThreadPool* tp);
+   static void AppendFragment(vector<vector<unsigned int>>& vvuiFragments,
+                              unsigned long long& ullNumFragments,
+                              unsigned int uiBin);
+   static void CalculateFragments(int iNumIndexingThreads,
+                                  ThreadPool *tp);
+   static void SortFragmentPeptides(int iNumIndexingThreads,
+                                    vector<struct FragmentPeptidesStruct>& vPeptides);
+   static void SetPrecursorBins(unsigned long long ullNumFragments,
+                                bool bPersist);
+   static void SetPartition(int iFirstBin,
+                            int iEndBin);
+   static unsigned long long BuildFragmentIndexPartition(int iNumIndexingThreads,
+                                                         ThreadPool *tp);
+   static void BuildFragmentIndexKeys(int iNumIndexingThreads,
+                                      ThreadPool *tp);
+   static void FreeFragmentIndexPartition(void);
+   static void BuildFragmentIndexThreadProc(int iWhichThread,
+                                            int iNumIndexingThreads,
+                                            int iWhichPass);
+   static bool SortFragmentsByPepMass(const FragmentPeptidesStruct& a,
+                                      const FragmentPeptidesStruct& b);
+   static bool CompressFragmentIndex(int iNumIndexingThreads,
+                                     ThreadPool *tp,
+                                     bool bPlainIfSmaller);
+   static void CompressFragmentThreadProc(int iWhichThread,
+                                          int iNumIndexingThreads,
+                                          bool bSizeOnly);
+   static void SortDBIndex(vector<DBIndex>& vDBIndex,
+                           bool (*pfnCompare)(const DBIndex&, const DBIndex&),
+                           int iNumThreads,
+                           ThreadPool *tp);
+   static void SortDBIndexThreadProc(vector<DBIndex>* pvDBIndex,
+                                     size_t tFirst,
+                                     size_t tMiddle,
+                                     size_t tLast,
+                                     bool (*pfnCompare)(const DBIndex&, const DBIndex&));
+   static void ProteinListsThreadProc(vector<DBIndex>* pvDBIndex,
+                                      size_t tFirst,
+                                      size_t tLast,
+                                      vector<vector<comet_fileoffset_t>>* pvProteinsList,
+                                      size_t* ptNumUnique);
+   static unsigned long long PackedResidueBytes(unsigned long long ullNumResidues);
+   static bool WritePackedResidues(FILE *fp,
+                                   const char *szResidues,
+                                   size_t tNumResidues,
+                                   unsigned long long *pullNumBytes);
+   static string NewIndexRunFile(void);
+   static bool WriteIndexRunEntry(FILE *fp,
+                                  const DBIndex& sEntry,
+                                  const vector<comet_fileoffset_t> *pvProteins);
+   static bool ReadIndexRunEntry(IndexRunStruct *pRun,
+                                 bool bProteins);
+   static bool OpenIndexRuns(const vector<string>& vstrRunFiles,
+                             vector<IndexRunStruct>& vRuns);
+   static bool CloseIndexRuns(const vector<string>& vstrRunFiles,
+                              vector<IndexRunStruct>& vRuns);
+   static bool MergeIndexRuns(vector<IndexRunStruct>& vRuns,
+                              bool bProteins,
+                              bool (*pfnCompare)(const DBIndex&, const DBIndex&),
+                              const std::function<bool(IndexRunStruct&)>& fnEntry);
+   static bool ReduceIndexRuns(bool bProteins,
+                               bool (*pfnCompare)(const DBIndex&, const DBIndex&));
+   static bool WriteMassSortedRun(vector<DBIndex>& vDBIndex,
+                                  vector<vector<comet_fileoffset_t>>& vProteinsList,
+                                  int iNumThreads,
+                                  ThreadPool *tp);
+   static bool MergePeptideSortedRuns(size_t tMaxBytes,
+                                      int iNumThreads,
+                                      ThreadPool *tp,
+                                      size_t *ptNumPeptides);
+   static bool WriteMergedPeptideSections(FILE *fp,
+                                          PlainPeptideIndexHeader *pHeader,
+                                          const string& strTmpFile);
    static bool CompareByPeptide(const DBIndex &lhs,
                                 const DBIndex &rhs);
    static bool CompareByMass(const DBIndex &lhs,
                              const DBIndex &rhs);
+   static bool ReadFragmentIndex(void);
+   static bool PublishFragmentIndex(ThreadPool *tp);
+   static bool LockFragmentIndexFile(void);
+   static void UnlockFragmentIndexFile(void);
+   static string FragmentIndexFileName(void);
+   static bool GetIdxFileStat(long long *llSize,
+                              long long *llMTime);
+   static void InitFragmentIndexHeader(FragmentIndexFileHeader *pHeader);
+   static void SetFragmentIndexFilePositions(FragmentIndexFileHeader *pHeader);
+   static bool AppendFile(FILE *fp,
+                          const string& strFile);
+   static bool WritePadding(FILE *fp);
+   static void* AllocateIndexArray(size_t tBytes);
+   static void FreeIndexArray(void *pArray,
+                              size_t tBytes);
+   static size_t FragmentIndexMemory(void);
 
    unsigned int       _uiBinnedIonMasses[MAX_FRAGMENT_CHARGE+1][9][MAX_PEPTIDE_LEN][BIN_MOD_COUNT];
    unsigned int       _uiBinnedIonMassesDecoy[MAX_FRAGMENT_CHARGE+1][9][MAX_PEPTIDE_LEN][BIN_MOD_COUNT];
    unsigned int       _uiBinnedPrecursorNL[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE];
    unsigned int       _uiBinnedPrecursorNLDecoy[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE];
 
-   static bool *_pbSearchMemoryPool;    // Pool of memory to be shared by search threads
    static bool **_ppbDuplFragmentArr;   // Number of arrays equals number of threads
 
-   static Mutex _vFragmentPeptidesMutex;
+   // Per-thread peptides calculated by AddFragments and the BIN() of their fragment
+   // ions; fragments of a thread's peptide i are _vvuiThreadFragments (chunked)
+   // from _vullThreadFragmentEnd[i] up to _vullThreadFragmentEnd[i+1].
+   static vector<struct FragmentPeptidesStruct> _vThreadPeptides[FRAGINDEX_MAX_THREADS];
+   static vector<vector<unsigned int>> _vvuiThreadFragments[FRAGINDEX_MAX_THREADS];
+   static vector<unsigned long long> _vullThreadFragmentEnd[FRAGINDEX_MAX_THREADS];
+   static unsigned int _uiThreadPeptideStart[FRAGINDEX_MAX_THREADS + 1];
+   static unsigned int* _puiFragmentPeptideOrder;      // thread buffer position of each mass ordered g_vFragmentPeptides entry
+
+   // Precursor bins hold equal numbers of indexed peptides.  Bin i+1 starts at
+   // _vdPrecursorBinStartMass[i]; bin 0 covers all masses below that.
+   static int _iNumPrecursorBins;
+   static vector<double> _vdPrecursorBinStartMass;
+   static vector<size_t> _vtPrecursorBinFirstPeptide;  // first g_vFragmentPeptides entry of each bin while building
+
+   // Precursor bins being built.  An index built in memory is one partition covering
+   // all bins; WritePartitionedFragmentIndex builds one range of bins at a time, and
+   // g_uiFragmentIndex, g_fFragmentIndexPepMass and the compressed block arrays then
+   // hold just that partition starting at its first entry, block and packed byte.
+   static bool _bPeptidesOnly;                         // AddFragments collects peptides without their fragment ions
+   static int _iPartitionFirstBin;
+   static int _iPartitionEndBin;
+   static double _dPartitionMassLow;                   // AddFragments skips peptides below this mass
+   static double _dPartitionMassHigh;                  // and at or above this mass
+   static size_t _tPartitionFirstPeptide;
+   static unsigned long long _ullPartitionFirstEntry;
+   static unsigned long long _ullPartitionFirstBlock;
+   static unsigned long long _ullPartitionFirstPackedByte;
+
+   static size_t _tFragmentIndexPackedSize;            // bytes allocated for g_ucFragmentIndexPacked
+
+   static vector<string> _vstrIndexRunFiles;           // sorted run files not yet merged while creating the .idx file
+   static int _iNumIndexRunFiles;                      // # of run files created so far, used to name the next one
+
+   static MappedFileStruct _sPlainPeptideIndexMap;  // .idx file
+   static MappedFileStruct _sFragmentIndexMap;      // .idx.frag file; not mapped if index built in memory
+#ifdef _WIN32
+   static HANDLE _hFragmentIndexLockFile;  // .idx.frag.lock held while publishing the .idx.frag file
+#else
+   static int _iFragmentIndexLockFile;
+#endif
 };
 
 #endif // _COMETFRAGMENTINDEX_H_
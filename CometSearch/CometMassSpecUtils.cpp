@@ -132,37 +132,33 @@ void CometMassSpecUtils::GetProteinName(FILE *fpdb,
                                         comet_fileoffset_t lFilePosition,
                                         char *szProteinName)
 {
-   comet_fseek(fpdb, lFilePosition, SEEK_SET);
-
    if (g_staticParams.bIndexDb)  //index database
    {
-      long lSize;
-
-      fread(&lSize, sizeof(long), 1, fpdb);
-      vector<comet_fileoffset_t> vOffsets;
-      for (long x = 0; x < lSize; ++x) // read file offsets
-      {
-         comet_fileoffset_t tmpoffset;
-         fread(&tmpoffset, sizeof(comet_fileoffset_t), 1, fpdb);
-         vOffsets.push_back(tmpoffset);
-      }
-      for (long x = 0; x < lSize; ++x) // read name from fasta
-      {
-         char szTmp[WIDTH_REFERENCE];
-         comet_fseek(fpdb, vOffsets.at(x), SEEK_SET);
-         fread(szTmp, sizeof(char)*WIDTH_REFERENCE, 1, fpdb);
-         sscanf(szTmp, "%511s", szProteinName);  // WIDTH_REFERENCE-1
-         break;  //break here to only get first protein reference (out of lSize)
-      }
+      strcpy(szProteinName, GetIndexProteinName(lFilePosition));
    }
    else  //regular fasta database
    {
+      comet_fseek(fpdb, lFilePosition, SEEK_SET);
       fscanf(fpdb, "%511s", szProteinName);  // WIDTH_REFERENCE-1
       szProteinName[511] = '\0';
    }
 }
 
 
+// return the accession of the database entry at lFilePosition from the protein
+// names stored in the .idx file; empty if there is no such entry
+const char* CometMassSpecUtils::GetIndexProteinName(comet_fileoffset_t lFilePosition)
+{
+   comet_fileoffset_t *pEnd = g_lProteinNameFilePositions + g_tNumProteinNames;
+   comet_fileoffset_t *pEntry = std::lower_bound(g_lProteinNameFilePositions, pEnd, lFilePosition);
+
+   if (pEntry == pEnd || *pEntry != lFilePosition)
+      return "";
+
+   return g_szProteinNames + g_ullProteinNameOffsets[pEntry - g_lProteinNameFilePositions];
+}
+
+
 // return a single protein sequence as C++ string
 void CometMassSpecUtils::GetProteinSequence(FILE *fpdb,
                                             comet_fileoffset_t lFilePosition,
@@ -231,11 +227,9 @@ void CometMassSpecUtils::GetProteinNameString(FILE *fpdb,
          vector<string> vTmp;      // store decoy matches here to append at end
 
          comet_fileoffset_t lEntry = pOutput[iWhichResult].lProteinFilePosition;
-         for (auto it = g_pvProteinsList.at(lEntry).begin(); it != g_pvProteinsList.at(lEntry).end(); ++it)
+         for (unsigned long long i = g_ullProteinListOffsets[lEntry]; i < g_ullProteinListOffsets[lEntry + 1]; ++i)
          {
-            comet_fseek(fpdb, *it, SEEK_SET);
-            fscanf(fpdb, "%511s", szProteinName);  // WIDTH_REFERENCE-1
-            szProteinName[511] = '\0';
+            strcpy(szProteinName, GetIndexProteinName(g_lProteinListFilePositions[i]));
 
             if (!strncmp(szProteinName, g_staticParams.szDecoyPrefix, iLenDecoyPrefix))
                vTmp.push_back(szProteinName);
@@ -42,6 +42,8 @@ public:
                               comet_fileoffset_t lFilePosition,
                               char *szProteinName);
 
+   static const char* GetIndexProteinName(comet_fileoffset_t lFilePosition);
+
    static void GetProteinSequence(FILE *fpdb,
                                   comet_fileoffset_t lFilePosition,
                                   string &strSeq);
@@ -618,15 +618,14 @@ bool CometPreprocess::LoadAndPreprocessSpectra(MSReader &mstReader,
                iNumSpectraLoaded++;
                Threading::UnlockMutex(g_pvQueryMutex);
 
-               pPreprocessThreadPool->wait_for_available_thread();
-
                //-->MH
                //If there are no Z-lines, filter the spectrum for charge state
                //run filter here.
 
                PreprocessThreadData *pPreprocessThreadData = new PreprocessThreadData(mstSpectrum, iAnalysisType, iFileLastScan);
 
-               pPreprocessThreadPool->doJob(std::bind(PreprocessThreadProc, pPreprocessThreadData, pPreprocessThreadPool));
+               // Hand off one spectrum at a time; block until a thread picks up the last one
+               pPreprocessThreadPool->doJob(std::bind(PreprocessThreadProc, pPreprocessThreadData, pPreprocessThreadPool), 1);
             }
          }
 
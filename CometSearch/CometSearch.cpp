@@ -18,6 +18,7 @@
 #include "ThreadPool.h"
 #include "CometStatus.h"
 #include "CometPostAnalysis.h"
+#include "CometPreprocess.h"
 #include "CometMassSpecUtils.h"
 #include "CometFragmentIndex.h"
 #include "ModificationsPermuter.h"
@@ -26,8 +27,15 @@
 #include <sstream>
 #include <bitset>
 
-bool *CometSearch::_pbSearchMemoryPool;
+CometSearch *CometSearch::_pSearchWorkspace;
 bool **CometSearch::_ppbDuplFragmentArr;
+FragmentIndexAccumulator *CometSearch::_pFragIndexAccumulator;
+vector<DBIndex> *CometSearch::_pvIndexPeptides;
+size_t CometSearch::_tMaxIndexPeptides = 0;
+vector<DatabaseEntryStruct> CometSearch::_vDatabaseEntries;
+bool CometSearch::_bDatabaseEntriesKept = false;
+unsigned long int CometSearch::_uliKeptTotAACount = 0;
+MappedFileStruct CometSearch::_sDatabaseMap;
 
 CometSearch::CometSearch()
 {
@@ -37,6 +45,10 @@ CometSearch::CometSearch()
 
    _iSizepiVarModSites = sizeof(int)*MAX_PEPTIDE_LEN_P2;
    _iSizepdVarModSites = sizeof(double)*MAX_PEPTIDE_LEN_P2;
+   _pvDBIndex = NULL;
+   _uliNumResidues = 0;
+   _iSearchStartPos = 0;
+   _iSearchEndPos = INT_MAX;
 }
 
 CometSearch::~CometSearch()
@@ -51,11 +63,31 @@ bool CometSearch::AllocateMemory(int maxNumThreads)
    // Must be equal to largest possible array
    int iArraySize = (int)((g_staticParams.options.dPeptideMassHigh + 100.0) * g_staticParams.dInverseBinWidth);
 
-   // Initally mark all arrays as available (i.e. false == not in use)
-   _pbSearchMemoryPool = new bool[maxNumThreads];
+   // Each search thread keeps its own CometSearch object, with its binned ion
+   // arrays, and the slot i arrays below; see WhichSearchWorkspace()
+   _pSearchWorkspace = new CometSearch[maxNumThreads];
+
+   // Fragment index accumulators are sized on first use as the
+   // number of g_vFragmentPeptides is not known yet
+   _pFragIndexAccumulator = new FragmentIndexAccumulator[maxNumThreads];
+
+   // When creating an index, each search thread collects its peptides without
+   // locking; CollectIndexPeptides gathers them into g_pvDBIndex afterwards
+   _pvIndexPeptides = new vector<DBIndex>[maxNumThreads];
    for (i=0; i < maxNumThreads; ++i)
+      _pSearchWorkspace[i]._pvDBIndex = &_pvIndexPeptides[i];
+
+   // With peptide_index_memory set, each slot holds its share of that memory and
+   // writes its peptides to a sorted run file whenever it fills up
+   _tMaxIndexPeptides = 0;
+   if (g_staticParams.options.bCreateIndex && g_staticParams.options.iPeptideIndexMemory > 0)
    {
-      _pbSearchMemoryPool[i] = false;
+      _tMaxIndexPeptides = (size_t)g_staticParams.options.iPeptideIndexMemory * 1048576 / maxNumThreads / sizeof(DBIndex);
+      if (_tMaxIndexPeptides < 1)
+         _tMaxIndexPeptides = 1;
+
+      for (i=0; i < maxNumThreads; ++i)
+         _pvIndexPeptides[i].reserve(_tMaxIndexPeptides);
    }
 
    // Allocate array
@@ -87,7 +119,7 @@ bool CometSearch::DeallocateMemory(int maxNumThreads)
 {
    int i;
 
-   delete [] _pbSearchMemoryPool;
+   delete [] _pSearchWorkspace;
 
    for (i=0; i<maxNumThreads; ++i)
    {
@@ -96,10 +128,53 @@ bool CometSearch::DeallocateMemory(int maxNumThreads)
 
    delete [] _ppbDuplFragmentArr;
 
+   for (i=0; i<maxNumThreads; ++i)
+   {
+      delete [] _pFragIndexAccumulator[i].puiMatchCount;
+   }
+
+   delete [] _pFragIndexAccumulator;
+
+   delete [] _pvIndexPeptides;
+
+   ReleaseDatabaseEntries();
+
    return true;
 }
 
 
+// Move the peptides each search memory pool slot found while creating an index
+// into g_pvDBIndex, releasing each slot's buffer as soon as it is copied.  If sorted
+// run files were written (bWriteRuns), each slot's peptides go to one more run file.
+void CometSearch::CollectIndexPeptides(int maxNumThreads,
+                                       bool bWriteRuns)
+{
+   if (bWriteRuns)
+   {
+      for (int i = 0; i < maxNumThreads; ++i)
+      {
+         if (_pvIndexPeptides[i].size() > 0)
+            CometFragmentIndex::WriteIndexPeptideRun(_pvIndexPeptides[i]);
+         vector<DBIndex>().swap(_pvIndexPeptides[i]);
+      }
+      return;
+   }
+
+   size_t tNumPeptides = g_pvDBIndex.size();
+
+   for (int i = 0; i < maxNumThreads; ++i)
+      tNumPeptides += _pvIndexPeptides[i].size();
+
+   g_pvDBIndex.reserve(tNumPeptides);
+
+   for (int i = 0; i < maxNumThreads; ++i)
+   {
+      g_pvDBIndex.insert(g_pvDBIndex.end(), _pvIndexPeptides[i].begin(), _pvIndexPeptides[i].end());
+      vector<DBIndex>().swap(_pvIndexPeptides[i]);
+   }
+}
+
+
 
 // called by DoSingleSpectrumSearch
 bool CometSearch::RunSearch(ThreadPool *tp)
@@ -116,9 +191,7 @@ bool CometSearch::RunSearch(ThreadPool *tp)
       g_bFragmentIndexRead = true;
    }
 
-   size_t iWhichQuery = 0;
-
-   sqSearch.SearchFragmentIndex(iWhichQuery, tp);
+   sqSearch.SearchFragmentIndex(0, 1, tp);
 
    return true;
 }
@@ -144,16 +217,15 @@ bool CometSearch::RunSearch(int iPercentStart,
          g_bFragmentIndexRead = true;
       }
 
-      int iNumIndexingThreads = g_staticParams.options.iNumThreads;
-      if (iNumIndexingThreads > FRAGINDEX_MAX_THREADS)
-         iNumIndexingThreads = FRAGINDEX_MAX_THREADS;
-
       ThreadPool *pSearchThreadPool = tp;
 
+      // g_pvQuery is sorted by precursor mass; each job queries the fragment
+      // index with a batch of FRAGINDEX_QUERY_BATCHSIZE neighboring spectra
       size_t iEnd = g_pvQuery.size();
-      for (size_t iWhichQuery = 0; iWhichQuery < iEnd; ++iWhichQuery)
+      for (size_t iWhichQuery = 0; iWhichQuery < iEnd; iWhichQuery += FRAGINDEX_QUERY_BATCHSIZE)
       {
-         pSearchThreadPool->doJob(std::bind(sqSearch.SearchFragmentIndex, iWhichQuery, pSearchThreadPool));
+         size_t iLastQuery = (iWhichQuery + FRAGINDEX_QUERY_BATCHSIZE < iEnd ? iWhichQuery + FRAGINDEX_QUERY_BATCHSIZE : iEnd);
+         pSearchThreadPool->doJob(std::bind(sqSearch.SearchFragmentIndex, iWhichQuery, iLastQuery, pSearchThreadPool));
       }
 
       pSearchThreadPool->wait_on_threads();
@@ -186,12 +258,41 @@ bool CometSearch::RunSearch(int iPercentStart,
 
       vector<OBOStruct> vectorPeffOBO;
 
+      SearchThreadData *pSearchThreadData = NULL;   // job being packed with database entries
+
       //Reuse existing ThreadPool
       ThreadPool *pSearchThreadPool = tp;
       
       g_staticParams.databaseInfo.uliTotAACount = 0;
       g_staticParams.databaseInfo.iTotalNumProteins = 0;
 
+      // later spectrum batches search the database entries kept by the first one
+      if (_bDatabaseEntriesKept)
+         return SearchKeptDatabaseEntries(iPercentStart, iPercentEnd, pSearchThreadPool);
+
+      // keep the database entries in memory if more spectrum batches are to be searched
+      bool bKeepEntries = !g_staticParams.options.bCreateIndex && !CometPreprocess::DoneProcessingAllSpectra();
+      _vDatabaseEntries.clear();
+
+      // plain fasta databases are memory mapped; PEFF databases are read below
+      if (!g_staticParams.peffInfo.iPeffSearch
+            && CometFragmentIndex::MapFile(g_staticParams.databaseInfo.szDatabase, &_sDatabaseMap))
+      {
+         bSucceeded = SearchMappedDatabase(_sDatabaseMap.pMap, _sDatabaseMap.tSize, iPercentStart, iPercentEnd,
+               bKeepEntries, pSearchThreadPool);
+
+         // kept entries' sequences stay in the mapped file until ReleaseDatabaseEntries
+         if (bSucceeded && bKeepEntries)
+         {
+            _bDatabaseEntriesKept = true;
+            _uliKeptTotAACount = g_staticParams.databaseInfo.uliTotAACount;
+         }
+         else
+            ReleaseDatabaseEntries();
+
+         return bSucceeded;
+      }
+
       if ((fp=fopen(g_staticParams.databaseInfo.szDatabase, "rb")) == NULL)
       {
          string  strErrorMsg = " Error (1) - cannot read database file \"" +  string(g_staticParams.databaseInfo.szDatabase) + "\n";
@@ -791,24 +892,17 @@ bool CometSearch::RunSearch(int iPercentStart,
                }
             }
 
-            // Allow up to 500 jobs/sequences to be queued before pausing; otherwise all
-            // sequences in the database will be loaded/queued all at once which can be
-            // a memory issue for extremely large fasta files
-            while (pSearchThreadPool->jobs_.size() >= 500)
-            {
-#ifdef _WIN32
-               Sleep(10);
-#else
-               usleep(10);
-#endif
-//             pSearchThreadPool->wait_on_threads();
-            }
+            DatabaseEntryStruct sEntry;
 
-            // Now search sequence entry; add threading here so that
-            // each protein sequence is passed to a separate thread.
-            SearchThreadData *pSearchThreadData = new SearchThreadData(dbe);
+            sEntry.dbEntry = dbe;
+            sEntry.tNumResidues = dbe.strSeq.size();
 
-            pSearchThreadPool->doJob(std::bind(SearchThreadProc, pSearchThreadData, pSearchThreadPool));
+            if (bKeepEntries)
+               _vDatabaseEntries.push_back(sEntry);
+
+            // Now search sequence entry; add threading here so that
+            // sequences are packed into jobs passed to separate threads.
+            AddSearchJobEntry(&pSearchThreadData, sEntry, pSearchThreadPool);
 
             g_staticParams.databaseInfo.iTotalNumProteins++;
 
@@ -836,6 +930,8 @@ bool CometSearch::RunSearch(int iPercentStart,
          }
       }
 
+      SubmitSearchJob(&pSearchThreadData, pSearchThreadPool);
+
       // Wait for active search threads to complete processing.
 
       pSearchThreadPool->wait_on_threads();
@@ -865,12 +961,309 @@ bool CometSearch::RunSearch(int iPercentStart,
          free(szMods);
          free(szPeffLine);
       }
+
+      if (bSucceeded && bKeepEntries)
+      {
+         _bDatabaseEntriesKept = true;
+         _uliKeptTotAACount = g_staticParams.databaseInfo.uliTotAACount;
+      }
+      else
+         ReleaseDatabaseEntries();
+   }
+
+   return bSucceeded;
+}
+
+
+// Search a memory mapped fasta database.  This thread only reads the description line
+// of each entry and finds the '>' that ends its sequence lines; the search threads
+// load the sequences from the mapped file (LoadSequence) in parallel.  Entries and
+// description lines are handled just as RunSearch does when reading the file.
+bool CometSearch::SearchMappedDatabase(const char *pDatabase,
+                                       size_t tDatabaseSize,
+                                       int iPercentStart,
+                                       int iPercentEnd,
+                                       bool bKeepEntries,
+                                       ThreadPool *tp)
+{
+   bool bSucceeded = true;
+   const char *pEnd = pDatabase + tDatabaseSize;
+   const char *pStr = pDatabase;
+   int iNumBadChars = 0; // count # of bad (non-printing) characters in header 
+
+   ThreadPool *pSearchThreadPool = tp;
+   SearchThreadData *pSearchThreadData = NULL;   // job being packed with database entries
+
+   if (!g_staticParams.options.bOutputSqtStream && !g_staticParams.options.bCreateIndex)
+   {
+      logout("     - Search progress: ");
+      fflush(stdout);
+   }
+
+   // skip through whitespace and a comment line at head of fasta
+   while (pStr < pEnd && isspace((unsigned char)*pStr))
+      pStr++;
+   if (pStr < pEnd && *pStr == '#')
+   {
+      while (pStr < pEnd && *pStr != '\n' && *pStr != '\r')
+         pStr++;
+   }
+
+   // skip lines until one starts with a '>'; as with fgets(szBuf[8192]), a line
+   // longer than 8191 characters continues on the next "line"
+   while (pStr < pEnd && *pStr != '>')
+   {
+      const char *pLine = pStr + 1;
+      while (pLine < pEnd && pLine - pStr <= 8191)
+      {
+         if (*pLine++ == '\n')
+            break;
+      }
+      pStr = pLine;
+   }
+
+   // each entry is a '>' through the next '>'
+   while (pStr < pEnd)
+   {
+      sDBEntry dbe;
+      bool bTrimDescr = false;
+
+      dbe.lProteinFilePosition = (comet_fileoffset_t)(pStr - pDatabase) + 1;
+
+      for (pStr++; pStr < pEnd && *pStr != '\n' && *pStr != '\r'; ++pStr)
+      {
+         int iTmpCh = (unsigned char)*pStr;
+
+         if (!bTrimDescr && iscntrl(iTmpCh))
+            bTrimDescr = true;
+
+         if (!bTrimDescr && dbe.strName.size() < (WIDTH_REFERENCE-1))
+         {
+            if (iTmpCh < 32 || iTmpCh>126)  // sanity check for reading binary (index) file
+            {
+               iNumBadChars++;
+               if (iNumBadChars > 20)
+               {
+                  logerr(" Too many non-printing characters in database header lines; wrong file type/format?\n");
+                  bSucceeded = false;
+                  break;
+               }
+            }
+            else
+               dbe.strName += iTmpCh;
+         }
+      }
+
+      if (!bSucceeded)
+         break;
+
+      if (dbe.strName.length() <= 0)
+      {
+         string strErrorMsg = " Error - zero length sequence description; wrong database file/format?\n";
+         g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+         logerr(strErrorMsg.c_str());
+         bSucceeded = false;
+         break;
+      }
+
+      if (g_staticParams.options.bCreateIndex)
+      {
+         struct IndexProteinStruct sEntry;
+
+         // store protein name
+         strcpy(sEntry.szProt, dbe.strName.c_str());
+         sEntry.lProteinFilePosition = dbe.lProteinFilePosition;
+         g_pvProteinNames.insert({ sEntry.lProteinFilePosition, sEntry });
+      }
+
+      if (pStr < pEnd)
+         pStr++;  // end of description line
+
+      const char *pSequence = pStr;
+
+      if ((pStr = (const char*)memchr(pSequence, '>', pEnd - pSequence)) == NULL)
+         pStr = pEnd;
+
+      DatabaseEntryStruct sEntry;
+
+      sEntry.dbEntry = dbe;
+      sEntry.pSequence = pSequence;
+      sEntry.tSequenceLen = pStr - pSequence;
+
+      // the sequence lines less their line breaks, found with memchr rather than
+      // walking every residue; an upper bound if the lines hold other characters
+      size_t tNumLineBreaks = 0;
+      for (const char *pLine = pSequence; (pLine = (const char*)memchr(pLine, '\n', pStr - pLine)) != NULL; ++pLine)
+         tNumLineBreaks += (pLine > pSequence && pLine[-1] == '\r') ? 2 : 1;
+      sEntry.tNumResidues = sEntry.tSequenceLen - tNumLineBreaks;
+
+      if (bKeepEntries)
+         _vDatabaseEntries.push_back(sEntry);
+
+      AddSearchJobEntry(&pSearchThreadData, sEntry, pSearchThreadPool);
+
+      g_staticParams.databaseInfo.iTotalNumProteins++;
+
+      if (!g_staticParams.options.bOutputSqtStream && !(g_staticParams.databaseInfo.iTotalNumProteins%500))
+      {
+         char szTmp[128];
+         comet_fileoffset_t lCurrPos = pStr - pDatabase;
+         if (g_staticParams.options.bCreateIndex)
+            sprintf(szTmp, "%3d%%", (int)(100.0*(0.005 + (double)lCurrPos/(double)tDatabaseSize)));
+         else // go from iPercentStart to iPercentEnd, scaled by lCurrPos/tDatabaseSize
+            sprintf(szTmp, "%3d%%", (int)(((iPercentStart + ((double)iPercentEnd-iPercentStart)*(double)lCurrPos/(double)tDatabaseSize) )));
+         logout(szTmp);
+         fflush(stdout);
+         logout("\b\b\b\b");
+      }
+
+      bSucceeded = !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
+      if (!bSucceeded)
+         break;
+   }
+
+   SubmitSearchJob(&pSearchThreadData, pSearchThreadPool);
+
+   // Wait for active search threads to complete processing; they use the mapped file.
+   pSearchThreadPool->wait_on_threads();
+
+   // residues counted by each search thread as it loaded its sequences
+   for (int i = 0; i < g_staticParams.options.iNumThreads; ++i)
+   {
+      g_staticParams.databaseInfo.uliTotAACount += _pSearchWorkspace[i]._uliNumResidues;
+      _pSearchWorkspace[i]._uliNumResidues = 0;
+   }
+
+   // Check for errors one more time since there might have been an error
+   // while we were waiting for the threads.
+   if (bSucceeded)
+      bSucceeded = !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
+
+   if (!g_staticParams.options.bOutputSqtStream)
+   {
+      char szTmp[128];
+      if (g_staticParams.options.bCreateIndex)
+         sprintf(szTmp, "100%%\n");
+      else
+         sprintf(szTmp, "%3d%%\n", iPercentEnd);
+      logout(szTmp);
+      fflush(stdout);
    }
 
    return bSucceeded;
 }
 
 
+// Search the database entries kept in memory by the first spectrum batch.
+bool CometSearch::SearchKeptDatabaseEntries(int iPercentStart,
+                                            int iPercentEnd,
+                                            ThreadPool *tp)
+{
+   bool bSucceeded = true;
+   size_t tNumEntries = _vDatabaseEntries.size();
+
+   ThreadPool *pSearchThreadPool = tp;
+   SearchThreadData *pSearchThreadData = NULL;
+
+   if (!g_staticParams.options.bOutputSqtStream)
+   {
+      logout("     - Search progress: ");
+      fflush(stdout);
+   }
+
+   for (size_t i = 0; i < tNumEntries; ++i)
+   {
+      DatabaseEntryStruct &sEntry = _vDatabaseEntries[i];
+
+      AddSearchJobEntry(&pSearchThreadData, sEntry, pSearchThreadPool);
+
+      if (!g_staticParams.options.bOutputSqtStream && !((i+1)%500))
+      {
+         char szTmp[128];
+         sprintf(szTmp, "%3d%%", (int)(((iPercentStart + ((double)iPercentEnd-iPercentStart)*(double)(i+1)/(double)tNumEntries) )));
+         logout(szTmp);
+         fflush(stdout);
+         logout("\b\b\b\b");
+      }
+
+      bSucceeded = !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
+      if (!bSucceeded)
+         break;
+   }
+
+   SubmitSearchJob(&pSearchThreadData, pSearchThreadPool);
+
+   pSearchThreadPool->wait_on_threads();
+
+   if (bSucceeded)
+      bSucceeded = !g_cometStatus.IsError() && !g_cometStatus.IsCancel();
+
+   // totals of the database as counted by the first batch
+   g_staticParams.databaseInfo.iTotalNumProteins = (int)tNumEntries;
+   g_staticParams.databaseInfo.uliTotAACount = _uliKeptTotAACount;
+
+   for (int i = 0; i < g_staticParams.options.iNumThreads; ++i)
+      _pSearchWorkspace[i]._uliNumResidues = 0;
+
+   if (!g_staticParams.options.bOutputSqtStream)
+   {
+      char szTmp[128];
+      sprintf(szTmp, "%3d%%\n", iPercentEnd);
+      logout(szTmp);
+      fflush(stdout);
+   }
+
+   return bSucceeded;
+}
+
+
+// Free the database entries kept for later spectrum batches.
+void CometSearch::ReleaseDatabaseEntries(void)
+{
+   vector<DatabaseEntryStruct>().swap(_vDatabaseEntries);
+   _bDatabaseEntriesKept = false;
+   CometFragmentIndex::UnmapFile(&_sDatabaseMap);
+}
+
+
+// Set strSeq to the residues of the sequence lines of a memory mapped database entry,
+// in upper case with all but residues and stop codons removed.  Returns the # of
+// residues, not counting stop codons.
+unsigned long int CometSearch::LoadSequence(const char *pSequence,
+                                            size_t tSequenceLen,
+                                            string& strSeq)
+{
+   unsigned long int uliNumResidues = 0;
+
+   strSeq.resize(tSequenceLen);
+
+   char *pSeq = &strSeq[0];
+   for (size_t i = 0; i < tSequenceLen; ++i)
+   {
+      char cResidue = pSequence[i];
+
+      if ('a' <= cResidue && cResidue <= 'z')
+      {
+         *pSeq++ = cResidue - 32;  // convert toupper case so subtract 32 (i.e. 'A'-'a')
+         uliNumResidues++;
+      }
+      else if ('A' <= cResidue && cResidue <= 'Z')
+      {
+         *pSeq++ = cResidue;
+         uliNumResidues++;
+      }
+      else if (cResidue == '*')  // stop codon
+      {
+         *pSeq++ = cResidue;
+      }
+   }
+
+   strSeq.resize(pSeq - strSeq.data());
+
+   return uliNumResidues;
+}
+
+
 void CometSearch::ReadOBO(char *szOBO,
                           vector<OBOStruct> *vectorPeffOBO)
 {
@@ -989,43 +1382,144 @@ bool CometSearch::MapOBO(string strMod, vector<OBOStruct> *vectorPeffOBO, struct
 
 void CometSearch::SearchThreadProc(SearchThreadData *pSearchThreadData, ThreadPool* tp)
 {
-   // Grab available array from shared memory pool.
-   int i;
-
-   Threading::LockMutex(g_searchMemoryPoolMutex);   
+   unsigned long int uliNumResidues = 0;
 
-   for (i = 0; i < g_staticParams.options.iNumThreads; ++i)
+   for (auto it = pSearchThreadData->vEntries.begin(); it != pSearchThreadData->vEntries.end(); ++it)
    {
-      if (!_pbSearchMemoryPool[i])
-      {
-         _pbSearchMemoryPool[i] = true;
-         break;
-      }
+      if (it->pSequence != NULL)  // never a slice; AddSearchJobEntry loads those
+         uliNumResidues += LoadSequence(it->pSequence, it->tSequenceLen, it->dbEntry.strSeq);
    }
 
-   // Fail-safe to stop if memory isn't available for the next thread.
-   // Needs better capture and return?
-   if (i == g_staticParams.options.iNumThreads)
+   // This thread's search memory; no other thread uses it.
+   int i = WhichSearchWorkspace(tp);
+
+   if (i < 0)
    {
-      printf("Error with memory pool.\n");
-      exit(1);
+      delete pSearchThreadData;
+      return;
    }
 
-   Threading::UnlockMutex(g_searchMemoryPoolMutex);
+   CometSearch *pSearch = &_pSearchWorkspace[i];
 
-   // Give memory manager access to the thread.
-   pSearchThreadData->pbSearchMemoryPool = &_pbSearchMemoryPool[i];
+   pSearch->_uliNumResidues += uliNumResidues;
+
+   for (auto it = pSearchThreadData->vEntries.begin(); it != pSearchThreadData->vEntries.end(); ++it)
+   {
+      pSearch->_iSearchStartPos = it->iStartPos;
+      pSearch->_iSearchEndPos = it->iEndPos;
+
+      // DoSearch now returns true/false, but we already log errors and set
+      // the global error variable before we get here, so no need to check
+      // the return value here.
+      pSearch->DoSearch(it->dbEntry, _ppbDuplFragmentArr[i]);
+
+      if (g_cometStatus.IsError() || g_cometStatus.IsCancel())
+         break;
+   }
+
+   pSearch->_iSearchStartPos = 0;
+   pSearch->_iSearchEndPos = INT_MAX;
 
-   CometSearch sqSearch;
-   // DoSearch now returns true/false, but we already log errors and set
-   // the global error variable before we get here, so no need to check
-   // the return value here.
-   sqSearch.DoSearch(pSearchThreadData->dbEntry, _ppbDuplFragmentArr[i]);
    delete pSearchThreadData;
    pSearchThreadData = NULL;
 }
 
 
+// Search memory slot of the calling thread.  Each pool thread, and the thread that
+// queues the jobs and also runs them in wait_on_threads(), owns one slot from
+// AllocateMemory() to DeallocateMemory() so jobs reuse it without any locking.
+// Returns -1, with the error status set, if the pool has more threads than slots.
+int CometSearch::WhichSearchWorkspace(ThreadPool *tp)
+{
+   int i = tp->getThreadIndex();
+
+   if (i >= g_staticParams.options.iNumThreads)
+   {
+      char szErrorMsg[SIZE_ERROR];
+      sprintf(szErrorMsg, " Error - no search workspace for search thread %d; only %d slots were allocated.\n",
+            i, g_staticParams.options.iNumThreads);
+      string strErrorMsg(szErrorMsg);
+      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
+      logerr(szErrorMsg);
+      return -1;
+   }
+
+   return i;
+}
+
+
+// Pack a database entry into the search job being filled, queuing the job once it
+// holds SEARCH_JOB_RESIDUES residues.  A protein longer than that is split into
+// slices of peptide start positions; each slice still sees the whole sequence so
+// peptides crossing a slice boundary are found once, by the slice they start in.
+void CometSearch::AddSearchJobEntry(SearchThreadData **ppSearchThreadData,
+                                    DatabaseEntryStruct &sEntry,
+                                    ThreadPool *tp)
+{
+   // Nucleotide and PEFF variant searches go through the whole sequence in one pass.
+   bool bSplit = sEntry.tNumResidues > SEARCH_JOB_RESIDUES
+      && g_staticParams.options.iWhichReadingFrame == 0
+      && sEntry.dbEntry.vectorPeffVariantSimple.empty()
+      && sEntry.dbEntry.vectorPeffVariantComplex.empty();
+
+   // A memory mapped protein to split is loaded once here for all of its slices, which
+   // are then bounded by its actual length.  Its residues are counted here too as no
+   // search thread loads it.
+   if (bSplit && sEntry.pSequence != NULL)
+   {
+      g_staticParams.databaseInfo.uliTotAACount += LoadSequence(sEntry.pSequence, sEntry.tSequenceLen, sEntry.dbEntry.strSeq);
+      sEntry.pSequence = NULL;
+      sEntry.tNumResidues = sEntry.dbEntry.strSeq.size();
+   }
+
+   size_t tNumResidues = sEntry.tNumResidues;
+   size_t tStartPos = 0;
+
+   do
+   {
+      size_t tSliceResidues = tNumResidues;
+
+      if (*ppSearchThreadData == NULL)
+         *ppSearchThreadData = new SearchThreadData();
+
+      (*ppSearchThreadData)->vEntries.push_back(sEntry);
+
+      if (bSplit)
+      {
+         DatabaseEntryStruct &sSlice = (*ppSearchThreadData)->vEntries.back();
+
+         tSliceResidues = (tNumResidues - tStartPos < SEARCH_JOB_RESIDUES ? tNumResidues - tStartPos : SEARCH_JOB_RESIDUES);
+
+         sSlice.iStartPos = (int)tStartPos;
+         if (tStartPos + tSliceResidues < tNumResidues)
+            sSlice.iEndPos = (int)(tStartPos + tSliceResidues);
+      }
+
+      (*ppSearchThreadData)->tNumResidues += tSliceResidues;
+      tStartPos += tSliceResidues;
+
+      if ((*ppSearchThreadData)->tNumResidues >= SEARCH_JOB_RESIDUES)
+         SubmitSearchJob(ppSearchThreadData, tp);
+
+   } while (bSplit && tStartPos < tNumResidues);
+}
+
+
+// Queue the search job being filled by AddSearchJobEntry.
+void CometSearch::SubmitSearchJob(SearchThreadData **ppSearchThreadData,
+                                  ThreadPool *tp)
+{
+   if (*ppSearchThreadData == NULL)
+      return;
+
+   // Allow up to 500 jobs to be queued before blocking; otherwise all sequences
+   // in the database will be loaded/queued all at once which can be a memory
+   // issue for extremely large fasta files
+   tp->doJob(std::bind(SearchThreadProc, *ppSearchThreadData, tp), 500);
+   *ppSearchThreadData = NULL;
+}
+
+
 bool CometSearch::DoSearch(sDBEntry dbe, bool *pbDuplFragment)
 {
    // Standard protein database search.
@@ -1042,7 +1536,7 @@ bool CometSearch::DoSearch(sDBEntry dbe, bool *pbDuplFragment)
       if (!SearchForPeptides(dbe, (char *)dbe.strSeq.c_str(), 0, pbDuplFragment))
          return false;
 
-      if (g_staticParams.options.bClipNtermMet && dbe.strSeq[0]=='M')
+      if (g_staticParams.options.bClipNtermMet && dbe.strSeq[0]=='M' && _iSearchStartPos == 0)
       {
          _proteinInfo.iTmpProteinSeqLength -= 1;   // remove 1 for M, used in checking termini
 
@@ -1187,124 +1681,300 @@ bool CometSearch::DoSearch(sDBEntry dbe, bool *pbDuplFragment)
 }
 
 
-void CometSearch::SearchFragmentIndex(size_t iWhichQuery,
+// Query the fragment index with the queries [iFirstQuery, iLastQuery).  Queries are
+// sorted by precursor mass so neighboring queries look up many of the same precursor
+// and fragment bin posting lists; each list needed by the batch is walked once and
+// its matches are scattered to every query in the batch that asked for it.
+void CometSearch::SearchFragmentIndex(size_t iFirstQuery,
+                                      size_t iLastQuery,
                                       ThreadPool* tp)
 {
-   double pdAAforward[MAX_PEPTIDE_LEN];
-   double pdAAreverse[MAX_PEPTIDE_LEN];
+   int iWhichThread = WhichSearchWorkspace(tp);
 
-   CometSearch sqSearch;
+   if (iWhichThread < 0)
+      return;
+
+   CometSearch *pSearch = &_pSearchWorkspace[iWhichThread];
 
-   std::map<comet_fileoffset_t, int> mPeptides;   // which peptide (fileoffset, and # matched fragments)
+   size_t iNumQueries = iLastQuery - iFirstQuery;
    size_t lNumPeps = 0;
    unsigned int uiFragmentMass;
-   int iArraySize = (int)((g_staticParams.options.dPeptideMassHigh + 100.0) * g_staticParams.dInverseBinWidth);
 
-   unsigned int uiBinnedIonMasses[MAX_FRAGMENT_CHARGE + 1][9][MAX_PEPTIDE_LEN][BIN_MOD_COUNT];
-   unsigned int uiBinnedPrecursorNL[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE];
+   // float search keys of each query's precursor tolerance range for g_fFragmentIndexPepMass
+   vector<float> vfPeptideMassToleranceMinus(iNumQueries);
+   vector<float> vfPeptideMassTolerancePlus(iNumQueries);
 
-   bool* pbDuplFragment = new bool[iArraySize];
+   // for a compressed index, the range of mass ordered g_vFragmentPeptides entries
+   // within each query's precursor tolerance range
+   bool bCompressed = (g_ullFragmentIndexBlockOffsets != NULL);
+   vector<unsigned int> vuiFirstPeptide(iNumQueries);
+   vector<unsigned int> vuiEndPeptide(iNumQueries);
 
-/*
-   // print out fragment masses at each fragment index
-   int x=0;
+   // posting list (precursor bin, fragment bin) and batch query that looks it up
+   vector<std::pair<size_t, unsigned int>> vQueryLists;
 
-   for (int iWhichThread = 0; iWhichThread < g_staticParams.options.iFragIndexNumThreads; ++iWhichThread)
+   // Walk through the binned peaks in each spectrum and list the fragment index
+   // entries to look up to count all peptides that contain each fragment peak.
+   for (size_t iQuery = 0; iQuery < iNumQueries; ++iQuery)
    {
-      for (int iPrecursorBin = 0; iPrecursorBin < FRAGINDEX_PRECURSORBIN; ++iPrecursorBin)
+      Query* pQuery = g_pvQuery.at(iFirstQuery + iQuery);
+
+      int iPrecursorBinStart = CometFragmentIndex::WhichPrecursorBin(pQuery->_pepMassInfo.dPeptideMassToleranceMinus);
+      int iPrecursorBinEnd   = CometFragmentIndex::WhichPrecursorBin(pQuery->_pepMassInfo.dPeptideMassTolerancePlus);
+
+      vfPeptideMassToleranceMinus[iQuery] = (float)pQuery->_pepMassInfo.dPeptideMassToleranceMinus;
+      vfPeptideMassTolerancePlus[iQuery]  = (float)pQuery->_pepMassInfo.dPeptideMassTolerancePlus;
+
+      if (bCompressed)
+      {
+         double dToleranceMinus = pQuery->_pepMassInfo.dPeptideMassToleranceMinus;
+         double dTolerancePlus = pQuery->_pepMassInfo.dPeptideMassTolerancePlus;
+
+         vuiFirstPeptide[iQuery] = (unsigned int)(std::lower_bound(g_pFragmentPeptides, g_pFragmentPeptides + g_tNumFragmentPeptides, dToleranceMinus,
+                  [](const FragmentPeptidesStruct& a, double dMass) { return a.dPepMass < dMass; }) - g_pFragmentPeptides);
+         vuiEndPeptide[iQuery] = (unsigned int)(std::upper_bound(g_pFragmentPeptides, g_pFragmentPeptides + g_tNumFragmentPeptides, dTolerancePlus,
+                  [](double dMass, const FragmentPeptidesStruct& a) { return dMass < a.dPepMass; }) - g_pFragmentPeptides);
+      }
+
+      for (auto it2 = pQuery->vdRawFragmentPeakMass.begin(); it2 != pQuery->vdRawFragmentPeakMass.end(); ++it2)
       {
-         for (unsigned int i = 0; i < g_massRange.g_uiMaxFragmentArrayIndex; ++i)
+         // We can consider higher charged fragments by simply assuming each fragment mass is
+         // higher charged and convert to singly charged to look into the 1+ paXionfileOffsets[].
+         // FIX: ideally deconvolute input spectrum to singly charged first
+         for (int iChg = 1; iChg <= pQuery->_spectrumInfoInternal.iMaxFragCharge; ++iChg)
          {
-            if (g_arrvFragmentIndex[iWhichThread][iPrecursorBin][i].size() > 0)
+            uiFragmentMass = BIN((*it2) * iChg - (iChg - 1.0));
+
+            if (uiFragmentMass < g_massRange.g_uiMaxFragmentArrayIndex)
             {
-               for (size_t ii = 0; ii < g_arrvFragmentIndex[iWhichThread][iPrecursorBin][i].size(); ++ii)
+               for (int iPrecursorBin = iPrecursorBinStart; iPrecursorBin <= iPrecursorBinEnd; ++iPrecursorBin)
                {
-                  printf("%0.2f ", g_vFragmentPeptides[g_arrvFragmentIndex[iWhichThread][iPrecursorBin][i][ii]].dPepMass);
-                  if (ii==10)
-                     break;
+                  size_t tList = (size_t)iPrecursorBin * g_massRange.g_uiMaxFragmentArrayIndex + uiFragmentMass;
+                  vQueryLists.push_back(std::make_pair(tList, (unsigned int)iQuery));
                }
-               printf("\n");
-               x++;
             }
-            if (x == 10)
-               break;
          }
       }
    }
-*/
 
-   mPeptides.clear();
+   sort(vQueryLists.begin(), vQueryLists.end());
+
+   // matched g_vFragmentPeptides entries of each batch query; an entry is listed once
+   // per matched fragment peak
+   vector<vector<unsigned int>> vvuiMatches(iNumQueries);
 
-   int iPrecursorBinStart = CometFragmentIndex::WhichPrecursorBin(g_pvQuery.at(iWhichQuery)->_pepMassInfo.dPeptideMassToleranceMinus);
-   int iPrecursorBinEnd   = CometFragmentIndex::WhichPrecursorBin(g_pvQuery.at(iWhichQuery)->_pepMassInfo.dPeptideMassTolerancePlus);
+   unsigned int puiBlockEntries[FRAGINDEX_POSTINGBLOCKSIZE];
 
-   // Walk through the binned peaks in the spectrum and map them to the fragment index
-   // to count all peptides that contain each fragment peak.
-   for (auto it2 = g_pvQuery.at(iWhichQuery)->vdRawFragmentPeakMass.begin();
-      it2 != g_pvQuery.at(iWhichQuery)->vdRawFragmentPeakMass.end(); ++it2)
+   for (size_t i = 0; i < vQueryLists.size(); )
    {
-      // We can consider higher charged fragments by simply assuming each fragment mass is
-      // higher charged and convert to singly charged to look into the 1+ paXionfileOffsets[].
-      // FIX: ideally deconvolute input spectrum to singly charged first
-      for (int iChg = 1; iChg <= g_pvQuery.at(iWhichQuery)->_spectrumInfoInternal.iMaxFragCharge; ++iChg)
+      size_t tList = vQueryLists[i].first;
+      size_t iGroupEnd = i;
+
+      // union of the precursor tolerance ranges of the batch queries looking up this list
+      float fPeptideMassToleranceMinus = vfPeptideMassToleranceMinus[vQueryLists[i].second];
+      float fPeptideMassTolerancePlus  = vfPeptideMassTolerancePlus[vQueryLists[i].second];
+
+      while (iGroupEnd < vQueryLists.size() && vQueryLists[iGroupEnd].first == tList)
       {
-         uiFragmentMass = BIN((*it2) * iChg - (iChg - 1.0));
+         unsigned int iQuery = vQueryLists[iGroupEnd].second;
+
+         if (vfPeptideMassToleranceMinus[iQuery] < fPeptideMassToleranceMinus)
+            fPeptideMassToleranceMinus = vfPeptideMassToleranceMinus[iQuery];
+         if (vfPeptideMassTolerancePlus[iQuery] > fPeptideMassTolerancePlus)
+            fPeptideMassTolerancePlus = vfPeptideMassTolerancePlus[iQuery];
+
+         ++iGroupEnd;
+      }
 
-         if (uiFragmentMass < g_massRange.g_uiMaxFragmentArrayIndex)
+      // number of peptides that contain this fragment mass
+      lNumPeps = (size_t)(g_ullFragmentIndexOffsets[tList + 1] - g_ullFragmentIndexOffsets[tList]);
+
+      if (lNumPeps > 0 && bCompressed)
+      {
+         // Entries of a compressed list are in increasing order, which is mass order, so the
+         // queries' precursor tolerance ranges are entry ranges.  Skip to the last block that
+         // starts before the lowest entry of the batch queries and decode blocks from there.
+         unsigned int uiFirstPeptide = vuiFirstPeptide[vQueryLists[i].second];
+         unsigned int uiEndPeptide = vuiEndPeptide[vQueryLists[i].second];
+
+         for (size_t iGroup = i + 1; iGroup < iGroupEnd; ++iGroup)
+         {
+            unsigned int iQuery = vQueryLists[iGroup].second;
+
+            if (vuiFirstPeptide[iQuery] < uiFirstPeptide)
+               uiFirstPeptide = vuiFirstPeptide[iQuery];
+            if (vuiEndPeptide[iQuery] > uiEndPeptide)
+               uiEndPeptide = vuiEndPeptide[iQuery];
+         }
+
+         size_t tBlockStart = (size_t)g_ullFragmentIndexBlockOffsets[tList];
+         size_t tBlockEnd = (size_t)g_ullFragmentIndexBlockOffsets[tList + 1];
+         size_t tBlock = std::lower_bound(g_uiFragmentIndexBlockFirst + tBlockStart,
+               g_uiFragmentIndexBlockFirst + tBlockEnd, uiFirstPeptide) - g_uiFragmentIndexBlockFirst;
+
+         if (tBlock > tBlockStart)
+            --tBlock;
+
+         for (; tBlock < tBlockEnd && g_uiFragmentIndexBlockFirst[tBlock] < uiEndPeptide; ++tBlock)
          {
-            for (int iWhichThread = 0; iWhichThread < g_staticParams.options.iFragIndexNumThreads; ++iWhichThread)
+            size_t tSkipped = (tBlock - tBlockStart) * FRAGINDEX_POSTINGBLOCKSIZE;
+            unsigned int uiNumEntries = (unsigned int)(lNumPeps - tSkipped < FRAGINDEX_POSTINGBLOCKSIZE ? lNumPeps - tSkipped : FRAGINDEX_POSTINGBLOCKSIZE);
+
+            CometFragmentIndex::DecodePostingBlock(tBlock, uiNumEntries, puiBlockEntries);
+
+            for (unsigned int ix = 0; ix < uiNumEntries && puiBlockEntries[ix] < uiEndPeptide; ++ix)
             {
-               for (int iPrecursorBin = iPrecursorBinStart; iPrecursorBin <= iPrecursorBinEnd; ++iPrecursorBin)
+               if (puiBlockEntries[ix] < uiFirstPeptide)
+                  continue;
+
+               for (size_t iGroup = i; iGroup < iGroupEnd; ++iGroup)
                {
-                  // number of peptides that contain this fragment mass
-                  lNumPeps = g_iCountFragmentIndex[iWhichThread][iPrecursorBin][uiFragmentMass];
+                  unsigned int iQuery = vQueryLists[iGroup].second;
 
-                  if (lNumPeps > 0)
+                  if (puiBlockEntries[ix] >= vuiFirstPeptide[iQuery]
+                        && puiBlockEntries[ix] < vuiEndPeptide[iQuery]
+                        && pSearch->CheckMassMatch(iFirstQuery + iQuery, g_pFragmentPeptides[puiBlockEntries[ix]].dPepMass))
                   {
-                     // g_vFragmentPeptides[g_iFragmentIndex[iWhichThread][uiFragmentMass][ix]].dPepMass
-                     // is >= to g_pvQuery.at(iWhichQuery)->_pepMassInfo.dPeptideMassToleranceMinus
-                     // Each fragment index entry has lNumPeps peptides sort in increasing order by mass;
-                     // find first entry that matches low tolerance of current query
+                     vvuiMatches[iQuery].push_back(puiBlockEntries[ix]);
+                  }
+               }
+            }
+         }
+      }
+      else if (lNumPeps > 0)
+      {
+         const unsigned int *puiEntries = g_uiFragmentIndex + g_ullFragmentIndexOffsets[tList];
+         const float *pfPepMass = g_fFragmentIndexPepMass + g_ullFragmentIndexOffsets[tList];
 
-                     size_t iFirst = BinarySearchIndexMass(iWhichThread, iPrecursorBin, 0,
-                           lNumPeps, g_pvQuery.at(iWhichQuery)->_pepMassInfo.dPeptideMassToleranceMinus, &uiFragmentMass);
+         // Each fragment index entry has lNumPeps peptides sorted in increasing order by mass
+         // with pfPepMass holding their masses as float keys; find first entry that matches
+         // the lowest tolerance of the batch queries and scan while the key is within the
+         // highest tolerance.  CheckMassMatch does the exact tolerance check on the double mass.
 
-                     for (size_t ix = iFirst; ix < lNumPeps; ++ix)
-                     {
-                        double dCalcPepMass = g_vFragmentPeptides[g_iFragmentIndex[iWhichThread][iPrecursorBin][uiFragmentMass][ix]].dPepMass;
+         size_t iFirst = LowerBoundIndexMass(pfPepMass, lNumPeps, fPeptideMassToleranceMinus);
 
-                        if (dCalcPepMass >= g_pvQuery.at(iWhichQuery)->_pepMassInfo.dPeptideMassToleranceMinus
-                           && dCalcPepMass <= g_pvQuery.at(iWhichQuery)->_pepMassInfo.dPeptideMassTolerancePlus)
-                        {
-                           if (sqSearch.CheckMassMatch(iWhichQuery, dCalcPepMass))
-                              mPeptides[g_iFragmentIndex[iWhichThread][iPrecursorBin][uiFragmentMass][ix]] += 1;
-                        }
+         for (size_t ix = iFirst; ix < lNumPeps && pfPepMass[ix] <= fPeptideMassTolerancePlus; ++ix)
+         {
+            for (size_t iGroup = i; iGroup < iGroupEnd; ++iGroup)
+            {
+               unsigned int iQuery = vQueryLists[iGroup].second;
 
-                        if (dCalcPepMass > g_pvQuery.at(iWhichQuery)->_pepMassInfo.dPeptideMassTolerancePlus)
-                           break;
-                     }
-                  }
+               if (pfPepMass[ix] >= vfPeptideMassToleranceMinus[iQuery]
+                     && pfPepMass[ix] <= vfPeptideMassTolerancePlus[iQuery]
+                     && pSearch->CheckMassMatch(iFirstQuery + iQuery, g_pFragmentPeptides[puiEntries[ix]].dPepMass))
+               {
+                  vvuiMatches[iQuery].push_back(puiEntries[ix]);
                }
             }
          }
       }
+
+      i = iGroupEnd;
    }
 
-   // copy mPeptides map to a vector of pairs and sort in
-   // descending order of matched fragment ions
-   std::vector<std::pair<comet_fileoffset_t, int>> vPeptides;
-   for (auto ix = mPeptides.begin(); ix != mPeptides.end(); ++ix)
+   vQueryLists.clear();
+
+   FragmentIndexAccumulator *pAccum = &_pFragIndexAccumulator[iWhichThread];
+
+   if (pAccum->tSize != g_tNumFragmentPeptides)
    {
-      if (ix->second >= FRAGINDEX_MIN_MATCHEDIONS)
-         vPeptides.push_back(*ix);
+      delete [] pAccum->puiMatchCount;
+
+      // zeroed so no entry carries the stamp of the first generation
+      pAccum->tSize = g_tNumFragmentPeptides;
+      pAccum->puiMatchCount = new unsigned int[pAccum->tSize]();
+      pAccum->uiGeneration = 0;
+   }
+
+   unsigned int *puiMatchCount = pAccum->puiMatchCount;
+   vector<unsigned int>& vuiTouched = pAccum->vuiTouched;
+
+   vector<vector<std::pair<comet_fileoffset_t, int>>> vvPeptides(iNumQueries);
+
+   for (size_t iQuery = 0; iQuery < iNumQueries; ++iQuery)
+   {
+      // Advance the generation so all counts from the previous query are stale;
+      // only on 16-bit wraparound does the count array need to be cleared.
+      pAccum->uiGeneration = (pAccum->uiGeneration + 1) & 0xFFFF;
+      if (pAccum->uiGeneration == 0)
+      {
+         memset(pAccum->puiMatchCount, 0, sizeof(unsigned int) * pAccum->tSize);
+         pAccum->uiGeneration = 1;
+      }
+
+      unsigned int uiGenerationStamp = pAccum->uiGeneration << 16;
+
+      vuiTouched.clear();
+
+      for (auto it = vvuiMatches[iQuery].begin(); it != vvuiMatches[iQuery].end(); ++it)
+      {
+         unsigned int uiCount = puiMatchCount[*it];
+
+         if ((uiCount & 0xFFFF0000) != uiGenerationStamp)
+         {
+            uiCount = uiGenerationStamp;
+            vuiTouched.push_back(*it);
+         }
+
+         if ((uiCount & 0xFFFF) != 0xFFFF)
+            uiCount++;
+
+         puiMatchCount[*it] = uiCount;
+      }
+
+      vector<unsigned int>().swap(vvuiMatches[iQuery]);
+
+      // copy touched peptides with enough matched fragment ions to a vector of pairs,
+      // select the top iFragIndexMaxNumScored and sort those in descending order of
+      // matched fragment ions (ties by peptide entry to keep the order deterministic)
+      vector<std::pair<comet_fileoffset_t, int>>& vPeptides = vvPeptides[iQuery];
+      for (auto it = vuiTouched.begin(); it != vuiTouched.end(); ++it)
+      {
+         int iMatchCount = (int)(puiMatchCount[*it] & 0xFFFF);
+
+         if (iMatchCount >= g_staticParams.options.iFragIndexMinMatchedIons)
+            vPeptides.push_back(std::make_pair((comet_fileoffset_t)*it, iMatchCount));
+      }
+
+      auto compareMatchCount = [](const std::pair<comet_fileoffset_t, int>& a, const std::pair<comet_fileoffset_t, int>& b)
+      {
+         return (a.second > b.second || (a.second == b.second && a.first < b.first));
+      };
+
+      size_t tNumScored = (size_t)g_staticParams.options.iFragIndexMaxNumScored;
+      if (vPeptides.size() > tNumScored)
+      {
+         std::nth_element(vPeptides.begin(), vPeptides.begin() + tNumScored, vPeptides.end(), compareMatchCount);
+         vPeptides.resize(tNumScored);
+      }
+      sort(vPeptides.begin(), vPeptides.end(), compareMatchCount);
    }
 
-   mPeptides.clear();
-   sort(vPeptides.begin(), vPeptides.end(), [=](const std::pair<comet_fileoffset_t, int>& a, const std::pair<comet_fileoffset_t, int>& b) { return a.second > b.second; });
+   for (size_t iQuery = 0; iQuery < iNumQueries; ++iQuery)
+      XcorrScoreFragmentIndexPeptides(iFirstQuery + iQuery, vvPeptides[iQuery], iWhichThread);
+}
+
+
+// Score the fragment index candidates in vPeptides, already sorted in descending
+// order of matched fragment ions, against query iWhichQuery with xcorr.  Scratch
+// arrays come from search thread iWhichThread's workspace.
+void CometSearch::XcorrScoreFragmentIndexPeptides(size_t iWhichQuery,
+                                                  vector<std::pair<comet_fileoffset_t, int>>& vPeptides,
+                                                  int iWhichThread)
+{
+   double *pdAAforward = _pSearchWorkspace[iWhichThread]._pdAAforward;
+   double *pdAAreverse = _pSearchWorkspace[iWhichThread]._pdAAreverse;
+
+   int iArraySize = (int)((g_staticParams.options.dPeptideMassHigh + 100.0) * g_staticParams.dInverseBinWidth);
+
+   auto& uiBinnedIonMasses = _pSearchWorkspace[iWhichThread]._uiBinnedIonMasses;
+   auto& uiBinnedPrecursorNL = _pSearchWorkspace[iWhichThread]._uiBinnedPrecursorNL;
+
+   bool* pbDuplFragment = _ppbDuplFragmentArr[iWhichThread];
 
    // Now that all peptides are determined based on mapping fragment ions,
    // re-score highest matches with xcorr. Let use cutoff of at least
-   // FRAGINDEX_MIN_MATCHEDIONS fragment ion matches.
+   // iFragIndexMinMatchedIons fragment ion matches.
 
    int iLenPeptide;
    int iWhichIonSeries;
@@ -1325,28 +1995,27 @@ void CometSearch::SearchFragmentIndex(size_t iWhichQuery,
 
    for (auto ix = vPeptides.begin(); ix != vPeptides.end(); ++ix)
    {
-      // ix->first references peptide entry in g_vFragmentPeptides[ix->first].iWhichPeptide/.modnumIdx
+      // ix->first references peptide entry in g_pFragmentPeptides[ix->first].iWhichPeptide/.modnumIdx
       // ix->second is matched fragment count
 
-      if (++iCountPeptidesScored >= FRAGINDEX_MAX_NUMSCORED) // set some cutoff to score only N top peptides based on fragment ion match
+      if (++iCountPeptidesScored >= g_staticParams.options.iFragIndexMaxNumScored) // set some cutoff to score only N top peptides based on fragment ion match
          break;
 
-      if (ix->second >= FRAGINDEX_MIN_MATCHEDIONS)
+      if (ix->second >= g_staticParams.options.iFragIndexMinMatchedIons)
       {
          int iFoundVariableMod = 0;
 
          // calculate full xcorr here those that pass simple filter
 
-         strcpy(szPeptide, g_vRawPeptides.at(g_vFragmentPeptides[ix->first].iWhichPeptide).sPeptide.c_str());
-         iLenPeptide = strlen(szPeptide);
+         iLenPeptide = CometFragmentIndex::GetRawPeptide(g_pFragmentPeptides[ix->first].iWhichPeptide, szPeptide);
 
-         ModificationNumber modNum;
-         char* mods = NULL;
+         char szMods[MAX_PEPTIDE_LEN];
+         char* mods = szMods;
          int modSeqIdx;
-         int modNumIdx = g_vFragmentPeptides[ix->first].modNumIdx;
-         int iWhichPeptide = g_vFragmentPeptides[ix->first].iWhichPeptide;
-         string modSeq;
-         double dCalcPepMass = g_vFragmentPeptides[ix->first].dPepMass;
+         int modNumIdx = g_pFragmentPeptides[ix->first].modNumIdx;
+         int iWhichPeptide = g_pFragmentPeptides[ix->first].iWhichPeptide;
+         char* modSeq;
+         double dCalcPepMass = g_pFragmentPeptides[ix->first].dPepMass;
 
          iEndPos = iLenMinus1 = iLenPeptide - 1;
 
@@ -1354,10 +2023,18 @@ void CometSearch::SearchFragmentIndex(size_t iWhichQuery,
 
          if (modNumIdx != -1)  // set modified peptide info
          {
-            modNum = MOD_NUMBERS.at(modNumIdx);
-            mods = modNum.modifications;
             modSeqIdx = PEPTIDE_MOD_SEQ_IDXS[iWhichPeptide];
-            modSeq = MOD_SEQS.at(modSeqIdx);
+            modSeq = g_szModSeqs + g_ullModSeqOffsets[modSeqIdx];
+
+            if (g_cModNumbers != NULL)
+               mods = g_cModNumbers + g_ullModNumberOffsets[modNumIdx];
+            else
+            {
+               // decode the modification number; fragment index entries only refer to valid ones
+               ModificationsPermuter::getModificationNumber(modSeq,
+                     (int)(g_ullModSeqOffsets[modSeqIdx + 1] - g_ullModSeqOffsets[modSeqIdx]) - 1,
+                     modNumIdx - MOD_SEQ_MOD_NUM_START[modSeqIdx], szMods);
+            }
 
             // now replicate piVarModSites[]
 
@@ -1384,16 +2061,16 @@ void CometSearch::SearchFragmentIndex(size_t iWhichQuery,
          memset(pbDuplFragment, 0, sizeof(bool) * iArraySize);
 
          // set terminal mods
-         if (g_vFragmentPeptides[ix->first].siNtermMod > -1)
+         if (g_pFragmentPeptides[ix->first].siNtermMod > -1)
          {
-            piVarModSites[iLenPeptide] = g_vFragmentPeptides[ix->first].siNtermMod + 1;
-            dBion += g_staticParams.variableModParameters.varModList[g_vFragmentPeptides[ix->first].siNtermMod].dVarModMass;
+            piVarModSites[iLenPeptide] = g_pFragmentPeptides[ix->first].siNtermMod + 1;
+            dBion += g_staticParams.variableModParameters.varModList[g_pFragmentPeptides[ix->first].siNtermMod].dVarModMass;
             iFoundVariableMod = 1;
          }
-         if (g_vFragmentPeptides[ix->first].siCtermMod > -1)
+         if (g_pFragmentPeptides[ix->first].siCtermMod > -1)
          {
-            piVarModSites[iLenPeptide + 1] = g_vFragmentPeptides[ix->first].siCtermMod + 1;
-            dYion += g_staticParams.variableModParameters.varModList[g_vFragmentPeptides[ix->first].siCtermMod].dVarModMass;
+            piVarModSites[iLenPeptide + 1] = g_pFragmentPeptides[ix->first].siCtermMod + 1;
+            dYion += g_staticParams.variableModParameters.varModList[g_pFragmentPeptides[ix->first].siCtermMod].dVarModMass;
             iFoundVariableMod = 1;
          }
 
@@ -1612,15 +2289,13 @@ void CometSearch::SearchFragmentIndex(size_t iWhichQuery,
 
          dbe.strName = "";
          dbe.strSeq = szPeptide;
-         // this lProteinFilePosition is actually the entry in g_pvProteinsList that contains the list of proteins for that peptide
-         dbe.lProteinFilePosition = g_vRawPeptides.at(g_vFragmentPeptides[ix->first].iWhichPeptide).lIndexProteinFilePosition;
+         // this lProteinFilePosition is actually the peptide whose protein list (g_ullProteinListOffsets) to use
+         dbe.lProteinFilePosition = g_pFragmentPeptides[ix->first].iWhichPeptide;
 
          XcorrScoreI(szPeptide, iStartPos, iEndPos, iFoundVariableMod, dCalcPepMass,
                false, iWhichQuery, iLenPeptide, piVarModSites, &dbe, uiBinnedIonMasses, uiBinnedPrecursorNL);
       }
    }
-
-   delete[] pbDuplFragment;
 }
 
 
@@ -1683,6 +2358,15 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
    if (g_staticParams.options.bClipNtermAA) // skip the N-term residue of every peptide
       iStartPos = 1;
 
+   // Slice of a long protein searched by this job; see AddSearchJobEntry()
+   if (!iNtermPeptideOnly && iStartPos < _iSearchStartPos)
+   {
+      iStartPos = _iSearchStartPos;
+
+      if (iStartPos >= iLenProtein)
+         return true;
+   }
+
    // Quick clip n-term & PEFF variant check. Start summing amino acid mass at
    // the start variant position and work backwards.  If the mass is larger than
    // the max mass or the peptide length is longer than the max length before we
@@ -1741,7 +2425,7 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
       dCalcPepMass += g_staticParams.staticModifications.dAddCterminusProtein;
 
    // Search through entire protein.
-   while (iStartPos < iLenProtein)
+   while (iStartPos < iLenProtein && iStartPos < _iSearchEndPos)
    {
       // Check to see if peptide is within global min/mass range for all queries.
       iLenPeptide = iEndPos-iStartPos+1;
@@ -1759,9 +2443,7 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
                 && CheckEnzymeTermini(szProteinSeq, iStartPos, iEndPos)
                 && dCalcPepMass < g_massRange.dMaxMass)
             {
-               Threading::LockMutex(g_pvQueryMutex);
-
-               // add to DBIndex vector
+               // add to this thread's DBIndex vector; no other thread uses it
                DBIndex sEntry;
                sEntry.dPepMass = dCalcPepMass;  //MH+ mass
 
@@ -1785,10 +2467,12 @@ bool CometSearch::SearchForPeptides(struct sDBEntry dbe,
                   sEntry.lIndexProteinFilePosition = _proteinInfo.lProteinFilePosition;
                   memset(sEntry.pcVarModSites, 0, sizeof(char) * (iLenPeptide + 2.0));
 
-                  g_pvDBIndex.push_back(sEntry);
-               }
+                  _pvDBIndex->push_back(sEntry);
 
-               Threading::UnlockMutex(g_pvQueryMutex);
+                  // over this thread's share of peptide_index_memory
+                  if (_tMaxIndexPeptides > 0 && _pvDBIndex->size() >= _tMaxIndexPeptides)
+                     CometFragmentIndex::WriteIndexPeptideRun(*_pvDBIndex);
+               }
             }
          }
          else if (!g_staticParams.variableModParameters.iRequireVarMod)
@@ -3211,46 +3895,27 @@ int CometSearch::BinarySearchMass(int start,
 }
 
 
-int CometSearch::BinarySearchIndexMass(int iWhichThread,
-                                       int iPrecursorBin,
-                                       int start,
-                                       int end,
-                                       double dQueryMass,
-                                       unsigned int *uiFragmentMass)
+// Return the first position in the sorted pfPepMass keys that is >= fQueryMass,
+// or tNumEntries if there is none.  Branch-free so the loop compiles to
+// conditional moves over the contiguous keys.
+size_t CometSearch::LowerBoundIndexMass(const float *pfPepMass,
+                                        size_t tNumEntries,
+                                        float fQueryMass)
 {
-   // dQueryMass is the lower bound tolerance mass of input spectrum.
- 
-   // Termination condition: start index greater than end index.
-   if (start >= end)
-   {
-      return start;
-   }
+   if (tNumEntries == 0)
+      return 0;
 
-   // Find the middle element of the vector and use that for splitting
-   // the array into two pieces.
-   unsigned middle = start + ((end - start) / 2);
-
-   double dArrayMass = g_vFragmentPeptides[g_iFragmentIndex[iWhichThread][iPrecursorBin][*uiFragmentMass][middle]].dPepMass;
+   const float *pfBase = pfPepMass;
+   size_t tLen = tNumEntries;
 
-   if (dArrayMass > dQueryMass)
-   {
-      return BinarySearchIndexMass(iWhichThread, iPrecursorBin, start, middle - 1, dQueryMass, uiFragmentMass);
-   }
-   else if (dArrayMass < dQueryMass)
-   {
-      return BinarySearchIndexMass(iWhichThread, iPrecursorBin, middle + 1, end, dQueryMass, uiFragmentMass);
-   }
-   else // this means (dArrayMass >= dQueryMass && dArrayMass <= dQueryMass)
+   while (tLen > 1)
    {
-      // always walk backwards now until ArrayMass is < dQueryMass
-      // as there may be multiple entries in the mass vector with the same ArrayMass so
-      // need to start at the first one (or the entry before the first one)
-      while (middle > 0 && g_vFragmentPeptides[g_iFragmentIndex[iWhichThread][iPrecursorBin][*uiFragmentMass][middle]].dPepMass >= dQueryMass)
-      {
-         middle--;
-      }
-      return middle;
+      size_t tHalf = tLen / 2;
+      pfBase = (pfBase[tHalf] < fQueryMass) ? pfBase + tHalf : pfBase;
+      tLen -= tHalf;
    }
+
+   return (size_t)(pfBase - pfPepMass) + (*pfBase < fQueryMass);
 }
 
 
@@ -19,43 +19,60 @@
 #include "Common.h"
 #include "CometDataInternal.h"
 #include <functional>
+#include <climits>
 
-struct SearchThreadData
+struct MappedFileStruct;
+
+// Database entry to search.  Also kept in memory by the first spectrum batch's
+// RunSearch so that later batches search the entries again without reading the database.
+struct DatabaseEntryStruct
 {
    sDBEntry dbEntry;
-   bool *pbSearchMemoryPool;
-   ThreadPool *tp;
-  
-   SearchThreadData()
-   {
-   }
+   const char *pSequence;     // sequence lines of a memory mapped database entry; NULL if dbEntry.strSeq is set
+   size_t tSequenceLen;
+   size_t tNumResidues;       // sequence length without line breaks; packs and splits search jobs
+   int iStartPos;             // search peptides starting at residues iStartPos to iEndPos-1;
+   int iEndPos;               // a long protein is split across search jobs this way
 
-   SearchThreadData(sDBEntry &dbEntry_in)
+   DatabaseEntryStruct()
    {
-      dbEntry.strName = dbEntry_in.strName;
-      dbEntry.strSeq = dbEntry_in.strSeq;
-      dbEntry.lProteinFilePosition = dbEntry_in.lProteinFilePosition;
-      dbEntry.vectorPeffMod = dbEntry_in.vectorPeffMod;
-      dbEntry.vectorPeffVariantSimple = dbEntry_in.vectorPeffVariantSimple;
-      dbEntry.vectorPeffVariantComplex = dbEntry_in.vectorPeffVariantComplex;
+      pSequence = NULL;
+      tSequenceLen = 0;
+      tNumResidues = 0;
+      iStartPos = 0;
+      iEndPos = INT_MAX;
    }
+};
 
-   ~SearchThreadData()
-   {
-      // Mark that the memory is no longer in use.
-      // DO NOT FREE MEMORY HERE. Just release pointer.
-     //      Threading::LockMutex(g_searchMemoryPoolMutex);
+// A search job: database entries packed up to SEARCH_JOB_RESIDUES residues.
+struct SearchThreadData
+{
+   vector<DatabaseEntryStruct> vEntries;
+   size_t tNumResidues;
 
-      if (pbSearchMemoryPool!=NULL)
-      {
-         *pbSearchMemoryPool=false;
-         pbSearchMemoryPool=NULL;
-      }
+   SearchThreadData()
+   {
+      tNumResidues = 0;
+   }
+};
 
-      dbEntry.vectorPeffMod.clear();
-      dbEntry.vectorPeffVariantSimple.clear();
+// Per search memory pool slot counter of matched fragment ions for each
+// g_vFragmentPeptides entry.  Each entry packs the query generation that last
+// touched it in the upper 16 bits and the matched ion count in the lower 16 bits
+// so the array never has to be cleared between queries; vuiTouched lists the
+// entries touched by the current query.
+struct FragmentIndexAccumulator
+{
+   unsigned int *puiMatchCount;
+   vector<unsigned int> vuiTouched;
+   size_t tSize;
+   unsigned int uiGeneration;
 
-      //Threading::UnlockMutex(g_searchMemoryPoolMutex);
+   FragmentIndexAccumulator()
+   {
+      puiMatchCount = NULL;
+      tSize = 0;
+      uiGeneration = 0;
    }
 };
 
@@ -68,12 +85,32 @@ public:
    // Manages memory in the search memory pool
    static bool AllocateMemory(int maxNumThreads);
    static bool DeallocateMemory(int maxNumThreads);
+   static void CollectIndexPeptides(int maxNumThreads,
+                                    bool bWriteRuns);
    static bool RunSearch(int iPercentStart,
                          int iPercentEnd,
                          ThreadPool *tp);
    static bool RunSearch(ThreadPool *tp);    // for DoSingleSpectrumSearch() to call IndexSearch()
    static void SearchThreadProc(SearchThreadData *pSearchThreadData,
                                 ThreadPool *tp);
+   static void AddSearchJobEntry(SearchThreadData **ppSearchThreadData,
+                                 DatabaseEntryStruct &sEntry,
+                                 ThreadPool *tp);
+   static void SubmitSearchJob(SearchThreadData **ppSearchThreadData,
+                               ThreadPool *tp);
+   static bool SearchMappedDatabase(const char *pDatabase,
+                                    size_t tDatabaseSize,
+                                    int iPercentStart,
+                                    int iPercentEnd,
+                                    bool bKeepEntries,
+                                    ThreadPool *tp);
+   static bool SearchKeptDatabaseEntries(int iPercentStart,
+                                         int iPercentEnd,
+                                         ThreadPool *tp);
+   static void ReleaseDatabaseEntries(void);
+   static unsigned long int LoadSequence(const char *pSequence,
+                                         size_t tSequenceLen,
+                                         string& strSeq);
    bool DoSearch(sDBEntry dbe,
                  bool *pbDuplFragment);
 
@@ -92,12 +129,9 @@ private:
    int BinarySearchMass(int start,
                         int end,
                         double dCalcPepMass);
-   static int BinarySearchIndexMass(int iWhichThread,
-                                    int iPrecursorBin,
-                                    int start,
-                                    int end,
-                                    double dQueryMass,
-                                    unsigned int *uiFragmentMass);
+   static size_t LowerBoundIndexMass(const float *pfPepMass,
+                                     size_t tNumEntries,
+                                     float fQueryMass);
    void SubtractVarMods(int *piVarModCounts,
                         int cResidue,
                         int iResiduePosition);
@@ -216,8 +250,13 @@ private:
                        double dCalcPepMass,
                        int iLenPeptide,
                        struct sDBEntry *dbe);
-   static void SearchFragmentIndex(size_t iWhichQuery,
+   static void SearchFragmentIndex(size_t iFirstQuery,
+                                   size_t iLastQuery,
                                    ThreadPool *tp);
+   static void XcorrScoreFragmentIndexPeptides(size_t iWhichQuery,
+                                               vector<std::pair<comet_fileoffset_t, int>>& vPeptides,
+                                               int iWhichThread);
+   static int WhichSearchWorkspace(ThreadPool *tp);
    bool SearchForPeptides(struct sDBEntry dbe,
                           char *szProteinSeq,
                           int iNtermPeptideOnly,  // used in clipped methionine sequence
@@ -309,8 +348,20 @@ private:
    unsigned int       _uiBinnedPrecursorNL[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE];
    unsigned int       _uiBinnedPrecursorNLDecoy[MAX_PRECURSOR_NL_SIZE][MAX_PRECURSOR_CHARGE];
 
-   static bool *_pbSearchMemoryPool;    // Pool of memory to be shared by search threads
+   static CometSearch *_pSearchWorkspace;  // One per search thread; see WhichSearchWorkspace()
    static bool **_ppbDuplFragmentArr;   // Number of arrays equals number of threads
+   static FragmentIndexAccumulator *_pFragIndexAccumulator;  // One per search thread
+   static vector<DBIndex> *_pvIndexPeptides;    // One per search thread; peptides found when creating an index
+   static size_t _tMaxIndexPeptides;            // # of peptides a slot holds before writing a sorted run file; 0=no limit
+   static vector<DatabaseEntryStruct> _vDatabaseEntries;  // database entries kept for later spectrum batches
+   static bool _bDatabaseEntriesKept;           // set once _vDatabaseEntries holds every database entry
+   static unsigned long int _uliKeptTotAACount; // uliTotAACount of the kept entries
+   static MappedFileStruct _sDatabaseMap;       // memory mapped fasta database
+
+   vector<DBIndex> *_pvDBIndex;         // this search's _pvIndexPeptides slot
+   unsigned long int _uliNumResidues;   // residues of the memory mapped sequences this workspace loaded
+   int _iSearchStartPos;                // peptide start positions searched, as in DatabaseEntryStruct
+   int _iSearchEndPos;
 };
 
 #endif // _COMETSEARCH_H_
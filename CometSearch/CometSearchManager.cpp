@@ -43,19 +43,35 @@ MassRange                     g_massRange;
 map<long long, IndexProteinStruct>    g_pvProteinNames;  // for db index
 Mutex                         g_pvQueryMutex;
 Mutex                         g_preprocessMemoryPoolMutex;
-Mutex                         g_searchMemoryPoolMutex;
 CometStatus                   g_cometStatus;
 string                        g_sCometVersion;
 
-vector<vector<comet_fileoffset_t>> g_pvProteinsList;
-unsigned int** g_iFragmentIndex[FRAGINDEX_MAX_THREADS][FRAGINDEX_PRECURSORBINS];        // stores fragment index; [thread][pepmass][BIN(mass)][which g_vFragmentPeptides entries]
-unsigned int* g_iCountFragmentIndex[FRAGINDEX_MAX_THREADS][FRAGINDEX_PRECURSORBINS];      // stores counts of fragment index; [thread][pepmass][BIN(mass)]
+unsigned int* g_uiFragmentIndex = NULL;                     // stores fragment index entries; which g_vFragmentPeptides entries
+unsigned long long* g_ullFragmentIndexOffsets = NULL;       // [pepmass bin][BIN(mass)] offsets into g_uiFragmentIndex
+float* g_fFragmentIndexPepMass = NULL;                      // peptide mass keys parallel to g_uiFragmentIndex
+unsigned long long* g_ullFragmentIndexBlockOffsets = NULL;  // [pepmass bin][BIN(mass)] offsets into compressed blocks
+unsigned int* g_uiFragmentIndexBlockFirst = NULL;           // first entry of each compressed block
+unsigned long long* g_ullFragmentIndexBlockPos = NULL;      // position of each compressed block in g_ucFragmentIndexPacked
+unsigned char* g_ucFragmentIndexPacked = NULL;              // bit-packed deltas of compressed blocks
 bool* g_bIndexPrecursors;                                   // array for BIN(precursors), set to true if precursor present in file
 vector<struct FragmentPeptidesStruct> g_vFragmentPeptides;  // each peptide is represented here iWhichPeptide, which mod if any, calculated mass
-vector<PlainPeptideIndex> g_vRawPeptides;                   // list of unmodified peptides and their proteins as file pointers
+FragmentPeptidesStruct* g_pFragmentPeptides = NULL;         // peptides referenced by the fragment index; g_vFragmentPeptides or mapped .idx.frag
+size_t g_tNumFragmentPeptides = 0;
+size_t g_tNumRawPeptides = 0;                               // # of unmodified peptides in the .idx
+unsigned long long* g_ullRawPeptideOffsets = NULL;          // index of each peptide's first residue in g_ucRawPeptideResidues
+unsigned char* g_ucRawPeptideResidues = NULL;               // 5 bit packed unmodified peptide sequences
+unsigned long long* g_ullProteinListOffsets = NULL;         // offsets into g_lProteinListFilePositions of each peptide
+comet_fileoffset_t* g_lProteinListFilePositions = NULL;     // database file positions of the proteins of each peptide
+size_t g_tNumProteinNames = 0;
+comet_fileoffset_t* g_lProteinNameFilePositions = NULL;     // database file positions of the proteins, ascending
+unsigned long long* g_ullProteinNameOffsets = NULL;         // offsets into g_szProteinNames of each protein accession
+char* g_szProteinNames = NULL;                              // NUL terminated protein accessions
+unsigned long long* g_ullModSeqOffsets = NULL;              // offsets into g_szModSeqs of each modifiable sequence
+char* g_szModSeqs = NULL;                                   // NUL terminated modifiable sequences
+unsigned long long* g_ullModNumberOffsets = NULL;           // offsets into g_cModNumbers of each modification number
+char* g_cModNumbers = NULL;                                 // modification of each residue of a modifiable sequence; NULL if decoded on demand
 bool g_bPlainPeptideIndexRead = false;
 bool g_bFragmentIndexRead = false;
-FILE* fpfasta;
 
 
 /******************************************************************************
@@ -518,6 +534,64 @@ static bool ValidateSequenceDatabaseFile()
    return true;
 }
 
+// settings of a search of a .idx database
+static bool InitializeIndexDb()
+{
+   // if searching fragment index database, limit load of query spectra as no
+   // need to load all spectra into memory since querying spectra sequentially
+   if (g_staticParams.options.iSpectrumBatchSize > FRAGINDEX_MAX_BATCHSIZE || g_staticParams.options.iSpectrumBatchSize == 0)
+      g_staticParams.options.iSpectrumBatchSize = FRAGINDEX_MAX_BATCHSIZE;
+
+   g_bIndexPrecursors = (bool*) malloc(BIN(g_staticParams.options.dPeptideMassHigh));
+   if (g_bIndexPrecursors == NULL)
+   {
+      printf("\n Error cannot allocate memory for g_bIndexPrecursors(%d)\n", BIN(g_staticParams.options.dPeptideMassHigh));
+      return false;
+   }
+   for (int x = 0; x < BIN(g_staticParams.options.dPeptideMassHigh); ++x)
+   {
+      if (g_pvInputFiles.size() == 0)
+         g_bIndexPrecursors[x] = true;  // if RTS search, no input file to read precursors from so all precursors are valid
+      else
+         g_bIndexPrecursors[x] = false; // set all precursors as invalid; valid precursors will be determined in ReadPrecursors
+   }
+
+   return true;
+}
+
+// With peptide_index_cache_dir set, a fasta database is searched through the .idx file
+// in that directory for the current parameters.  The .idx file is created first if it
+// is missing or was created with other parameters or from an older fasta database.
+static bool UseIndexCache(ThreadPool *tp)
+{
+   string strIndexFile = CometFragmentIndex::IndexCacheFileName();
+   string strOut;
+
+   if (CometFragmentIndex::IsIndexCacheCurrent(strIndexFile))
+   {
+      strOut = " Using cached peptide index " + strIndexFile + "\n\n";
+      logout(strOut.c_str());
+      fflush(stdout);
+   }
+   else
+   {
+      // created just as with -i; the search then reads it like any .idx database
+      g_staticParams.options.bCreateIndex = 1;
+      bool bSucceeded = CometFragmentIndex::WritePlainPeptideIndex(tp);
+      g_staticParams.options.bCreateIndex = 0;
+
+      if (!bSucceeded)
+         return false;
+
+      CometSearch::DeallocateMemory(g_staticParams.options.iNumThreads);
+   }
+
+   strcpy(g_staticParams.databaseInfo.szDatabase, strIndexFile.c_str());
+   g_staticParams.bIndexDb = 1;
+
+   return InitializeIndexDb();
+}
+
 static bool ValidateScanRange()
 {
    if (g_staticParams.options.scanRange.iEnd < g_staticParams.options.scanRange.iStart && g_staticParams.options.scanRange.iEnd != 0)
@@ -568,9 +642,6 @@ CometSearchManager::CometSearchManager() :
    // Initialize the mutex we'll use to protect the preprocess memory pool
    Threading::CreateMutex(&g_preprocessMemoryPoolMutex);
 
-   // Initialize the mutex we'll use to protect the search memory pool
-   Threading::CreateMutex(&g_searchMemoryPoolMutex);
-
    // Initialize the Comet version
    SetParam("# comet_version", comet_version, comet_version);
    _tp = new ThreadPool();
@@ -584,9 +655,6 @@ CometSearchManager::~CometSearchManager()
    // Destroy the mutex we used to protect the preprocess memory pool
    Threading::DestroyMutex(g_preprocessMemoryPoolMutex);
 
-   // Destroy the mutex we used to protect the search memory pool
-   Threading::DestroyMutex(g_searchMemoryPoolMutex);
-
    //std::vector calls destructor of every element it contains when clear() is called
    g_pvInputFiles.clear();
 
@@ -622,6 +690,9 @@ bool CometSearchManager::InitializeStaticParams()
          strcpy(g_staticParams.szTxtFileExt, strData.c_str());
    } 
 
+   if (GetParamValue("peptide_index_cache_dir", strData))
+      strcpy(g_staticParams.szIndexCacheDir, strData.c_str());
+
    if (GetParamValue("peff_obo", strData))
       strcpy(g_staticParams.peffInfo.szPeffOBO, strData.c_str());
 
@@ -1074,6 +1145,25 @@ bool CometSearchManager::InitializeStaticParams()
    GetParamValue("fragindex_num_spectrumpeaks", g_staticParams.options.iFragIndexNumSpectrumPeaks);
    GetParamValue("fragindex_max_peptidesscored", g_staticParams.options.iFragIndexMaxNumScored);
    GetParamValue("fragindex_min_matchedions", g_staticParams.options.iFragIndexMinMatchedIons);
+   if (GetParamValue("fragindex_num_precursorbins", iIntData))
+   {
+      if (iIntData >= 1 && iIntData <= FRAGINDEX_MAX_PRECURSORBINS)
+         g_staticParams.options.iFragIndexNumPrecursorBins = iIntData;
+   }
+   GetParamValue("fragindex_compress", g_staticParams.options.bFragIndexCompress);
+   GetParamValue("fragindex_prune_precursors", g_staticParams.options.bFragIndexPrunePrecursors);
+   if (GetParamValue("fragindex_num_partitions", iIntData))
+   {
+      if (iIntData >= 1)
+         g_staticParams.options.iFragIndexNumPartitions = iIntData;
+   }
+   GetParamValue("fragindex_share", g_staticParams.options.bFragIndexShare);
+   if (GetParamValue("peptide_index_memory", iIntData))
+   {
+      if (iIntData >= 0)
+         g_staticParams.options.iPeptideIndexMemory = iIntData;
+   }
+   GetParamValue("peptide_index_decode_mods", g_staticParams.options.bPeptideIndexDecodeMods);
 
    GetParamValue("num_enzyme_termini", g_staticParams.options.iEnzymeTermini);
    if ((g_staticParams.options.iEnzymeTermini != 1)
@@ -1574,15 +1664,8 @@ bool CometSearchManager::InitializeStaticParams()
 
    // At this point, check extension to set whether index database or not
    if (!strcmp(g_staticParams.databaseInfo.szDatabase + strlen(g_staticParams.databaseInfo.szDatabase) - 4, ".idx"))
-   {
       g_staticParams.bIndexDb = 1;
 
-      // if searching fragment index database, limit load of query spectra as no
-      // need to load all spectra into memory since querying spectra sequentially
-      if (g_staticParams.options.iSpectrumBatchSize > FRAGINDEX_MAX_BATCHSIZE || g_staticParams.options.iSpectrumBatchSize == 0)
-         g_staticParams.options.iSpectrumBatchSize = FRAGINDEX_MAX_BATCHSIZE;
-   }
-
    if (g_staticParams.options.bCreateIndex && g_staticParams.bIndexDb)
    {
       char szErrorMsg[SIZE_ERROR];
@@ -1593,22 +1676,8 @@ bool CometSearchManager::InitializeStaticParams()
       return false;
    }
 
-   if (g_staticParams.bIndexDb)
-   {
-      g_bIndexPrecursors = (bool*) malloc(BIN(g_staticParams.options.dPeptideMassHigh));
-      if (g_bIndexPrecursors == NULL)
-      {
-         printf("\n Error cannot allocate memory for g_bIndexPrecursors(%d)\n", BIN(g_staticParams.options.dPeptideMassHigh));
-         return false;
-      }
-      for (int x = 0; x < BIN(g_staticParams.options.dPeptideMassHigh); ++x)
-      {
-         if (g_pvInputFiles.size() == 0)
-            g_bIndexPrecursors[x] = true;  // if RTS search, no input file to read precursors from so all precursors are valid
-         else
-            g_bIndexPrecursors[x] = false; // set all precursors as invalid; valid precursors will be determined in ReadPrecursors
-      }
-   }
+   if (g_staticParams.bIndexDb && !InitializeIndexDb())
+      return false;
 
    return true;
 }
@@ -1961,6 +2030,12 @@ bool CometSearchManager::DoSearch()
    g_massRange.dMinMass = g_staticParams.options.dPeptideMassLow;
    g_massRange.dMaxMass = g_staticParams.options.dPeptideMassHigh;
 
+   if (!g_staticParams.options.bCreateIndex && !g_staticParams.bIndexDb && g_staticParams.szIndexCacheDir[0] != '\0')
+   {
+      if (!UseIndexCache(tp))
+         return false;
+   }
+
    if (g_staticParams.options.bCreateIndex) //index
    {
       // write out .idx file containing unmodified peptides and protein refs;
@@ -1971,6 +2046,36 @@ bool CometSearchManager::DoSearch()
 
       CometSearch::DeallocateMemory(g_staticParams.options.iNumThreads);
 
+      // Build the full fragment index (all precursors valid as there are no input
+      // files to prune against) and persist it next to the .idx so that searches
+      // can memory map it instead of regenerating it.
+      g_bIndexPrecursors = (bool*) malloc(BIN(g_staticParams.options.dPeptideMassHigh));
+      if (g_bIndexPrecursors == NULL)
+      {
+         printf("\n Error cannot allocate memory for g_bIndexPrecursors(%d)\n", BIN(g_staticParams.options.dPeptideMassHigh));
+         return false;
+      }
+      for (int x = 0; x < BIN(g_staticParams.options.dPeptideMassHigh); ++x)
+         g_bIndexPrecursors[x] = true;
+
+      g_bPlainPeptideIndexRead = true;  // WritePlainPeptideIndex maps the .idx it writes
+
+      strOut = " Creating fragment index file:\n";
+      logout(strOut.c_str());
+      fflush(stdout);
+
+      // a partitioned build writes the file as it goes so it never holds the whole index
+      if (g_staticParams.options.iFragIndexNumPartitions > 1)
+         bSucceeded = CometFragmentIndex::WritePartitionedFragmentIndex(tp);
+      else
+      {
+         CometFragmentIndex::CreateFragmentIndex(tp);
+         bSucceeded = CometFragmentIndex::WriteFragmentIndex();
+      }
+
+      CometFragmentIndex::DeallocateFragmentIndex();
+      free(g_bIndexPrecursors);
+
       return bSucceeded;
    }
 
@@ -1979,7 +2084,8 @@ bool CometSearchManager::DoSearch()
 
    bool bBlankSearchFile = false;
 
-   tp->fillPool( g_staticParams.options.iNumThreads < 0 ? 0 : g_staticParams.options.iNumThreads-1);  
+   if (tp->threads_.empty())  // else filled creating the .idx file for peptide_index_cache_dir
+      tp->fillPool( g_staticParams.options.iNumThreads < 0 ? 0 : g_staticParams.options.iNumThreads-1);  
 
    // read precursors before creating fragment index
    auto tTime1 = chrono::steady_clock::now();
@@ -2418,11 +2524,10 @@ bool CometSearchManager::DoSearch()
          // We need to reset some of the static variables in-between input files
          CometPreprocess::Reset();
 
-         FILE *fpdb;  // need FASTA file again to grab headers for output (currently just store file positions)
+         FILE *fpdb = NULL;  // need FASTA file again to grab headers for output (currently just store file positions)
          string sTmpDB = g_staticParams.databaseInfo.szDatabase;
-         if (g_staticParams.bIndexDb)
-            sTmpDB = sTmpDB.erase(sTmpDB.size()-4); // need plain fasta if indexdb input
-         if ((fpdb=fopen(sTmpDB.c_str(), "r")) == NULL)
+         // .idx searches report the protein names stored in the .idx file
+         if (!g_staticParams.bIndexDb && (fpdb=fopen(sTmpDB.c_str(), "r")) == NULL)
          {
             char szErrorMsg[SIZE_ERROR];
             sprintf(szErrorMsg, " Error (3) - cannot read database file \"%s\".\n", sTmpDB.c_str());
@@ -2816,7 +2921,8 @@ cleanup_results:
             }
          }
 
-         fclose(fpdb);
+         if (fpdb != NULL)
+            fclose(fpdb);
       }
 
       // Clean up the input files vector
@@ -2918,27 +3024,9 @@ cleanup_results:
 
    if (g_staticParams.bIndexDb)
    {
-      int iNumIndexingThreads = g_staticParams.options.iNumThreads;
-      if (iNumIndexingThreads > FRAGINDEX_MAX_THREADS)
-         iNumIndexingThreads = FRAGINDEX_MAX_THREADS;
-
       free(g_bIndexPrecursors);       // allocated in InitializeStaticParams
 
-      for (int iWhichThread = 0; iWhichThread < iNumIndexingThreads; ++iWhichThread)
-      {
-         for (int iPrecursorBin = 0; iPrecursorBin < FRAGINDEX_PRECURSORBINS; ++iPrecursorBin)
-         {
-            for (unsigned int iMass = 0; iMass < g_massRange.g_uiMaxFragmentArrayIndex; ++iMass)
-            {
-               if (g_iFragmentIndex[iWhichThread][iPrecursorBin][iMass] != NULL)
-               {
-                  delete [] g_iFragmentIndex[iWhichThread][iPrecursorBin][iMass];
-               }
-            }
-            delete[] g_iFragmentIndex[iWhichThread][iPrecursorBin];
-            delete[] g_iCountFragmentIndex[iWhichThread][iPrecursorBin];
-         }
-      }
+      CometFragmentIndex::DeallocateFragmentIndex();
 
       printf(" - done.\n\n");
    }
@@ -2992,19 +3080,7 @@ bool CometSearchManager::InitializeSingleSpectrumSearch()
       sqSearch.CreateFragmentIndex(tp);
    }
 
-   // open FASTA for retrieving protein names
-   string sTmpDB = g_staticParams.databaseInfo.szDatabase;
-   if (!strcmp(g_staticParams.databaseInfo.szDatabase + strlen(g_staticParams.databaseInfo.szDatabase) - 4, ".idx"))
-      sTmpDB = sTmpDB.erase(sTmpDB.size() - 4); // need plain fasta if indexdb input
-   if ((fpfasta = fopen(sTmpDB.c_str(), "r")) == NULL)
-   {
-      char szErrorMsg[SIZE_ERROR];
-      sprintf(szErrorMsg, " Error (3) - cannot read database file \"%s\".\n", sTmpDB.c_str());
-      string strErrorMsg(szErrorMsg);
-      g_cometStatus.SetStatus(CometResult_Failed, strErrorMsg);
-      logerr(szErrorMsg);
-      return false;
-   }
+   // protein names come from the .idx file so the FASTA is not needed
 
    singleSearchInitializationComplete = true;
 
@@ -3022,8 +3098,6 @@ void CometSearchManager::FinalizeSingleSpectrumSearch()
       // Deallocate search memory
       CometSearch::DeallocateMemory(singleSearchThreadCount);
 
-      fclose(fpfasta);
-
       singleSearchInitializationComplete = false;
    }
 }
@@ -3177,11 +3251,8 @@ bool CometSearchManager::DoSingleSpectrumSearch(int iPrecursorCharge,
          strReturnPeptide += ss.str();
       }
 
-      // retrieve protein name from fasta; need to fopen just once
-      char szProtein[512];
-      comet_fseek(fpfasta, g_pvProteinsList.at(pOutput[0].lProteinFilePosition).at(0), SEEK_SET);
-      fscanf(fpfasta, "%511s", szProtein);  // WIDTH_REFERENCE-1
-      szProtein[511] = '\0';
+      // protein name from the names stored in the .idx file
+      const char *szProtein = CometMassSpecUtils::GetIndexProteinName(g_lProteinListFilePositions[g_ullProteinListOffsets[pOutput[0].lProteinFilePosition]]);
       strReturnPeptide += "." + std::string(1, pOutput[0].cNextAA);
 
       strReturnProtein = szProtein;            //protein
@@ -3537,11 +3608,8 @@ bool CometSearchManager::DoSingleSpectrumSearchMultiResults(const int topN,
                 eachStrReturnPeptide += ss.str();
             }
 
-            // retrieve protein name from fasta; need to fopen just once
-            char szProtein[512];
-            comet_fseek(fpfasta, g_pvProteinsList.at(pOutput[idx].lProteinFilePosition).at(0), SEEK_SET);
-            fscanf(fpfasta, "%511s", szProtein);  // WIDTH_REFERENCE-1
-            szProtein[511] = '\0';
+            // protein name from the names stored in the .idx file
+            const char *szProtein = CometMassSpecUtils::GetIndexProteinName(g_lProteinListFilePositions[g_ullProteinListOffsets[pOutput[idx].lProteinFilePosition]]);
             eachStrReturnPeptide += "." + std::string(1, pOutput[idx].cNextAA);
 
             eachStrReturnProtein = szProtein;            //protein
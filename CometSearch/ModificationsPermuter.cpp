@@ -22,6 +22,7 @@
 #include <bitset>
 #include <chrono>
 #include <unordered_set>
+#include <climits>
 #include "CombinatoricsUtils.h"
 #include "ModificationsPermuter.h"
 #include "CometFragmentIndex.h"
@@ -46,6 +47,12 @@ int MAX_K_VAL = 10;
 
 int IGNORED_SEQ_CNT = 0; // Sequences that were ignored because they would generate more than FRAGINDEX_MAX_COMBINATIONS combinations.
 
+// Set by initModificationNumbers
+vector<string> MOD_NUMBER_MODS;                // ALL_MODS the modification numbers refer to
+int MOD_NUMBER_MAX_MODS_PER_MOD = 0;
+unsigned int MOD_NUMBER_RESIDUE_MODS[128];     // bit m is set if ALL_MODS[m] applies to the residue
+vector<vector<vector<int>>> COMBINATION_SETS;  // getCombinationSets(modCount) for each modCount
+
 long TIME_IN_COMBINE = 0;
 long TIME_GEN_MODS = 0;
 
@@ -267,7 +274,9 @@ string ModificationsPermuter::getModifiableAas(std::string peptide,
 }
 
 
-vector<string> ModificationsPermuter::getModifiableSequences(vector<PlainPeptideIndex>& vRawPeptides,
+vector<string> ModificationsPermuter::getModifiableSequences(const unsigned long long *pullPeptideOffsets,
+                                                             const char *szPeptideResidues,
+                                                             size_t tNumPeptides,
                                                              int* PEPTIDE_MOD_SEQ_IDXS,
                                                              vector<string>& ALL_MODS)
 {
@@ -276,9 +285,10 @@ vector<string> ModificationsPermuter::getModifiableSequences(vector<PlainPeptide
    int pepIdx = 0;
    int modSeqIdx = 0;
    int modifiablePeptides = 0;
-   for (auto it = vRawPeptides.begin(); it != vRawPeptides.end(); ++it)
+   for (size_t i = 0; i < tNumPeptides; ++i)
    {
-      string modifiableAas = getModifiableAas((*it).sPeptide, ALL_MODS);
+      string modifiableAas = getModifiableAas(string(szPeptideResidues + pullPeptideOffsets[i],
+            (size_t)(pullPeptideOffsets[i + 1] - pullPeptideOffsets[i])), ALL_MODS);
 
       if (!modifiableAas.empty())
       {
@@ -317,8 +327,8 @@ vector<string> ModificationsPermuter::getModifiableSequences(vector<PlainPeptide
 
 // Iterate over the modSeq and set the bit to 1 if the amino acid at an index matches the given modChar
 // Example: CMHQQQMK -> 01000010 (for modChar = 'M')
-unsigned long long ModificationsPermuter::getModBitmask(string* modSeq,
-                                                        string sModChars)
+unsigned long long ModificationsPermuter::getModBitmask(const string* modSeq,
+                                                              string sModChars)
 {
    uint64_t bitMask = 0ULL;
    long len = (*modSeq).size();
@@ -376,364 +386,450 @@ vector<vector<int>> ModificationsPermuter::getCombinationSets(int modCount)
 // combinations:     3 +  1 +  3 +  3 +     9 +     3 +     9       = 31
 int ModificationsPermuter::getTotalCombinationCount(vector<int> combinationCounts, vector<vector<int>> combinationSets)
 {
-   int allCombos = 0;
+   long long allCombos = 0;
    for (vector<vector<int>>::iterator it = combinationSets.begin(); it != combinationSets.end(); ++it)
    {
-      int combos = 1;
+      long long combos = 1;
       vector<int> set = *it;
       for (unsigned int j = 0; j < set.size(); ++j)
       {
          int s = set.at(j);
          combos *= combinationCounts.at(s);
+         if (combos > INT_MAX)
+            combos = INT_MAX;
          if (ignorePeptidesWithTooManyMods() && combos > FRAGINDEX_MAX_COMBINATIONS)
          {
             return -1;
          }
       }
       allCombos += combos;
+      if (allCombos > INT_MAX)
+         allCombos = INT_MAX;  // more than can be numbered; only the first FRAGINDEX_MAX_COMBINATIONS are kept
    }
-   return ignorePeptidesWithTooManyMods() && allCombos > FRAGINDEX_MAX_COMBINATIONS ? -1 : allCombos; 
+   return ignorePeptidesWithTooManyMods() && allCombos > FRAGINDEX_MAX_COMBINATIONS ? -1 : (int)allCombos; 
 }
 
 
-bool ModificationsPermuter::combine(int* modNumbers,
-                                    unsigned long long* bitmasks,
-                                    int modNumCount,
-                                    int modStringLen)
+// Set the modifications the modification numbers refer to.  With peptide_index_decode_mods
+// the .idx file does not store the modification numbers; they are decoded on demand by
+// getModificationNumber, so this must be called with the same modifications and
+// max_mods_per_mod when the .idx file is created and whenever it is used.
+void ModificationsPermuter::initModificationNumbers(vector<string>& ALL_MODS,
+                                                    int max_mods_per_mod)
 {
-   const auto start = startTime();
+   MOD_NUMBER_MODS = ALL_MODS;
+   MOD_NUMBER_MAX_MODS_PER_MOD = max_mods_per_mod;
 
-   for (int j = 0; j < modNumCount; ++j)
+   memset(MOD_NUMBER_RESIDUE_MODS, 0, sizeof(MOD_NUMBER_RESIDUE_MODS));
+   for (int m = 0; m < (int)ALL_MODS.size(); ++m)
    {
-      for (int k = j+1; k < modNumCount; ++k)
+      for (char aa : ALL_MODS[m])
+         MOD_NUMBER_RESIDUE_MODS[aa & 127] |= 1U << m;
+   }
+
+   COMBINATION_SETS.clear();
+   for (int modCount = 0; modCount <= (int)ALL_MODS.size(); ++modCount)
+      COMBINATION_SETS.push_back(getCombinationSets(modCount));
+
+   CombinatoricsUtils::initBinomialCoefficients(MAX_PEPTIDE_LEN, MAX_K_VAL);
+}
+
+
+// Find the modifications of the modifiable sequence: for each one its index in ALL_MODS,
+// its bitmask (see getModBitmask) and its number of combinations.  modCount is set to
+// the number of modifications found or -1 if the sequence would have too many combinations.
+void ModificationsPermuter::getSequenceModifications(const char* modSeq,
+                                                     int modSeqLen,
+                                                     SequenceModifications* seqMods)
+{
+   const int MOD_CNT = (int)MOD_NUMBER_MODS.size();
+   unsigned long long bitmasks[VMODS];
+
+   seqMods->modCount = 0;
+   seqMods->bCombinations = false;
+
+   for (int m = 0; m < MOD_CNT; ++m)
+      bitmasks[m] = 0ULL;
+
+   for (int i = 0; i < modSeqLen; ++i)
+   {
+      unsigned int residueMods = MOD_NUMBER_RESIDUE_MODS[modSeq[i] & 127];
+      for (int m = 0; residueMods != 0; ++m, residueMods >>= 1)
       {
-         // cout << "1: "; printBits(bitmasks[j]);
-         // cout << "2: "; printBits(bitmasks[k]);
-         unsigned long long combined = bitmasks[j] & bitmasks[k];
-         // cout << "3: "; printBits(combined);
-         if (combined != 0)
-         {
-            // If any two modification combinations have the same bit set then this is not a valid combination.
-            // This can happen when more than one modification is defined on the same amino acid.
-            return false;
-         }
+         if (residueMods & 1)
+            bitmasks[m] |= 1ULL << (modSeqLen - i - 1);
       }
    }
 
-   char *mods = new char[modStringLen];
-   char modNum;
+   for (int m = 0; m < MOD_CNT; ++m)
+   {
+      if (bitmasks[m] == 0)
+         continue;
 
-   for (int i = 0; i < modStringLen; ++i)
-      mods[i] = -1;
+      std::bitset<64> x(bitmasks[m]);
+      int bitCount = (int)x.count();
 
-   for (int i = 0; i < modStringLen; ++i)
-   {
-      int idx = modStringLen - i - 1;
-      for (int j = 0; j < modNumCount; ++j)
+      if (ignorePeptidesWithTooManyMods() && bitCount > (int)MAX_BITCOUNT)
       {
-         unsigned long long btm = bitmasks[j];
-         modNum = modNumbers[j];
+         seqMods->modCount = -1;
+         return;
+      }
+
+      int combinationCount = CombinatoricsUtils::getCombinationCount(bitCount, MOD_NUMBER_MAX_MODS_PER_MOD); // nCk + nCk-1 +...+nC1
 
-         // extract the i-th bit in the bitmask
-         const unsigned long long b = (btm & 1ULL << i);
-         if (b > 0)
+      if (combinationCount > FRAGINDEX_MAX_COMBINATIONS)
+      {
+         if (ignorePeptidesWithTooManyMods())
          {
-            mods[idx] = modNum;
-            break; // We found the modification at this index. Go to the next index.
+            seqMods->modCount = -1;
+            return;
          }
+
+         combinationCount = FRAGINDEX_MAX_COMBINATIONS;  // keep only the first FRAGINDEX_MAX_COMBINATIONS
       }
+
+      seqMods->modIndices[seqMods->modCount] = m;
+      seqMods->modBitmasks[seqMods->modCount] = bitmasks[m];
+      seqMods->combinationCounts[seqMods->modCount] = combinationCount;
+      seqMods->modCount++;
    }
+}
+
 
-   ModificationNumber modification;
-   MOD_NUM++;  //FIX:  confirm this is not needed either
-   modification.modifications = mods;
-   modification.modStringLen = modStringLen;
+// Set the bitmask of every combination of each modification found by
+// getSequenceModifications so decoding many modification numbers of the sequence does
+// not compute them over and over.
+void ModificationsPermuter::getSequenceCombinations(SequenceModifications* seqMods)
+{
+   for (int s = 0; s < seqMods->modCount; ++s)
+   {
+      vector<unsigned long long>& combinations = seqMods->combinations[s];
 
-   MOD_NUMBERS.push_back(modification);
+      combinations.resize(seqMods->combinationCounts[s]);
+      for (int c = 0; c < seqMods->combinationCounts[s]; ++c)
+         combinations[c] = getCombinationBitmask(seqMods->modBitmasks[s], c);
+   }
 
-// TIME_IN_COMBINE += duration(start);
-   return true;
+   seqMods->bCombinations = true;
 }
 
 
-// Generate all the modification combinations for the given sequence of modifiable amino acids.
-void ModificationsPermuter::generateModifications(string* sequence,
-                                                  int max_mods_per_mod,
-                                                  int* ret_modNumStart,
-                                                  int* ret_modNumCount,
-                                                  vector<string>& ALL_MODS,
-                                                  int MOD_CNT,
-                                                  int ALL_COMBINATION_CNT,
-                                                  unsigned long long* ALL_COMBINATIONS)
+// Bitmask of combination 'rank' of the residues set in modBitmask; the combinations are
+// in ascending order like the ALL_COMBINATIONS bitmasks within modBitmask.
+unsigned long long ModificationsPermuter::getCombinationBitmask(unsigned long long modBitmask,
+                                                                int rank)
 {
-   vector<unsigned long long> modBitmasks; // One entry in the vector for each user specified modification found in the sequence
-   vector<int> modIndices; // Indices in the ALL_MODS array of the modifications found in the given sequence
-   vector<int> combinationCounts; // Number of combinations that would be generated for each modification
-
-   *ret_modNumStart = -1;
-   *ret_modNumCount = 0;
+   std::bitset<64> x(modBitmask);
+   const unsigned long long combination = CombinatoricsUtils::getCombination((int)x.count(), MOD_NUMBER_MAX_MODS_PER_MOD, rank);
 
-   // Step 1: Get a bitmask representing each user specified modification found in the sequence.
-   for (int m = 0; m < MOD_CNT; ++m)
+   // bit b of the combination selects the b-th lowest bit set in modBitmask
+   unsigned long long bitmask = 0ULL;
+   for (int b = 0; modBitmask != 0; ++b)
    {
-      string sModChars = ALL_MODS[m];
+      const unsigned long long lowestBit = modBitmask & (~modBitmask + 1);
+      if (combination & (1ULL << b))
+         bitmask |= lowestBit;
+      modBitmask ^= lowestBit;
+   }
 
-      const unsigned long long bitmask = getModBitmask(sequence, sModChars); // Example: CMHQQQMK -> 01000010 (for modChar = 'M')
+   return bitmask;
+}
 
-      if (bitmask != 0)
-      {
-         std::bitset<64> x(bitmask);
-         unsigned long long bitCount = x.count();
 
-         if (ignorePeptidesWithTooManyMods() && bitCount > MAX_BITCOUNT)
-         {
-            IGNORED_SEQ_CNT++;
-            return; 
-         }
+// Decode modification number 'rank' of the modifiable sequence, i.e. its rank-th
+// combination in enumeration order: the combination sets in getCombinationSets order
+// and, within a set, the combinations of its modifications with the last modification
+// varying fastest, each modification's combinations in getCombinationBitmask order.
+// mods is set to the ALL_MODS index of the modification of each residue or -1.
+// Returns false if the combination places two modifications on the same residue; such
+// ranks do not stand for a modification number.
+bool ModificationsPermuter::getModificationNumber(const char* modSeq,
+                                                  int modSeqLen,
+                                                  int rank,
+                                                  char* mods)
+{
+   SequenceModifications seqMods;
 
-         int combinationCount = CombinatoricsUtils::getCombinationCount(int(bitCount), max_mods_per_mod); // nCk + nCk-1 +...+nC1
+   getSequenceModifications(modSeq, modSeqLen, &seqMods);
 
-         if (ignorePeptidesWithTooManyMods() && combinationCount > FRAGINDEX_MAX_COMBINATIONS)
-         {
-            IGNORED_SEQ_CNT++;
-            return;
-         }
+   return getModificationNumber(&seqMods, modSeqLen, rank, mods);
+}
 
-         modIndices.push_back(m);
 
-         modBitmasks.push_back(bitmask);
-         combinationCounts.push_back(combinationCount);
-      }
-   }
+// As above for the modifications of the sequence found by getSequenceModifications.
+bool ModificationsPermuter::getModificationNumber(const SequenceModifications* seqMods,
+                                                  int modSeqLen,
+                                                  int rank,
+                                                  char* mods)
+{
+   if (seqMods->modCount <= 0)
+      return false;
 
-   // Step 2: Generate all the bitmask combinations for each modification found in the sequence
-   int idx = 0;
-   unsigned long long ** combinationsForAllMods = new unsigned long long*[modIndices.size()];
-   // Iterate over the bitmasks for the modifications found in the given sequence
-   for (auto it = modBitmasks.begin(); it != modBitmasks.end(); ++it)
+   vector<vector<int>>& combinationSets = COMBINATION_SETS[seqMods->modCount];
+   for (vector<vector<int>>::iterator it = combinationSets.begin(); it != combinationSets.end(); ++it)
    {
-      unsigned long long modBitmask = *it; // bitmask for a modification
+      vector<int>& set = *it;
+      const int setSize = (int)set.size();
 
-      const int calculatedCombinationsCount = combinationCounts[idx]; // number of calculated possible combinations
+      long long combos = 1;
+      for (int j = 0; j < setSize && combos <= INT_MAX; ++j)
+         combos *= seqMods->combinationCounts[set[j]];
 
-      if (ignorePeptidesWithTooManyMods() && calculatedCombinationsCount > FRAGINDEX_MAX_COMBINATIONS)
+      if (rank >= combos)
       {
-         // If we are ignoring peptides with > FRAGINDEX_MAX_COMBINATIONS or reducing FRAGINDEX_MAX_MODS_PER_PEP to get the number of
-         // modified peptides withing the threshold, then the calculated combinations should not exceed FRAGINDEX_MAX_COMBINATIONS
-         cout << "ERROR: calculated combination count exceeds FRAGINDEX_MAX_COMBINATIONS (" << to_string(FRAGINDEX_MAX_COMBINATIONS) +
-            ") but FRAGINDEX_KEEP_ALL_PEPTIDES is set to " << to_string(FRAGINDEX_KEEP_ALL_PEPTIDES);
-         // TODO: exit here?
+         rank -= (int)combos;
+         continue;
       }
 
-      // Some peptides will have > MAX_COMBINATION modification combinations if we are
-      // considering all peptides. In this case, keep only up to FRAGINDEX_MAX_COMBINATIONS
-      int combinationsForModArrLen = FRAGINDEX_KEEP_ALL_PEPTIDES && calculatedCombinationsCount > FRAGINDEX_MAX_COMBINATIONS ? FRAGINDEX_MAX_COMBINATIONS : calculatedCombinationsCount;
-      unsigned long long *combinationsForMod = new unsigned long long[combinationsForModArrLen];
-
-      unsigned long long notMod = ~modBitmask;
-      // Iterate over the pre-computed bitmask combinations. Keep the ones where one or more of bits set in the given bitmask
-      // are also set in the combination bitmask.
-      // Example: for MGGMAVMK
-      // Bitmask for M: 10010010 (3 methionines)
-      // Possible bitmask combinations for the modification: 
-      // 00000010
-      // 00010000
-      // 00010010
-      // 10000000
-      // 10000010
-      // 10010000
-      // 10010010
-      int combinationsFound = 0;
-
-      for (int j = 0; j < ALL_COMBINATION_CNT; ++j)
+      // combination of each modification in the set
+      unsigned long long combinations[VMODS];
+      for (int j = setSize - 1; j >= 0; j--)
       {
-         if (combinationsFound >= FRAGINDEX_MAX_COMBINATIONS)
-            break;
+         const int s = set[j];
+         const int c = rank % seqMods->combinationCounts[s];
 
-         const unsigned long long combination = ALL_COMBINATIONS[j];
+         rank /= seqMods->combinationCounts[s];
 
-         if (combination > modBitmask)
-            break;
-
-         if ((combination & notMod) == 0) // Only the bits set in the modification bitmask should be set in the combination.
-            combinationsForMod[combinationsFound++] = combination;
+         if (seqMods->bCombinations)
+            combinations[j] = seqMods->combinations[s][c];
+         else
+            combinations[j] = getCombinationBitmask(seqMods->modBitmasks[s], c);
       }
-      if (combinationsFound != combinationsForModArrLen) // Number of combinations found should be the same as the expected number.
+
+      for (int j = 0; j < setSize; ++j)
       {
-         cout << "ERROR: Unexpected combination count; Found combination count " << to_string(combinationsFound) 
-              << "; Expected calculated count is " << to_string(combinationsForModArrLen) << "; sequence " << *sequence << endl;
+         for (int k = j+1; k < setSize; ++k)
+         {
+            // If any two modification combinations have the same bit set then this is not a valid combination.
+            // This can happen when more than one modification is defined on the same amino acid.
+            if ((combinations[j] & combinations[k]) != 0)
+               return false;
+         }
       }
-      combinationsForAllMods[idx++] = combinationsForMod;
-   }
 
-/*
-   if (DEBUG)
-   {
-      for (auto i = 0; i < (int)modBitmasks.size(); ++i)
+      for (int i = 0; i < modSeqLen; ++i)
       {
-         unsigned long long* bitmasks = combinationsForAllMods[i];
-         int combinationCount = combinationCounts[i];
-         for (int j = 0; j < combinationCount; ++j)
+         int idx = modSeqLen - i - 1;
+
+         mods[idx] = -1;
+         for (int j = 0; j < setSize; ++j)
          {
-            unsigned long long bitmask = bitmasks[j];
-            // cout << bitmasks.at(i) << " - ";
-            std::bitset<64> x(bitmask);
-            cout << "OK " << i << " " << x << endl;
+            // extract the i-th bit in the bitmask
+            if (combinations[j] & (1ULL << i))
+            {
+               mods[idx] = (char)seqMods->modIndices[set[j]];
+               break; // We found the modification at this index. Go to the next index.
+            }
          }
       }
+
+      return true;
    }
-*/
 
-   // Step 3: We have all the possible combinations for each modification. Combine them to generate modification numbers.
+   return false;
+}
+
 
-   vector<vector<int>> combinationSets = getCombinationSets(modIndices.size());
+// Number of modification numbers (including ranks that place two modifications on one
+// residue) of the modifiable sequence; -1 if it would have too many combinations.
+// Without FRAGINDEX_KEEP_ALL_PEPTIDES the count ends at the rank of the
+// FRAGINDEX_MAX_COMBINATIONS-th valid modification number.
+int ModificationsPermuter::getModificationNumberCount(const string* sequence)
+{
+   SequenceModifications seqMods;
+   int modSeqLen = (int)sequence->length();
 
-   const int combinationCount = getTotalCombinationCount(combinationCounts, combinationSets);
-   
-   if (combinationCount != -1)
+   getSequenceModifications(sequence->c_str(), modSeqLen, &seqMods);
+   if (seqMods.modCount <= 0)
+      return seqMods.modCount;
+
+   int combinationCount = getTotalCombinationCount(vector<int>(seqMods.combinationCounts, seqMods.combinationCounts + seqMods.modCount),
+         COMBINATION_SETS[seqMods.modCount]);
+
+   if (!ignorePeptidesWithTooManyMods() && combinationCount > FRAGINDEX_MAX_COMBINATIONS)
    {
-      int totalModNumCount = 0;
-      const int startModNum = MOD_NUM;
+      bool bOverlap = false;  // set if two modifications share a residue so some ranks are not valid
 
-      for (vector<vector<int>>::iterator it = combinationSets.begin(); it != combinationSets.end(); ++it)
+      for (int j = 0; j < seqMods.modCount; ++j)
       {
-         vector<int> set = *it;
-
-         const int modNumCount = set.size();
-         int* modIndicesToMerge = new int[modNumCount];
-         int* combinationCountsToMerge = new int[modNumCount];
-         int s = 0;
-         for (vector<int>::iterator set_it = set.begin(); set_it != set.end(); ++set_it)
+         for (int k = j+1; k < seqMods.modCount; ++k)
          {
-            const int set_el = *set_it;
-            modIndicesToMerge[s] = set_el;
-            combinationCountsToMerge[s] = combinationCounts.at(set_el);
-            s++;
+            if ((seqMods.modBitmasks[j] & seqMods.modBitmasks[k]) != 0)
+               bOverlap = true;
          }
-         
-         int *currIdx = new int[modNumCount]; // Current index for each modification
-         for (int i = 0; i < modNumCount; ++i)
-            currIdx[i] = 0;
+      }
 
-         int modNumCalculated = 0;
-         
-         while (true)
-         {
-            unsigned long long* toCombine = new unsigned long long[modNumCount];
+      if (!bOverlap)
+         return FRAGINDEX_MAX_COMBINATIONS;
 
-            int c = 0;
-            for (int i = 0; i < modNumCount; ++i)
-            {
-               const int modIdx = modIndicesToMerge[i];
-               unsigned long long* combinationsForModIdx = combinationsForAllMods[modIdx];
-               const int y = currIdx[i];
-               const unsigned long long combination = combinationsForModIdx[y];
-               toCombine[c++] = combination;
-            }
+      // Don't keep more than FRAGINDEX_MAX_COMBINATIONS modifications
+      char mods[MAX_PEPTIDE_LEN];
+      int validCount = 0;
+      int rank = 0;
 
-            int *modNumbers = new int[modNumCount]; // index of the modification in ALL_MODS
-            for (int k = 0; k < modNumCount; ++k)
-            {
-               modNumbers[k] = modIndices.at(modIndicesToMerge[k]);
-            }
-
-            if (combine(modNumbers, toCombine, modNumCount, (*sequence).length()))
-            {
-               modNumCalculated++;
-            }
+      getSequenceCombinations(&seqMods);
+      while (rank < combinationCount && validCount < FRAGINDEX_MAX_COMBINATIONS)
+      {
+         if (getModificationNumber(&seqMods, modSeqLen, rank, mods))
+            validCount++;
+         rank++;
+      }
+      combinationCount = rank;
+   }
 
-            delete[] modNumbers;
-            delete[] toCombine;
-            
-            int next = modNumCount - 1;
-            while (next >= 0 && (currIdx[next] == combinationCountsToMerge[next] - 1))
-            {
-               next--;
-            }
-            if (next < 0)
-               break; // We are done
+   return combinationCount;
+}
 
-            currIdx[next]++;  // Go on to the next element in the list
 
-            for (int i = next + 1; i < modNumCount; ++i)
-            {
-               currIdx[i] = 0;
-            }
-            if (FRAGINDEX_KEEP_ALL_PEPTIDES && totalModNumCount + modNumCalculated >= FRAGINDEX_MAX_COMBINATIONS)
-            {
-               break; // Don't keep more than FRAGINDEX_MAX_COMBINATIONS modifications
-            }
-         }
+// Set MOD_SEQ_MOD_NUM_START and MOD_SEQ_MOD_NUM_CNT.  Modifiable sequence i has
+// modification numbers MOD_SEQ_MOD_NUM_START[i] + r for r up to MOD_SEQ_MOD_NUM_CNT[i],
+// decoded by getModificationNumber(sequence i, r).  Returns the number of modification numbers.
+int ModificationsPermuter::getModificationNumberCounts(const vector<string>& modifiableSeqs)
+{
+   MOD_SEQ_MOD_NUM_START = new int[modifiableSeqs.size()];
+   MOD_SEQ_MOD_NUM_CNT = new int[modifiableSeqs.size()];
 
-//       if (DEBUG)
-//          cout << "merged" << endl;
+   int modNum = 0;
 
-         totalModNumCount += modNumCalculated;
+   for (size_t i = 0; i < modifiableSeqs.size(); ++i)
+   {
+      const int modNumCount = getModificationNumberCount(&(modifiableSeqs[i]));
 
-         delete[] currIdx;
-         delete[] modIndicesToMerge;
-         delete[] combinationCountsToMerge;
+      if (modNumCount > 0)
+      {
+         MOD_SEQ_MOD_NUM_START[i] = modNum;
+         MOD_SEQ_MOD_NUM_CNT[i] = modNumCount;
+         modNum += modNumCount;
+      }
+      else
+      {
+         if (modNumCount == -1)
+            IGNORED_SEQ_CNT++; // Number of possible combinations exceed the cutoff.
 
-         if (FRAGINDEX_KEEP_ALL_PEPTIDES && totalModNumCount >= FRAGINDEX_MAX_COMBINATIONS)
-            break; // Don't keep more than FRAGINDEX_MAX_COMBINATIONS modifications
+         MOD_SEQ_MOD_NUM_START[i] = -1;
+         MOD_SEQ_MOD_NUM_CNT[i] = 0;
       }
+   }
 
-      if (MOD_NUM != startModNum + totalModNumCount)
+   return modNum;
+}
+
+
+// Store the valid modification numbers of modifiable sequences tFirst up to tLast in
+// pArena.  MOD_SEQ_MOD_NUM_START is set relative to the start of pArena.
+void ModificationsPermuter::getModificationCombinationsThreadProc(const vector<string>* modifiableSeqs,
+                                                                  size_t tFirst,
+                                                                  size_t tLast,
+                                                                  ModificationNumberArena* pArena)
+{
+   SequenceModifications seqMods;
+
+   pArena->vullModNumberOffsets.push_back(0);
+   pArena->iIgnoredSeqCnt = 0;
+
+   for (size_t i = tFirst; i < tLast; ++i)
+   {
+      const string* sequence = &(modifiableSeqs->at(i));
+      const int modSeqLen = (int)sequence->length();
+      const int modNumCount = getModificationNumberCount(sequence);
+
+      MOD_SEQ_MOD_NUM_START[i] = -1;
+      MOD_SEQ_MOD_NUM_CNT[i] = 0;
+
+      if (modNumCount <= 0)
       {
-         cout << "Error: Unexpected end index: " + std::to_string(MOD_NUM) << "; Expected: " << std::to_string(startModNum + totalModNumCount) << endl;
+         if (modNumCount == -1)
+            pArena->iIgnoredSeqCnt++; // Number of possible combinations exceed the cutoff.
+         continue;
       }
 
-      *ret_modNumStart = startModNum;
-      *ret_modNumCount = totalModNumCount;
+      getSequenceModifications(sequence->c_str(), modSeqLen, &seqMods);
+      getSequenceCombinations(&seqMods);
 
-   }
-   else
-   {
-      IGNORED_SEQ_CNT++; // Number of possible combinations exceed the cutoff.
-   }
+      const int startModNum = (int)pArena->vullModNumberOffsets.size() - 1;
 
-   combinationSets.clear();
-   for (unsigned int i = 0; i < modIndices.size(); ++i) 
-   {
-      delete[] combinationsForAllMods[i];
-   }
-   delete[] combinationsForAllMods;
+      for (int rank = 0; rank < modNumCount; ++rank)
+      {
+         // append the modification number to the arena; ranks that place two mods on one residue are dropped
+         size_t tStart = pArena->vcModNumbers.size();
+         pArena->vcModNumbers.resize(tStart + modSeqLen);
 
-   modBitmasks.clear();
-   modIndices.clear();
-   combinationCounts.clear();
+         if (getModificationNumber(&seqMods, modSeqLen, rank, &(pArena->vcModNumbers[tStart])))
+            pArena->vullModNumberOffsets.push_back(pArena->vcModNumbers.size());
+         else
+            pArena->vcModNumbers.resize(tStart);
+      }
 
-// TIME_GEN_MODS += duration(startGenMods);
+      MOD_SEQ_MOD_NUM_START[i] = startModNum;
+      MOD_SEQ_MOD_NUM_CNT[i] = (int)pArena->vullModNumberOffsets.size() - 1 - startModNum;
+   }
 }
 
 
-void ModificationsPermuter::getModificationCombinations(const vector<string> modifiableSeqs,
-                                                        int max_mods_per_mod,
-                                                        vector<string>& ALL_MODS,
-                                                        int MOD_CNT,
-                                                        int ALL_COMBINATION_CNT,
-                                                        unsigned long long* ALL_COMBINATIONS)
+// Set MOD_NUMBERS, MOD_NUMBER_OFFSETS, MOD_SEQ_MOD_NUM_START and MOD_SEQ_MOD_NUM_CNT.
+// Modifiable sequence i has modification numbers MOD_SEQ_MOD_NUM_START[i] + r for r up
+// to MOD_SEQ_MOD_NUM_CNT[i], all valid.  Ranges of modifiable sequences are permuted in
+// parallel, each into its own arena, and the arenas are then concatenated in order so
+// the result does not depend on the number of threads.  Returns the number of
+// modification numbers.
+int ModificationsPermuter::getModificationCombinations(const vector<string>& modifiableSeqs,
+                                                       ThreadPool* tp)
 {
-   MOD_SEQ_MOD_NUM_START = new int[modifiableSeqs.size()];
-   MOD_SEQ_MOD_NUM_CNT = new int[modifiableSeqs.size()];
+   size_t tNumModSeqs = modifiableSeqs.size();
 
-   CombinatoricsUtils::initBinomialCoefficients(g_staticParams.options.peptideLengthRange.iEnd, MAX_K_VAL);
+   MOD_SEQ_MOD_NUM_START = new int[tNumModSeqs];
+   MOD_SEQ_MOD_NUM_CNT = new int[tNumModSeqs];
 
-   int i = 0;
-   for (auto it = modifiableSeqs.begin(); it != modifiableSeqs.end(); ++it)
+   // more ranges than threads as the number of permutations varies a lot between sequences
+   size_t tNumRanges = (size_t)(g_staticParams.options.iNumThreads > 1 ? g_staticParams.options.iNumThreads : 1) * 16;
+   if (tNumRanges > tNumModSeqs)
+      tNumRanges = (tNumModSeqs > 0 ? tNumModSeqs : 1);
+
+   vector<ModificationNumberArena> vArenas(tNumRanges);
+
+   for (size_t r = 0; r < tNumRanges; ++r)
    {
-      string modSeq = *it;
+      tp->doJob(std::bind(getModificationCombinationsThreadProc, &modifiableSeqs, tNumModSeqs * r / tNumRanges,
+            tNumModSeqs * (r + 1) / tNumRanges, &vArenas[r]));
+   }
+   tp->wait_on_threads();
 
-      int modNumStart = -1;
-      int modNumCount = 0;
+   size_t tNumModNumbers = 0;
+   size_t tNumModNumberBytes = 0;
 
-      int maxModsPerModForSeq = max_mods_per_mod;
+   for (size_t r = 0; r < tNumRanges; ++r)
+   {
+      tNumModNumbers += vArenas[r].vullModNumberOffsets.size() - 1;
+      tNumModNumberBytes += vArenas[r].vcModNumbers.size();
+   }
 
-      generateModifications(&modSeq, maxModsPerModForSeq, &modNumStart, &modNumCount, ALL_MODS, MOD_CNT, ALL_COMBINATION_CNT, ALL_COMBINATIONS);
+   MOD_NUMBERS.clear();
+   MOD_NUMBERS.reserve(tNumModNumberBytes);
+   MOD_NUMBER_OFFSETS.clear();
+   MOD_NUMBER_OFFSETS.reserve(tNumModNumbers + 1);
+   MOD_NUMBER_OFFSETS.push_back(0);
 
-      MOD_SEQ_MOD_NUM_START[i] = modNumStart;
-      MOD_SEQ_MOD_NUM_CNT[i] = modNumCount;
+   for (size_t r = 0; r < tNumRanges; ++r)
+   {
+      ModificationNumberArena& sArena = vArenas[r];
+      int iFirstModNum = (int)MOD_NUMBER_OFFSETS.size() - 1;
+      unsigned long long ullFirstByte = MOD_NUMBERS.size();
 
-      i++;
+      for (size_t i = tNumModSeqs * r / tNumRanges; i < tNumModSeqs * (r + 1) / tNumRanges; ++i)
+      {
+         if (MOD_SEQ_MOD_NUM_START[i] != -1)
+            MOD_SEQ_MOD_NUM_START[i] += iFirstModNum;
+      }
+
+      MOD_NUMBERS.insert(MOD_NUMBERS.end(), sArena.vcModNumbers.begin(), sArena.vcModNumbers.end());
+      for (size_t i = 1; i < sArena.vullModNumberOffsets.size(); ++i)
+         MOD_NUMBER_OFFSETS.push_back(ullFirstByte + sArena.vullModNumberOffsets[i]);
+
+      IGNORED_SEQ_CNT += sArena.iIgnoredSeqCnt;
+
+      vector<char>().swap(sArena.vcModNumbers);
+      vector<unsigned long long>().swap(sArena.vullModNumberOffsets);
    }
+
+   return (int)tNumModNumbers;
 }
@@ -19,6 +19,26 @@
 #include "Common.h"
 #include "CometDataInternal.h"
 
+// Variable mods found in a modifiable sequence by ModificationsPermuter::getSequenceModifications
+struct SequenceModifications
+{
+   int modCount;                          // number of mods found; -1 if the sequence has too many combinations
+   int modIndices[VMODS];                 // index in ALL_MODS of each mod found
+   unsigned long long modBitmasks[VMODS]; // residues each mod applies to (see getModBitmask)
+   int combinationCounts[VMODS];          // number of combinations of each mod's residues
+   bool bCombinations;                    // set if getSequenceCombinations set 'combinations'
+   vector<unsigned long long> combinations[VMODS];  // bitmask of every combination of each mod
+};
+
+// Modification numbers stored by one thread for a range of modifiable sequences;
+// modification number i is vcModNumbers from vullModNumberOffsets[i] up to vullModNumberOffsets[i+1].
+struct ModificationNumberArena
+{
+   vector<char> vcModNumbers;
+   vector<unsigned long long> vullModNumberOffsets;
+   int iIgnoredSeqCnt;
+};
+
 class ModificationsPermuter
 {
 public:
@@ -39,32 +59,40 @@ public:
    static vector<string> readPeptides(string file);
    static string getModifiableAas(std::string peptide,
                                   vector<string>& ALL_MODS);
-   static vector<string> getModifiableSequences(vector<PlainPeptideIndex>& vRawPeptides,
+   static vector<string> getModifiableSequences(const unsigned long long *pullPeptideOffsets,
+                                                const char *szPeptideResidues,
+                                                size_t tNumPeptides,
                                                 int* PEPTIDE_MOD_SEQ_IDXS,
                                                 vector<string>& ALL_MODS);
-   static unsigned long long getModBitmask(string* modSeq,
-                                           string sModChars);
+   static unsigned long long getModBitmask(const string* modSeq,
+                                                 string sModChars);
    static vector<vector<int>> getCombinationSets(int modCount);
    static int getTotalCombinationCount(vector<int> combinationCounts,
                                        vector<vector<int>> combinationSets);
-   static bool combine(int* modNumbers,
-                       unsigned long long* bitmasks,
-                       int modNumCount,
-                       int modStringLen);
-   static void generateModifications(string* sequence,
-                                     int max_mods_per_mod,
-                                     int* ret_modNumStart,
-                                     int* ret_modNumCount,
-                                     vector<string>& ALL_MODS,
-                                     int MOD_CNT,
-                                     int ALL_COMBINATION_CNT,
-                                     unsigned long long* ALL_COMBINATIONS);
-   static void getModificationCombinations(const vector<string> modifiableSeqs,
-                                           int max_mods_per_mod,
-                                           vector<string>& ALL_MODS,
-                                           int MOD_CNT,
-                                           int ALL_COMBINATION_CNT,
-                                           unsigned long long* ALL_COMBINATIONS);
+   static void initModificationNumbers(vector<string>& ALL_MODS,
+                                       int max_mods_per_mod);
+   static void getSequenceModifications(const char* modSeq,
+                                        int modSeqLen,
+                                        SequenceModifications* seqMods);
+   static void getSequenceCombinations(SequenceModifications* seqMods);
+   static unsigned long long getCombinationBitmask(unsigned long long modBitmask,
+                                                   int rank);
+   static bool getModificationNumber(const char* modSeq,
+                                     int modSeqLen,
+                                     int rank,
+                                     char* mods);
+   static bool getModificationNumber(const SequenceModifications* seqMods,
+                                     int modSeqLen,
+                                     int rank,
+                                     char* mods);
+   static int getModificationNumberCount(const string* sequence);
+   static int getModificationNumberCounts(const vector<string>& modifiableSeqs);
+   static void getModificationCombinationsThreadProc(const vector<string>* modifiableSeqs,
+                                                     size_t tFirst,
+                                                     size_t tLast,
+                                                     ModificationNumberArena* pArena);
+   static int getModificationCombinations(const vector<string>& modifiableSeqs,
+                                          ThreadPool* tp);
    static bool ignorePeptidesWithTooManyMods(void);
 
    ModificationsPermuter();
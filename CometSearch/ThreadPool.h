@@ -18,8 +18,8 @@
 #include <iostream>
 
 //#include "Threading.h"
-//#include <mutex>
-//#include <condition_variable>
+#include <mutex>
+#include <condition_variable>
 #include <deque>
 #include <vector>
 #include <functional>
@@ -66,6 +66,13 @@ unsigned int  threadStart(void* ptr);
 void* threadStart(void* ptr);
 #endif
 
+// thread_no of the calling pool thread; -1 in a thread not started by a ThreadPool
+inline int& threadPoolThreadNum()
+{
+   static thread_local int iThreadNum = -1;
+   return iThreadNum;
+}
+
 class ThreadPool
 {
 public:
@@ -166,6 +173,7 @@ public:
             // this->running_count_ ++;
 
             this->UNLOCK(&this->lock_);
+            this->notifySpace();
             // Do the job without holding any locks
             try
             {
@@ -200,6 +208,7 @@ public:
    void drainPool()
    {
       shutdown_ = true;
+      notifySpace();
       for (size_t i =0 ; i < data_.size(); i++)
       {
 #ifdef _WIN32
@@ -236,6 +245,45 @@ public:
       this->UNLOCK(&lock_);
    }
 
+   // Place a job on the queue but block the caller, without spinning, while
+   // iMaxQueued jobs are already waiting for a thread.  With no worker threads
+   // (num_threads = 1) nothing would ever drain the queue so run the job here.
+   void doJob (std::function <void (void)> func, size_t iMaxQueued)
+   {
+      if (threads_.empty())
+      {
+         func();
+         return;
+      }
+
+      std::unique_lock<std::mutex> lock(space_mutex_);
+      space_cv_.wait(lock, [this, iMaxQueued] { return shutdown_ || queuedJobs() < iMaxQueued; });
+      lock.unlock();
+
+      doJob(std::move(func));
+   }
+
+   size_t queuedJobs()
+   {
+      size_t tSize;
+      this->LOCK(&lock_);
+      tSize = jobs_.size();
+      this->UNLOCK(&lock_);
+
+      return tSize;
+   }
+
+   // Called after a job is taken off the queue to wake a blocked producer.
+   // space_mutex_ is taken so the wakeup can't land between the producer
+   // checking the queue size and going to sleep.
+   void notifySpace()
+   {
+      {
+         std::lock_guard<std::mutex> lock(space_mutex_);
+      }
+      space_cv_.notify_all();
+   }
+
    void incrementRunningCount()
    {
       this->LOCK(&countlock_);
@@ -250,6 +298,16 @@ public:
       this->UNLOCK(&countlock_);
    }
 
+   // Index of the calling thread: thread_no for the pool threads and threads_.size()
+   // for the thread queuing jobs, which also runs them in wait_on_threads() or
+   // in doJob() when there are no pool threads.
+   int getThreadIndex()
+   {
+      int i = threadPoolThreadNum();
+
+      return (i < 0 ? (int)threads_.size() : i);
+   }
+
    bool haveJob()
    {
      //return !jobs_.empty() || (running_count_ > 0);
@@ -320,6 +378,9 @@ public:
    std::vector<pthread_t> threads_;
 #endif
 
+   std::mutex space_mutex_;              // guards producers blocked in bounded doJob()
+   std::condition_variable space_cv_;    // signaled whenever a job leaves the queue
+
 };
 
 
@@ -335,6 +396,8 @@ inline void* threadStart(void* ptr)
    int i = data->thread_no;
    ThreadPool* tp = (ThreadPool*)data->tp;
    bool did_job = false;
+
+   threadPoolThreadNum() = i;
    while (1)
    {
       tp->LOCK(&tp->lock_);
@@ -393,6 +456,7 @@ inline void* threadStart(void* ptr)
             tp->running_count_ ++;
 
          tp->UNLOCK(&tp->lock_);
+         tp->notifySpace();
          // Do the job without holding any locks
          try
          {
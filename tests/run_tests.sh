@@ -0,0 +1,190 @@
+#!/bin/sh
+#
+# Round trip tests of the peptide index (.idx) and the fragment index.
+#
+# test.fasta is indexed with -i, then test.ms2 is searched through the .idx
+# once per configuration below, either mapping the .idx.frag file written
+# by -i or building the fragment index in memory without it.  Every search
+# must report exactly the same results as the first one, and the scan,
+# charge, peptide and protein of each result must match expected.txt.
+# The variable mods of comet.params include STY phospho and SK acetyl, which
+# overlap on serine.  compare_index checks that an .idx file created through
+# sorted run files is identical to one created in memory.
+#
+# usage:  sh run_tests.sh [comet executable]
+
+LC_ALL=C
+export LC_ALL
+
+TESTDIR=`cd "\`dirname "$0"\`" && pwd`
+COMET=${1:-$TESTDIR/../comet.exe}
+COMET=`cd "\`dirname "$COMET"\`" && pwd`/`basename "$COMET"`
+
+if [ ! -x "$COMET" ]
+then
+   echo " Error - cannot find comet executable $COMET"
+   exit 1
+fi
+
+WORKDIR=`mktemp -d "${TMPDIR:-/tmp}/comet_tests.XXXXXX"` || exit 1
+trap 'rm -rf "$WORKDIR"' EXIT
+
+cp "$TESTDIR/test.fasta" "$TESTDIR/test.ms2" "$WORKDIR" || exit 1
+cd "$WORKDIR" || exit 1
+
+NUMFAILED=0
+REFERENCE=
+
+# run_index:  create the index files with $NAME.params and search test.ms2
+# through the .idx, mapping the .idx.frag file (mapped) or building the
+# fragment index in memory (built), or search test.fasta through the .idx
+# file in peptide_index_cache_dir (cached)
+run_index()
+{
+   if [ "$MODE" = cached ]
+   then
+      "$COMET" -P$NAME.params -Dtest.fasta -N$NAME test.ms2 > $NAME.log 2>&1
+      return
+   fi
+
+   rm -f test.fasta.idx test.fasta.idx.frag
+
+   "$COMET" -P$NAME.params -i -Dtest.fasta > $NAME.log 2>&1 || return 1
+
+   if [ "$MODE" = built ]
+   then
+      rm -f test.fasta.idx.frag
+   fi
+
+   "$COMET" -P$NAME.params -Dtest.fasta.idx -N$NAME test.ms2 >> $NAME.log 2>&1
+}
+
+# compare_index <name> <sed expressions>:  create the .idx file with comet.params
+# edited by the sed expressions, once holding all digested peptides in memory and
+# once with a 1 MB peptide_index_memory budget, and compare the two files
+compare_index()
+{
+   NAME=$1
+   shift
+
+   sed "$@" "$TESTDIR/comet.params" > $NAME.params
+   sed "$@" -e "$RUNFILES" "$TESTDIR/comet.params" > ${NAME}_runs.params
+   rm -f test.fasta.idx test.fasta.idx.frag
+
+   if "$COMET" -P$NAME.params -i -Dtest.fasta > $NAME.log 2>&1 \
+         && mv test.fasta.idx $NAME.idx \
+         && "$COMET" -P${NAME}_runs.params -i -Dtest.fasta >> $NAME.log 2>&1
+   then
+      if cmp -s $NAME.idx test.fasta.idx
+      then
+         echo " passed $NAME"
+      else
+         echo " FAILED $NAME: .idx files differ"
+         NUMFAILED=`expr $NUMFAILED + 1`
+      fi
+   else
+      echo " FAILED $NAME: comet did not complete"
+      tail -20 $NAME.log
+      NUMFAILED=`expr $NUMFAILED + 1`
+   fi
+}
+
+# run_test <name> <mapped|built|cached> <sed expressions>:  search test.ms2 with
+# comet.params edited by the sed expressions and compare the results
+run_test()
+{
+   NAME=$1
+   MODE=$2
+   shift 2
+
+   if [ $# -eq 0 ]
+   then
+      cp "$TESTDIR/comet.params" $NAME.params
+   else
+      sed "$@" "$TESTDIR/comet.params" > $NAME.params
+   fi
+
+   if run_index && [ -f $NAME.txt ]
+   then
+      # the first line holds the version, date and file name of the search
+      tail -n +2 $NAME.txt | sort > $NAME.results
+      cut -f1,3,12,13,16 $NAME.results | sort > $NAME.expected
+
+      if ! cmp -s "$TESTDIR/expected.txt" $NAME.expected
+      then
+         echo " FAILED $NAME: results differ from expected.txt"
+         diff "$TESTDIR/expected.txt" $NAME.expected | head -20
+         NUMFAILED=`expr $NUMFAILED + 1`
+      elif [ -n "$REFERENCE" ] && ! cmp -s $REFERENCE.results $NAME.results
+      then
+         echo " FAILED $NAME: results differ from the $REFERENCE search"
+         diff $REFERENCE.results $NAME.results | head -20
+         NUMFAILED=`expr $NUMFAILED + 1`
+      else
+         echo " passed $NAME"
+      fi
+
+      REFERENCE=${REFERENCE:-$NAME}
+   else
+      echo " FAILED $NAME: comet did not complete"
+      tail -20 $NAME.log
+      NUMFAILED=`expr $NUMFAILED + 1`
+   fi
+}
+
+PRECURSORBINS='s/^fragindex_num_precursorbins = [0-9]*/fragindex_num_precursorbins = 37/'
+COMPRESSED='s/^fragindex_compress = [0-9]*/fragindex_compress = 1/'
+PRUNED='s/^fragindex_prune_precursors = [0-9]*/fragindex_prune_precursors = 1/'
+PARTITIONED='s/^fragindex_num_partitions = [0-9]*/fragindex_num_partitions = 4/'
+SHARED='s/^fragindex_share = [0-9]*/fragindex_share = 1/'
+RUNFILES='s/^peptide_index_memory = [0-9]*/peptide_index_memory = 1/'
+DECODED='s/^peptide_index_decode_mods = [0-9]*/peptide_index_decode_mods = 1/'
+SEMI='s/^num_enzyme_termini = [0-9]*/num_enzyme_termini = 1/'
+CACHE="s|^peptide_index_cache_dir = *#|peptide_index_cache_dir = $WORKDIR/cache #|"
+
+run_test mapped mapped
+run_test built built
+run_test precursor_bins mapped -e "$PRECURSORBINS"
+run_test mapped_compressed mapped -e "$COMPRESSED"
+run_test built_compressed built -e "$COMPRESSED"
+run_test pruned mapped -e "$PRUNED"
+run_test pruned_compressed mapped -e "$PRUNED" -e "$COMPRESSED"
+run_test partitioned mapped -e "$PARTITIONED"
+run_test partitioned_compressed mapped -e "$PARTITIONED" -e "$COMPRESSED"
+run_test shared built -e "$SHARED"
+run_test decoded_mods mapped -e "$DECODED"
+run_test decoded_mods_built built -e "$DECODED"
+compare_index run_files_semi -e "$SEMI"
+
+mkdir cache
+run_test cache_create cached -e "$CACHE"
+run_test cache_reuse cached -e "$CACHE"
+
+if ! grep -q "Using cached peptide index" cache_reuse.log
+then
+   echo " FAILED cache_reuse: the cached .idx file was not reused"
+   NUMFAILED=`expr $NUMFAILED + 1`
+fi
+
+# a search through an .idx created with other modifications must stop
+sed -e 's/^variable_mod03 = .*/variable_mod03 = 0.0 X 0 3 -1 0 0 0.0/' "$TESTDIR/comet.params" > params_mismatch.params
+rm -f test.fasta.idx test.fasta.idx.frag
+
+if "$COMET" -P"$TESTDIR/comet.params" -i -Dtest.fasta > params_mismatch.log 2>&1 \
+      && ! "$COMET" -Pparams_mismatch.params -Dtest.fasta.idx -Nparams_mismatch test.ms2 >> params_mismatch.log 2>&1 \
+      && grep -q "created with different digest/modification parameters" params_mismatch.log
+then
+   echo " passed params_mismatch"
+else
+   echo " FAILED params_mismatch: the search did not stop"
+   NUMFAILED=`expr $NUMFAILED + 1`
+fi
+
+if [ $NUMFAILED -ne 0 ]
+then
+   echo " $NUMFAILED test(s) failed"
+   exit 1
+fi
+
+echo " all tests passed"
+exit 0